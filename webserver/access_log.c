@@ -0,0 +1,337 @@
+/*
+ * access_log.c: Logs every response, without blocking the threads that serve
+ * them.
+ */
+
+#include <time.h>
+#include "common.h"
+#include "access_log.h"
+
+#define ACCESS_LOG_RING 8192		/* records per thread, a power of 2 */
+#define ACCESS_LOG_INTERVAL 20		/* ms between drains */
+#define ACCESS_LOG_BATCH 1024		/* records written at a time */
+#define ACCESS_LOG_LINE 160		/* longest CLF line */
+
+/* a single-producer, single-consumer ring. head is only written by the
+ * thread that owns the ring, tail only by the drain thread, and each is on
+ * a cache line of its own. */
+struct access_ring {
+	struct access_record rec[ACCESS_LOG_RING];
+	unsigned long head __attribute__((aligned(64)));
+	long dropped;		/* records that didn't fit */
+	unsigned long tail __attribute__((aligned(64)));
+	struct access_ring *next;	/* list of all threads' rings */
+};
+
+static const char *access_cache_names[NR_ACCESS_CACHE] = {
+	"-", "hit", "miss", "neg",
+};
+
+static int access_on;			/* logging, see access_log_record */
+static int access_fd = -1;
+static int access_format;
+static unsigned int access_threshold;	/* of a trace */
+static unsigned long access_epoch;	/* the realtime clock's ns, less the
+					 * monotonic clock's */
+/* rings are only added, under access_lock, and the drain thread walks the
+ * list without it */
+static struct access_ring *access_rings;
+static __thread struct access_ring *access_self;
+static pthread_mutex_t access_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t access_cond = PTHREAD_COND_INITIALIZER;
+static int access_exiting;		/* protected by access_lock */
+static pthread_t access_thread;
+/* statistics, only used by the drain thread */
+static long access_records;
+static int access_failed;		/* the log file can't be written */
+
+static unsigned long
+access_log_clock(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+unsigned long
+access_log_hash(const char *word)
+{
+	unsigned long hash = 5381;
+	int c;
+	while ((c = *word++))
+		hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+	return hash;
+}
+
+/* mixes the bits of hash, whose low bits are close for similar names */
+static unsigned long
+access_trace_mix(unsigned long hash)
+{
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdUL;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53UL;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+unsigned int
+access_trace_threshold(double rate)
+{
+	unsigned int threshold = rate * ACCESS_TRACE_SCALE + 0.5;
+
+	if (threshold < 1)
+		return 1;
+	return threshold > ACCESS_TRACE_SCALE ? ACCESS_TRACE_SCALE : threshold;
+}
+
+int
+access_trace_sampled(unsigned long hash, unsigned int threshold)
+{
+	/* the top 24 bits, i.e., out of ACCESS_TRACE_SCALE */
+	return (access_trace_mix(hash) >> 40) < threshold;
+}
+
+int
+access_log_format(char *buf, int size, const struct access_record *r,
+		  const char *file_name)
+{
+	char date[64], request[MAXLINE];
+	time_t sec = r->time / 1000000000UL;
+	struct tm tm;
+	int len;
+
+	localtime_r(&sec, &tm);
+	strftime(date, sizeof(date), "%d/%b/%Y:%H:%M:%S %z", &tm);
+	if (file_name)
+		snprintf(request, sizeof(request), "\"GET %s HTTP/1.%d\"",
+			 file_name[0] == '.' ? file_name + 1 : file_name,
+			 r->http11);
+	else if (r->path_hash)
+		snprintf(request, sizeof(request), "\"GET /#%016lx HTTP/1.%d\"",
+			 (unsigned long)r->path_hash, r->http11);
+	else
+		strcpy(request, "\"-\"");
+	len = snprintf(buf, size, "- - - [%s] %s %u %lu %u %s\n", date,
+		       request, r->status, (unsigned long)r->bytes, r->latency,
+		       r->cache < NR_ACCESS_CACHE ?
+		       access_cache_names[r->cache] : "?");
+	return len < size ? len : size - 1;
+}
+
+/* writes len bytes of buf to the log file. on an error, says so once, and
+ * drops the rest of the log, rather than stopping the server. */
+static void
+access_log_write(const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0 && !access_failed) {
+		n = write(access_fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "access log: %s\n", strerror(errno));
+			access_failed = 1;
+			return;
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+/* writes out what is in the rings. only the drain thread, or destroy once
+ * the thread is gone, calls this. */
+static void
+access_log_drain(void)
+{
+	static struct access_record batch[ACCESS_LOG_BATCH];
+	static struct access_trace_record trace[ACCESS_LOG_BATCH];
+	static char lines[ACCESS_LOG_BATCH * ACCESS_LOG_LINE];
+	struct access_ring *ring;
+	unsigned long head, tail;
+	int i, n, len;
+
+	ring = __atomic_load_n(&access_rings, __ATOMIC_ACQUIRE);
+	for (; ring; ring = ring->next) {
+		tail = ring->tail;
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		while (tail != head) {
+			n = head - tail < ACCESS_LOG_BATCH ? head - tail :
+				ACCESS_LOG_BATCH;
+			for (i = 0; i < n; i++)
+				batch[i] = ring->rec[(tail + i) &
+						     (ACCESS_LOG_RING - 1)];
+			/* the slots can be reused while the batch is
+			 * written */
+			tail += n;
+			__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+			access_records += n;
+			if (access_format == ACCESS_LOG_BINARY) {
+				access_log_write((char *)batch,
+						 n * sizeof(batch[0]));
+				continue;
+			}
+			if (access_format == ACCESS_LOG_TRACE) {
+				for (i = 0; i < n; i++) {
+					trace[i].path_hash = batch[i].path_hash;
+					trace[i].size = batch[i].bytes;
+				}
+				access_log_write((char *)trace,
+						 n * sizeof(trace[0]));
+				continue;
+			}
+			for (i = 0, len = 0; i < n; i++)
+				len += access_log_format(lines + len,
+							 ACCESS_LOG_LINE,
+							 &batch[i], NULL);
+			access_log_write(lines, len);
+		}
+	}
+}
+
+static void *
+do_access_log_thread(void *arg)
+{
+	struct timespec ts;
+
+	pthread_mutex_lock(&access_lock);
+	while (!access_exiting) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += ACCESS_LOG_INTERVAL * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&access_cond, &access_lock, &ts);
+		pthread_mutex_unlock(&access_lock);
+		access_log_drain();
+		pthread_mutex_lock(&access_lock);
+	}
+	pthread_mutex_unlock(&access_lock);
+	return NULL;
+}
+
+void
+access_log_init(const char *path, int format, double rate)
+{
+	struct access_log_header header;
+	struct access_trace_header trace;
+
+	access_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (access_fd < 0) {
+		fprintf(stderr, "access log: %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+	access_format = format;
+	if (format == ACCESS_LOG_BINARY) {
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, ACCESS_LOG_MAGIC, sizeof(header.magic));
+		header.version = ACCESS_LOG_VERSION;
+		header.record_size = sizeof(struct access_record);
+		access_log_write((char *)&header, sizeof(header));
+	} else if (format == ACCESS_LOG_TRACE) {
+		access_threshold = access_trace_threshold(rate);
+		memset(&trace, 0, sizeof(trace));
+		memcpy(trace.magic, ACCESS_TRACE_MAGIC, sizeof(trace.magic));
+		trace.version = ACCESS_TRACE_VERSION;
+		trace.record_size = sizeof(struct access_trace_record);
+		trace.threshold = access_threshold;
+		access_log_write((char *)&trace, sizeof(trace));
+	}
+	access_epoch = access_log_clock(CLOCK_REALTIME) -
+		access_log_clock(CLOCK_MONOTONIC);
+	access_exiting = 0;
+	SYS(pthread_create(&access_thread, NULL, do_access_log_thread, NULL));
+	access_on = 1;
+}
+
+void
+access_log_destroy(void)
+{
+	struct access_ring *ring, *next;
+	long dropped = 0;
+
+	if (!access_on)
+		return;
+	access_on = 0;
+	pthread_mutex_lock(&access_lock);
+	access_exiting = 1;
+	pthread_cond_signal(&access_cond);
+	pthread_mutex_unlock(&access_lock);
+	pthread_join(access_thread, NULL);
+	/* the servers are gone, so this gets the last records */
+	access_log_drain();
+	for (ring = access_rings; ring; ring = next) {
+		next = ring->next;
+		dropped += ring->dropped;
+		free(ring);
+	}
+	access_rings = NULL;
+	printf("access log: records = %ld, dropped = %ld\n", access_records,
+	       dropped);
+	SYS(close(access_fd));
+	access_fd = -1;
+}
+
+/* returns the calling thread's ring, which is set up on first use */
+static struct access_ring *
+access_log_ring(void)
+{
+	struct access_ring *ring = access_self;
+
+	if (ring)
+		return ring;
+	ring = aligned_alloc(64, sizeof(struct access_ring));
+	assert(ring);
+	ring->head = 0;
+	ring->tail = 0;
+	ring->dropped = 0;
+	pthread_mutex_lock(&access_lock);
+	ring->next = access_rings;
+	__atomic_store_n(&access_rings, ring, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&access_lock);
+	access_self = ring;
+	return ring;
+}
+
+void
+access_log_record(unsigned long start, const char *file_name, int status,
+		  long bytes, int cache, int http11)
+{
+	struct access_ring *ring;
+	struct access_record *r;
+	unsigned long head, latency, hash;
+
+	if (!access_on)
+		return;
+	hash = file_name ? access_log_hash(file_name) : 0;
+	/* a trace only has the files that were sent, from the cache or
+	 * not, and only the sampled ones */
+	if (access_format == ACCESS_LOG_TRACE &&
+	    (status != 200 || !hash ||
+	     (cache != ACCESS_HIT && cache != ACCESS_MISS) ||
+	     !access_trace_sampled(hash, access_threshold)))
+		return;
+	ring = access_log_ring();
+	head = ring->head;
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) ==
+	    ACCESS_LOG_RING) {
+		/* the drain thread is behind, e.g., on a slow disk. waiting
+		 * for it would hold up the client. */
+		__atomic_store_n(&ring->dropped, ring->dropped + 1,
+				 __ATOMIC_RELAXED);
+		return;
+	}
+	latency = (access_log_clock(CLOCK_MONOTONIC) - start) / 1000;
+	r = &ring->rec[head & (ACCESS_LOG_RING - 1)];
+	r->time = access_epoch + start;
+	r->path_hash = hash;
+	r->bytes = bytes;
+	r->latency = latency > UINT32_MAX ? UINT32_MAX : latency;
+	r->status = status;
+	r->cache = cache;
+	r->http11 = http11;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
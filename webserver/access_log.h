@@ -0,0 +1,112 @@
+#ifndef __ACCESS_LOG_H__
+#define __ACCESS_LOG_H__
+
+#include <stdint.h>
+
+/* Access log. Every response is logged as a fixed-size record, which the
+ * thread that served it puts in a ring of its own, without locks or system
+ * calls. A background thread drains the rings every 20 ms,
+ * and writes the records to the log file, either as they are (binary), or
+ * in Common Log Format, with the latency and cache outcome appended.
+ *
+ * Logging never blocks a thread that serves requests: if the log file
+ * can't keep up, e.g., on a slow disk, a thread whose ring is full drops
+ * its records, and counts them. Records are in time order per thread, but
+ * not across threads.
+ *
+ * Records don't hold the file name, only its hash (see access_log_hash),
+ * which the decoder (access_log_decode.c) can map back to names given a
+ * list of them, e.g., the fileset's index.
+ *
+ * The log can also be a trace of the files served, for the cache simulator
+ * (cache_sim.c): only the hash and size of each file that was sent, and
+ * only for a sample of the files, picked by their hash, as in SHARDS
+ * (Waldspurger et al., FAST '15). Every request for a sampled file is kept,
+ * so a cache that is rate times smaller sees the sample as a cache of the
+ * full size sees the whole trace. */
+
+#define ACCESS_LOG_MAGIC "ACCESSLG"
+#define ACCESS_LOG_VERSION 1
+
+/* a binary log is this header, followed by records */
+struct access_log_header {
+	char magic[8];		/* ACCESS_LOG_MAGIC */
+	uint32_t version;
+	uint32_t record_size;
+};
+
+#define ACCESS_TRACE_MAGIC "ACCESSTR"
+#define ACCESS_TRACE_VERSION 1
+#define ACCESS_TRACE_SCALE (1 << 24)	/* see access_trace_sampled */
+
+/* a trace is this header, followed by trace records */
+struct access_trace_header {
+	char magic[8];		/* ACCESS_TRACE_MAGIC */
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t threshold;	/* files sampled, out of
+				 * ACCESS_TRACE_SCALE */
+	uint32_t unused;
+};
+
+/* how the response was served */
+enum access_cache {
+	ACCESS_NONE,		/* not a file, e.g., a bad request */
+	ACCESS_HIT,		/* from the file cache */
+	ACCESS_MISS,		/* from disk, or an error about the file */
+	ACCESS_NEGATIVE,	/* an error from the negative cache */
+	NR_ACCESS_CACHE
+};
+
+/* in host byte order */
+struct access_record {
+	uint64_t time;		/* ns since the epoch, when the request
+				 * started */
+	uint64_t path_hash;	/* of the file name, 0 if there is none */
+	uint64_t bytes;		/* of the response, header included */
+	uint32_t latency;	/* us, from the start of the request until
+				 * the server was done with it */
+	uint16_t status;	/* e.g., 200 */
+	uint8_t cache;		/* enum access_cache */
+	uint8_t http11;		/* the request was HTTP/1.1 */
+};
+
+/* in host byte order */
+struct access_trace_record {
+	uint64_t path_hash;
+	uint64_t size;		/* of the response, header included */
+};
+
+enum access_log_format {
+	ACCESS_LOG_BINARY,
+	ACCESS_LOG_CLF,
+	ACCESS_LOG_TRACE,
+};
+
+/* starts logging to the file at path, which is truncated. exits if it
+ * can't be opened. a trace samples rate of the files, 0 < rate <= 1, the
+ * other formats ignore rate. */
+void access_log_init(const char *path, int format, double rate);
+/* writes out what is left in the rings, and stops logging */
+void access_log_destroy(void);
+
+unsigned long access_log_hash(const char *file_name);
+
+/* returns the threshold that samples rate of the files */
+unsigned int access_trace_threshold(double rate);
+/* returns 1 if a trace with threshold keeps the file with hash. a file
+ * sampled at a threshold is sampled at every larger one, too. */
+int access_trace_sampled(unsigned long hash, unsigned int threshold);
+
+/* formats r as a line of Common Log Format into buf, with the file's name,
+ * if file_name isn't NULL, or else its hash, as the path. returns its
+ * length. */
+int access_log_format(char *buf, int size, const struct access_record *r,
+		      const char *file_name);
+
+/* logs a response to a request that started at start (see stats_now) for
+ * file_name, which may be NULL. does nothing unless the log is on. */
+void access_log_record(unsigned long start, const char *file_name,
+		       int status, long bytes, int cache, int http11);
+
+#endif /* __ACCESS_LOG_H__ */
@@ -0,0 +1,172 @@
+/*
+ * access_log_decode.c: Prints a binary access log (see access_log.h).
+ *
+ * To run:
+ *  access_log_decode [-c] [-x index] [log]
+ *
+ *  -c: print Common Log Format, as the server's -L would have, rather than
+ *      a table
+ *  -x: map path hashes back to file names, given the fileset's index (e.g.,
+ *      fileset_dir.idx). other files are printed as their hash.
+ *
+ * Reads the log from stdin if no log is given.
+ */
+
+#include <time.h>
+#include "common.h"
+#include "access_log.h"
+
+struct name {
+	unsigned long hash;
+	char *file_name;
+};
+
+static struct name *names;
+static int nr_names;
+
+static void
+usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-c] [-x index] [log]\n", program);
+	exit(1);
+}
+
+static int
+name_cmp(const void *a, const void *b)
+{
+	unsigned long x = ((struct name *)a)->hash;
+	unsigned long y = ((struct name *)b)->hash;
+
+	return x < y ? -1 : x > y;
+}
+
+/* reads the names in a fileset index, see file_index_load */
+static void
+load_names(const char *idx_file)
+{
+	FILE *fp;
+	char name[MAXLINE], file_name[MAXLINE];
+	unsigned int csum;
+	int len, nr_files, size = 0;
+
+	fp = fopen(idx_file, "r");
+	if (!fp || fscanf(fp, "%d", &nr_files) != 1) {
+		fprintf(stderr, "%s: can't read index\n", idx_file);
+		exit(1);
+	}
+	while (fscanf(fp, "%8191s %u %d", name, &csum, &len) == 3) {
+		if (nr_names == size) {
+			size = size ? size * 2 : 256;
+			names = realloc(names, size * sizeof(struct name));
+			assert(names);
+		}
+		/* the server prefixes every uri with ./, see
+		 * request_parse_URI. a name too long for that is never
+		 * asked for. */
+		if (snprintf(file_name, sizeof(file_name), "./%s", name) >=
+		    (int)sizeof(file_name))
+			continue;
+		names[nr_names].hash = access_log_hash(file_name);
+		names[nr_names].file_name = strdup(file_name);
+		nr_names++;
+	}
+	fclose(fp);
+	qsort(names, nr_names, sizeof(struct name), name_cmp);
+}
+
+static const char *
+find_name(unsigned long hash)
+{
+	struct name key = { hash, NULL }, *n;
+
+	if (!hash || !nr_names)
+		return NULL;
+	n = bsearch(&key, names, nr_names, sizeof(struct name), name_cmp);
+	return n ? n->file_name : NULL;
+}
+
+static void
+print_record(const struct access_record *r, int clf)
+{
+	static const char *cache_names[NR_ACCESS_CACHE] = {
+		"-", "hit", "miss", "neg",
+	};
+	const char *file_name = find_name(r->path_hash);
+	char buf[2 * MAXLINE], date[32];
+	time_t sec = r->time / 1000000000UL;
+	struct tm tm;
+
+	if (clf) {
+		access_log_format(buf, sizeof(buf), r, file_name);
+		fputs(buf, stdout);
+		return;
+	}
+	localtime_r(&sec, &tm);
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+	printf("%s.%06lu %10u %3u %10lu %4s %s ", date,
+	       (unsigned long)(r->time % 1000000000UL) / 1000, r->latency,
+	       r->status, (unsigned long)r->bytes,
+	       r->cache < NR_ACCESS_CACHE ? cache_names[r->cache] : "?",
+	       r->http11 ? "HTTP/1.1" : "HTTP/1.0");
+	if (file_name)
+		printf("%s\n", file_name);
+	else if (r->path_hash)
+		printf("#%016lx\n", (unsigned long)r->path_hash);
+	else
+		printf("-\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct access_log_header header;
+	struct access_record r;
+	FILE *fp = stdin;
+	long n = 0;
+	int clf = 0, c;
+
+	while ((c = getopt(argc, argv, "cx:")) != -1) {
+		switch (c) {
+		case 'c':
+			clf = 1;
+			break;
+		case 'x':
+			load_names(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind > 1)
+		usage(argv[0]);
+	if (argc - optind == 1) {
+		fp = fopen(argv[optind], "r");
+		if (!fp) {
+			fprintf(stderr, "%s: %s\n", argv[optind],
+				strerror(errno));
+			exit(1);
+		}
+	}
+	if (fread(&header, sizeof(header), 1, fp) != 1 ||
+	    memcmp(header.magic, ACCESS_LOG_MAGIC, sizeof(header.magic)) != 0) {
+		fprintf(stderr, "not a binary access log\n");
+		exit(1);
+	}
+	if (header.version != ACCESS_LOG_VERSION ||
+	    header.record_size != sizeof(struct access_record)) {
+		fprintf(stderr, "access log version %u, with %u byte records, "
+			"is not supported\n", header.version,
+			header.record_size);
+		exit(1);
+	}
+	if (!clf)
+		printf("%-26s %10s %3s %10s %4s %-8s %s\n", "time", "latency_us",
+		       "st", "bytes", "hit", "version", "path");
+	while (fread(&r, sizeof(r), 1, fp) == 1) {
+		print_record(&r, clf);
+		n++;
+	}
+	if (!clf)
+		fprintf(stderr, "%ld records\n", n);
+	return 0;
+}
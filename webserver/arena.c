@@ -0,0 +1,52 @@
+/*
+ * arena.c: A bump allocator for per-request objects.
+ */
+
+#include "common.h"
+#include "arena.h"
+
+#define ARENA_ALIGN 16
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+void
+arena_init(struct arena *a)
+{
+	a->used = 0;
+	a->chunks = NULL;
+}
+
+void *
+arena_alloc(struct arena *a, size_t size)
+{
+	struct arena_chunk *chunk;
+	size_t aligned = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+	if (aligned <= ARENA_SIZE - a->used) {
+		void *p = a->buf + a->used;
+
+		a->used += aligned;
+		return p;
+	}
+	/* a long URI, say. rare enough that malloc is fine */
+	chunk = Malloc(sizeof(struct arena_chunk) + size);
+	chunk->next = a->chunks;
+	a->chunks = chunk;
+	return chunk->data;
+}
+
+void
+arena_reset(struct arena *a)
+{
+	struct arena_chunk *chunk, *next;
+
+	for (chunk = a->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+	a->chunks = NULL;
+	a->used = 0;
+}
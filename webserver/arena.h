@@ -0,0 +1,34 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+/* A bump allocator for objects that live as long as one request.
+ *
+ * Allocations are carved out of a buffer inside the arena, and are all freed
+ * at once by arena_reset, so serving a request needn't call malloc or free
+ * at all. An arena is only used by one thread at a time: a worker thread
+ * owns one in threads mode, and each connection owns one in epoll mode,
+ * where a loop has many requests in flight. Allocations that don't fit in
+ * the buffer fall back to malloc, and are freed by arena_reset too. */
+
+#include <stddef.h>
+
+#define ARENA_SIZE 2048		/* fits a request with a typical URI */
+
+struct arena_chunk;
+
+struct arena {
+	char buf[ARENA_SIZE] __attribute__((aligned(16)));
+	size_t used;			/* bytes of buf handed out */
+	struct arena_chunk *chunks;	/* allocations that didn't fit */
+};
+
+void arena_init(struct arena *a);
+
+/* returns size bytes, aligned like malloc's, that last until the next
+ * arena_reset */
+void *arena_alloc(struct arena *a, size_t size);
+
+/* frees everything allocated from a */
+void arena_reset(struct arena *a);
+
+#endif /* __ARENA_H__ */
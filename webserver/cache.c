@@ -0,0 +1,774 @@
+/*
+ * cache.c: The web server's in-memory file cache, shared by the thread pool
+ * (server_thread.c) and event loop (server_event.c) front ends.
+ */
+
+#include "common.h"
+#include "request.h"
+#include "cache.h"
+#include "slab.h"
+
+/* Some function declarations */
+static int cache_evict(Cache *c, CacheShard *s);
+
+#define TABLE_MIN_SIZE 16	/* chains per shard, a power of 2 */
+#define TABLE_MAX_LOAD 2	/* grow beyond 2 entries per chain on average */
+#define TABLE_MIN_LOAD 8	/* shrink below 1 entry per 8 chains */
+#define REHASH_STEP 4		/* chains moved per insert or eviction */
+
+#define pnode_entry(n) \
+	((CacheNode *)((char *)(n) - offsetof(CacheNode, pnode)))
+
+static unsigned long hash_func(const char *word) {
+	unsigned long hash = 5381;
+	int c;
+	while ((c = *word++))
+		hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+	return hash;
+}
+
+/* the low bits of the hash pick the shard, the rest pick the chain */
+static CacheShard *cache_shard(Cache *c, unsigned long hash) {
+	return &c->shards[hash % c->nr_shards];
+}
+
+static CacheNode **cache_chain(Cache *c, CacheTable *t, unsigned long hash) {
+	return &t->array[(hash / c->nr_shards) & t->mask];
+}
+
+static int cache_rehashing(CacheShard *s) {
+	return s->rehash_idx >= 0;
+}
+
+// compares the full hashes first, so that strcmp only runs on a match
+static CacheNode *linear_search(CacheNode *head, unsigned long hash,
+				char *word){
+	while (head) {
+		if (head->pnode.hash == hash &&
+		    strcmp(word, head->data->file_name) == 0)
+			return head;
+		head = head->next;
+	}
+	return NULL;
+}
+
+// searches the shard's table, and the table being resized, if any
+static CacheNode *cache_find(Cache *c, CacheShard *s, unsigned long hash,
+			     char *word) {
+	CacheNode *entry = linear_search(*cache_chain(c, &s->table, hash),
+					 hash, word);
+	if (!entry && cache_rehashing(s))
+		entry = linear_search(*cache_chain(c, &s->old_table, hash),
+				      hash, word);
+	return entry;
+}
+
+static void table_init(CacheTable *t, unsigned long size) {
+	t->array = (CacheNode **)calloc(size, sizeof(CacheNode *));
+	assert(t->array);
+	t->mask = size - 1;
+}
+
+// moves up to nr_chains chains of the old table over to the new one.
+// must be called with the shard locked for writing.
+static void cache_rehash(Cache *c, CacheShard *s, int nr_chains) {
+	CacheTable *old = &s->old_table;
+
+	while (cache_rehashing(s) && nr_chains-- > 0) {
+		CacheNode *entry = old->array[s->rehash_idx];
+		while (entry) {
+			CacheNode *next = entry->next;
+			CacheNode **chain = cache_chain(c, &s->table,
+							entry->pnode.hash);
+			entry->next = *chain;
+			*chain = entry;
+			entry = next;
+		}
+		old->array[s->rehash_idx] = NULL;
+		if ((unsigned long)++s->rehash_idx > old->mask) {
+			free(old->array);
+			old->array = NULL;
+			s->rehash_idx = -1;
+		}
+	}
+}
+
+// moves the shard along with any resize in progress, and starts a new one
+// when the table is too full or too empty.
+// must be called with the shard locked for writing.
+static void cache_resize(Cache *c, CacheShard *s) {
+	unsigned long size;
+
+	cache_rehash(c, s, REHASH_STEP);
+	if (cache_rehashing(s))
+		return;
+	size = s->table.mask + 1;
+	if (s->nr_entries > size * TABLE_MAX_LOAD)
+		size *= 2;
+	else if (size > TABLE_MIN_SIZE && s->nr_entries < size / TABLE_MIN_LOAD)
+		size /= 2;
+	else
+		return;
+	s->old_table = s->table;
+	table_init(&s->table, size);
+	s->rehash_idx = 0;
+}
+
+void
+cache_init(Cache *c, int max_cache_size, int policy)
+{
+	cache_init_shards(c, max_cache_size, policy, CACHE_SHARDS);
+}
+
+void
+cache_init_shards(Cache *c, int max_cache_size, int policy, int nr_shards)
+{	
+	pthread_rwlockattr_t attr;
+	int i;
+
+	assert(nr_shards > 0);
+	c->nr_shards = nr_shards;
+	c->policy = policy;
+	c->shards = aligned_alloc(64, sizeof(CacheShard) * nr_shards);
+	assert(c->shards);
+	// lookups are much more common than inserts, don't let them starve
+	// the writers
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr,
+		PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	for (i = 0; i < nr_shards; i++) {
+		CacheShard *s = &c->shards[i];
+
+		pthread_rwlock_init(&s->lock, &attr);
+		// initialize hash table, it grows as needed
+		table_init(&s->table, TABLE_MIN_SIZE);
+		s->old_table.array = NULL;
+		s->old_table.mask = 0;
+		s->rehash_idx = -1;
+		s->nr_entries = 0;
+		s->policy = policy_init(policy);
+		pthread_mutex_init(&s->flight_lock, NULL);
+		s->flights = NULL;
+		s->hits = 0;
+		s->misses = 0;
+		s->hit_bytes = 0;
+		s->miss_bytes = 0;
+		s->evictions = 0;
+		s->evicted_bytes = 0;
+		s->waits = 0;
+		s->coalesced = 0;
+		s->coalesced_bytes = 0;
+		s->generation = 0;
+		s->invalidations = 0;
+		s->stale = 0;
+	}
+	pthread_rwlockattr_destroy(&attr);
+	// entries are charged for all of their memory, so the budget is
+	// the memory that the cache may take up
+	c->max_cache_size = max_cache_size;
+	c->current_cache_size = 0;
+	c->slab = slab_init(max_cache_size);
+	c->no_room = 0;
+	c->evict_hand = 0;
+	c->copies = 0;
+	c->copied_bytes = 0;
+	return;
+}
+
+/* backs the cache's memory with huge pages, see slab_use_hugepages. returns
+ * 0 on success. */
+int
+cache_use_hugepages(Cache *c)
+{
+	return slab_use_hugepages(c->slab);
+}
+
+static void
+cache_node_free(Cache *c, CacheNode *entry)
+{
+	// the entry, its file_data and the file are all in the block
+	if (slab_contains(c->slab, entry)) {
+		slab_free(c->slab, entry);
+		return;
+	}
+	// shared by cache_load_done without being cached
+	file_data_free(entry->data);
+	free(entry);
+}
+
+/* drops a reference, freeing the entry if it was the last one */
+static void
+cache_unref(Cache *c, CacheNode *entry)
+{
+	int refcount = __atomic_sub_fetch(&entry->refcount, 1, __ATOMIC_ACQ_REL);
+
+	assert(refcount >= 0);
+	if (refcount == 0)
+		cache_node_free(c, entry);
+}
+
+/* Searches the hashtable for file_data of file_name. On a hit, returns the
+ * entry pinned for the caller, who must call cache_release() once done with
+ * entry->data. The data must not be modified. */
+CacheNode *cache_lookup(Cache *c, char *file_name) {
+
+	// if the word is empty, ignore
+	if (file_name[0] == '\0') return NULL;
+
+	// hash outside the lock
+	unsigned long hash = hash_func(file_name);
+	CacheShard *s = cache_shard(c, hash);
+
+	pthread_rwlock_rdlock(&s->lock);
+
+	CacheNode *element = cache_find(c, s, hash, file_name);
+	if (element) {
+		// the entry can't be unlinked while we hold the lock, so
+		// the cache's reference keeps it alive
+		__atomic_fetch_add(&element->refcount, 1, __ATOMIC_RELAXED);
+		policy_hit(s->policy, &element->pnode);
+		__atomic_fetch_add(&s->hits, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&s->hit_bytes, element->data->file_size,
+				   __ATOMIC_RELAXED);
+	} else {
+		__atomic_fetch_add(&s->misses, 1, __ATOMIC_RELAXED);
+	}
+
+	pthread_rwlock_unlock(&s->lock);
+	return element;
+}
+
+/* Returns the size of file_name if it is cached, or -1. Unlike a lookup,
+ * this doesn't pin the entry, or count as a hit or a miss. */
+int cache_file_size(Cache *c, char *file_name) {
+	if (file_name[0] == '\0') return -1;
+
+	unsigned long hash = hash_func(file_name);
+	CacheShard *s = cache_shard(c, hash);
+	int size = -1;
+
+	pthread_rwlock_rdlock(&s->lock);
+	CacheNode *element = cache_find(c, s, hash, file_name);
+	if (element) size = element->data->file_size;
+	pthread_rwlock_unlock(&s->lock);
+	return size;
+}
+
+static void
+cache_flight_free(CacheFlight *f)
+{
+	pthread_cond_destroy(&f->cond);
+	free(f);
+}
+
+// counts a miss that waited for another's load, and got entry from it
+static void
+cache_count_wait(CacheShard *s, CacheNode *entry)
+{
+	__atomic_fetch_add(&s->waits, 1, __ATOMIC_RELAXED);
+	if (entry) {
+		__atomic_fetch_add(&s->coalesced, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&s->coalesced_bytes, entry->data->file_size,
+				   __ATOMIC_RELAXED);
+	}
+}
+
+// With the shard's flight_lock held, after a lookup of file_name missed:
+// returns the load of file_name in progress, if there is one. Otherwise,
+// returns NULL, with the entry pinned in *entry if a load has finished since
+// the lookup, or else with a new load registered in *flight.
+static CacheFlight *
+cache_flight_get(Cache *c, CacheShard *s, unsigned long hash, char *file_name,
+		 CacheNode **entry, CacheFlight **flight)
+{
+	CacheFlight *f;
+
+	for (f = s->flights; f; f = f->next) {
+		if (f->hash == hash && strcmp(f->file_name, file_name) == 0)
+			return f;
+	}
+	// a load may have finished since the lookup missed
+	pthread_rwlock_rdlock(&s->lock);
+	*entry = cache_find(c, s, hash, file_name);
+	if (*entry)
+		__atomic_fetch_add(&(*entry)->refcount, 1, __ATOMIC_RELAXED);
+	pthread_rwlock_unlock(&s->lock);
+	if (!*entry) {
+		f = Malloc(sizeof(CacheFlight));
+		f->hash = hash;
+		f->file_name = file_name;
+		f->waiters = 0;
+		f->parked = NULL;
+		f->done = 0;
+		f->entry = NULL;
+		pthread_cond_init(&f->cond, NULL);
+		f->next = s->flights;
+		s->flights = f;
+		*flight = f;
+	}
+	return NULL;
+}
+
+/* Like cache_lookup, but coalesces concurrent misses on the same file. On a
+ * miss, if another thread is already loading the file, waits for it and
+ * returns its result, pinned for the caller. If the result couldn't be
+ * shared (the load failed, or the file is streamed from disk), returns NULL
+ * with *flight set to NULL, and the caller loads the file on its own.
+ * Otherwise, the caller is the first to miss: NULL is returned with *flight
+ * set, and the caller must load the file and then call cache_load_done(),
+ * even if the load fails, with file_name still valid until then. */
+CacheNode *cache_lookup_load(Cache *c, char *file_name, CacheFlight **flight) {
+	*flight = NULL;
+	CacheNode *entry = cache_lookup(c, file_name);
+	if (entry || file_name[0] == '\0') return entry;
+
+	unsigned long hash = hash_func(file_name);
+	CacheShard *s = cache_shard(c, hash);
+	CacheFlight *f;
+
+	pthread_mutex_lock(&s->flight_lock);
+	f = cache_flight_get(c, s, hash, file_name, &entry, flight);
+	if (f) {
+		// wait for the loader, the last one out frees the flight
+		f->waiters++;
+		while (!f->done)
+			pthread_cond_wait(&f->cond, &s->flight_lock);
+		entry = f->entry;
+		if (--f->waiters == 0)
+			cache_flight_free(f);
+		cache_count_wait(s, entry);
+	}
+	pthread_mutex_unlock(&s->flight_lock);
+	return entry;
+}
+
+/* Like cache_lookup_load, but never waits, for callers that must not block,
+ * e.g., event loops. If another thread is already loading the file, parks w
+ * on that load instead, and returns NULL with *parked set. The loader then
+ * calls w->done from cache_load_done, on its own thread, with the result
+ * pinned for the caller, or with NULL if the caller must load the file on
+ * its own. Until then, w must stay valid. */
+CacheNode *cache_lookup_park(Cache *c, char *file_name, CacheFlight **flight,
+			     CacheWaiter *w, int *parked) {
+	*flight = NULL;
+	*parked = 0;
+	CacheNode *entry = cache_lookup(c, file_name);
+	if (entry || file_name[0] == '\0') return entry;
+
+	unsigned long hash = hash_func(file_name);
+	CacheShard *s = cache_shard(c, hash);
+	CacheFlight *f;
+
+	pthread_mutex_lock(&s->flight_lock);
+	f = cache_flight_get(c, s, hash, file_name, &entry, flight);
+	if (f) {
+		w->next = f->parked;
+		f->parked = w;
+		*parked = 1;
+	}
+	pthread_mutex_unlock(&s->flight_lock);
+	return entry;
+}
+
+/* Finishes a load started by cache_lookup_load, and wakes up its waiters.
+ * file is the file that was loaded, or NULL if the load failed, and entry is
+ * what cache_insert returned for it. If the file is in memory but wasn't
+ * cached, and others are waiting for it, it is shared with them through an
+ * entry that is not in the cache, which takes ownership of file. Returns the
+ * entry, pinned for the caller, or NULL. */
+CacheNode *cache_load_done(Cache *c, CacheFlight *f, struct file_data *file,
+			   CacheNode *entry) {
+	CacheShard *s = cache_shard(c, f->hash);
+	CacheFlight **pprev;
+	CacheWaiter *parked, *w, *next;
+	int nr_waiters;
+
+	pthread_mutex_lock(&s->flight_lock);
+	for (pprev = &s->flights; *pprev != f; pprev = &(*pprev)->next)
+		assert(*pprev);
+	*pprev = f->next;
+
+	nr_waiters = f->waiters;
+	parked = f->parked;
+	for (w = parked; w; w = w->next)
+		nr_waiters++;
+	if (!entry && file && file->file_buf && nr_waiters > 0) {
+		// freed by the last cache_release, like an evicted entry
+		entry = Malloc(sizeof(CacheNode));
+		entry->data = file;
+		entry->refcount = 1;
+		entry->next = NULL;
+		entry->pnode.hash = f->hash;
+		entry->pnode.size = file->file_size;
+	}
+	if (entry)
+		__atomic_fetch_add(&entry->refcount, nr_waiters,
+				   __ATOMIC_RELAXED);
+	f->entry = entry;
+	f->done = 1;
+	pthread_cond_broadcast(&f->cond);
+	// only the waiters that block look at the flight once it is done
+	if (f->waiters == 0)
+		cache_flight_free(f);
+	pthread_mutex_unlock(&s->flight_lock);
+
+	// outside the lock, since the parked waiters may take locks of
+	// their own to pass their result on
+	for (w = parked; w; w = next) {
+		next = w->next;
+		cache_count_wait(s, entry);
+		w->done(w, entry);
+	}
+	return entry;
+}
+
+/* unpins an entry returned by cache_lookup, cache_lookup_load, cache_insert
+ * or cache_load_done */
+void cache_release(Cache *c, CacheNode *entry) {
+	cache_unref(c, entry);
+}
+
+/* Reserves num_bytes of the cache budget, evicting files from the shards in
+ * turn until the reservation fits. Returns 0 if it doesn't fit even with
+ * nothing left to evict, e.g., because the rest of the budget is reserved by
+ * concurrent inserts. */
+static int cache_reserve(Cache *c, int num_bytes) {
+	long needed;
+	int idle = 0;	// shards visited in a row with nothing to evict
+
+	needed = __atomic_add_fetch(&c->current_cache_size, num_bytes,
+				    __ATOMIC_SEQ_CST) - c->max_cache_size;
+	while (needed > 0) {
+		if (idle == c->nr_shards) {
+			__atomic_sub_fetch(&c->current_cache_size, num_bytes,
+					   __ATOMIC_SEQ_CST);
+			return 0;
+		}
+		// take one file from each shard in turn. only one shard
+		// lock is ever held at a time.
+		unsigned int i = __atomic_fetch_add(&c->evict_hand, 1,
+						    __ATOMIC_RELAXED);
+		CacheShard *s = &c->shards[i % c->nr_shards];
+		pthread_rwlock_wrlock(&s->lock);
+		int evicted = cache_evict(c, s);
+		pthread_rwlock_unlock(&s->lock);
+		idle = evicted ? 0 : idle + 1;
+		needed = __atomic_load_n(&c->current_cache_size,
+					 __ATOMIC_SEQ_CST) - c->max_cache_size;
+	}
+	return 1;
+}
+
+// copies file into the block at entry, see cache_insert
+static void cache_copy(Cache *c, CacheNode *entry, struct file_data *file,
+		       int header_len, int name_len) {
+	struct file_data *data = (struct file_data *)(entry + 1);
+	char *p = (char *)(data + 1);
+
+	*data = *file;
+	data->arena = NULL;
+	if (file->file_buf) {
+		data->file_buf = p;
+		memcpy(p, file->file_buf, file->file_size);
+		p += file->file_size;
+	}
+	if (file->file_header) {
+		data->file_header = p;
+		memcpy(p, file->file_header, header_len);
+		p += header_len;
+	}
+	data->file_name = p;
+	memcpy(p, file->file_name, name_len);
+	entry->data = data;
+	__atomic_fetch_add(&c->copies, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&c->copied_bytes,
+			   file->file_size + header_len + name_len,
+			   __ATOMIC_RELAXED);
+}
+
+/* Handles logic for file eviction as well. 
+	This is the only place cache_reserve is called.
+	On success, file is copied into the cache, and the new entry, which
+	holds the copy, is returned pinned for the caller. Returns NULL if the
+	file was not cached. Either way, the caller still owns file. */
+CacheNode *cache_insert(Cache *c, struct file_data *file){
+
+	unsigned long hash = hash_func(file->file_name);
+	CacheShard *s = cache_shard(c, hash);
+	int header_len = file->file_header ? file->file_header_len + 1 : 0;
+	int name_len = strlen(file->file_name) + 1;
+	size_t size = sizeof(CacheNode) + sizeof(struct file_data) +
+		file->file_size + header_len + name_len;
+	long charge = slab_block_size(size);
+
+	// the file was a miss
+	__atomic_fetch_add(&s->miss_bytes, file->file_size, __ATOMIC_RELAXED);
+
+	// check if there is enough space in the cache. streamed files are
+	// never small enough.
+	if (charge > c->max_cache_size) {
+		return NULL;
+	}
+	assert(file->file_buf || file->file_size == 0);
+
+	// and evict if necessary, only as much as is needed to make room
+	if (!cache_reserve(c, charge)) {
+		return NULL;
+	}
+	// even so, no free block may be large enough, because the free memory
+	// is in pieces, or evicted entries that are still pinned hold on to
+	// theirs. evicting more, in the policy's order, until one is would
+	// mostly empty the cache, so the file just isn't cached.
+	CacheNode *entry = slab_alloc(c->slab, size);
+	if (!entry) {
+		__atomic_fetch_add(&c->no_room, 1, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&c->current_cache_size, charge,
+				   __ATOMIC_SEQ_CST);
+		return NULL;
+	}
+	if (slab_size(entry) != (size_t)charge) {
+		// charge what the block really takes up
+		__atomic_add_fetch(&c->current_cache_size,
+				   slab_size(entry) - charge, __ATOMIC_SEQ_CST);
+		charge = slab_size(entry);
+	}
+	// outside the lock, which lookups would wait for
+	cache_copy(c, entry, file, header_len, name_len);
+
+	pthread_rwlock_wrlock(&s->lock);
+
+	// the file may have changed since we started reading it
+	if (file->cache_gen != s->generation) {
+		pthread_rwlock_unlock(&s->lock);
+		slab_free(c->slab, entry);
+		__atomic_sub_fetch(&c->current_cache_size, charge,
+				   __ATOMIC_SEQ_CST);
+		__atomic_fetch_add(&s->stale, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	// another worker may have inserted this file while we were reading it
+	if (cache_find(c, s, hash, file->file_name)) {
+		pthread_rwlock_unlock(&s->lock);
+		slab_free(c->slab, entry);
+		__atomic_sub_fetch(&c->current_cache_size, charge,
+				   __ATOMIC_SEQ_CST);
+		return NULL;
+	}
+
+	// initialize the new node, it holds the cache's and the caller's
+	// reference
+	CacheNode **chain = cache_chain(c, &s->table, hash);
+	entry->refcount = 2;
+	entry->next = *chain;
+	entry->pnode.hash = hash;
+	entry->pnode.size = charge;
+
+	// insert entry at the head of the chain
+	*chain = entry;
+	s->nr_entries++;
+	cache_resize(c, s);
+
+	policy_insert(s->policy, &entry->pnode);
+
+	pthread_rwlock_unlock(&s->lock);
+	return entry;
+}
+
+// unlinks an entry that the policy has let go of, and drops the cache's
+// reference. returns its size, i.e., what it was charged. must be called
+// with the shard locked for writing. entries that are still pinned by
+// readers are unlinked right away, but only freed by the last
+// cache_release()
+static int cache_unlink(Cache *c, CacheShard *s, CacheNode *entry){
+	// the entry is in one of the two tables
+	CacheNode **pprev = cache_chain(c, &s->table, entry->pnode.hash);
+	while (*pprev && *pprev != entry)
+		pprev = &(*pprev)->next;
+	if (!*pprev) {
+		assert(cache_rehashing(s));
+		pprev = cache_chain(c, &s->old_table, entry->pnode.hash);
+		while (*pprev != entry) {
+			assert(*pprev);
+			pprev = &(*pprev)->next;
+		}
+	}
+	*pprev = entry->next;
+	s->nr_entries--;
+	cache_resize(c, s);
+
+	int size = entry->pnode.size;
+	long total = __atomic_sub_fetch(&c->current_cache_size, size,
+					__ATOMIC_SEQ_CST);
+	assert(total >= 0);
+	cache_unref(c, entry);
+	return size;
+}
+
+// evicts the next victim of shard s's policy, and returns its size, or 0
+// if the shard is empty. must be called with the shard locked for writing.
+static int cache_evict(Cache *c, CacheShard *s){
+	struct policy_node *victim = policy_evict(s->policy);
+	if (!victim) return 0;
+
+	int evicted = cache_unlink(c, s, pnode_entry(victim));
+	__atomic_fetch_add(&s->evictions, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&s->evicted_bytes, evicted, __ATOMIC_RELAXED);
+	return evicted;
+}
+
+/* Returns the generation of file_name's shard. A miss reads it into the
+ * file's cache_gen before it looks at the file, so that cache_insert can
+ * tell whether the file was invalidated while it was being read. */
+unsigned long cache_generation(Cache *c, char *file_name) {
+	CacheShard *s = cache_shard(c, hash_func(file_name));
+
+	return __atomic_load_n(&s->generation, __ATOMIC_ACQUIRE);
+}
+
+/* Removes file_name from the cache, e.g., because the file changed on disk,
+ * and refuses the inserts of loads of it that are already under way.
+ * Readers that have the entry pinned finish sending the old copy. Returns 1
+ * if the file was cached. */
+int cache_invalidate(Cache *c, char *file_name) {
+	unsigned long hash = hash_func(file_name);
+	CacheShard *s = cache_shard(c, hash);
+
+	pthread_rwlock_wrlock(&s->lock);
+	__atomic_add_fetch(&s->generation, 1, __ATOMIC_RELEASE);
+	CacheNode *entry = cache_find(c, s, hash, file_name);
+	if (entry) {
+		policy_remove(s->policy, &entry->pnode);
+		cache_unlink(c, s, entry);
+		__atomic_fetch_add(&s->invalidations, 1, __ATOMIC_RELAXED);
+	}
+	pthread_rwlock_unlock(&s->lock);
+	return entry != NULL;
+}
+
+/* Like cache_invalidate, for every file, e.g., when the changes to the
+ * files are no longer known. */
+void cache_invalidate_all(Cache *c) {
+	for (int i = 0; i < c->nr_shards; ++i) {
+		CacheShard *s = &c->shards[i];
+		struct policy_node *victim;
+
+		pthread_rwlock_wrlock(&s->lock);
+		__atomic_add_fetch(&s->generation, 1, __ATOMIC_RELEASE);
+		while ((victim = policy_evict(s->policy))) {
+			cache_unlink(c, s, pnode_entry(victim));
+			__atomic_fetch_add(&s->invalidations, 1,
+					   __ATOMIC_RELAXED);
+		}
+		pthread_rwlock_unlock(&s->lock);
+	}
+}
+
+static void
+list_destroy(Cache *c, CacheNode *head) {
+	if(head == NULL) return;
+	if(head->next == NULL) {
+		cache_node_free(c, head);
+		return;
+	}
+	list_destroy(c, head->next);
+	cache_node_free(c, head);
+	return;
+}
+
+void
+cache_destroy(Cache *c)
+{
+	// loop through every shard
+	for (int i = 0; i < c->nr_shards; ++i) {
+		CacheShard *s = &c->shards[i];
+
+		// free each node
+		for (unsigned long j = 0; j <= s->table.mask; ++j)
+			list_destroy(c, s->table.array[j]);
+		free(s->table.array);
+		if (cache_rehashing(s)) {
+			for (unsigned long j = s->rehash_idx;
+			     j <= s->old_table.mask; ++j)
+				list_destroy(c, s->old_table.array[j]);
+			free(s->old_table.array);
+		}
+		policy_destroy(s->policy);
+		assert(!s->flights);
+		pthread_mutex_destroy(&s->flight_lock);
+		pthread_rwlock_destroy(&s->lock);
+	}
+	free(c->shards);
+	slab_destroy(c->slab);
+};
+
+// the shards are read without their locks, so the totals may be a little
+// out of date under load
+void
+cache_get_stats(Cache *c, struct cache_stats *st)
+{
+	struct slab_stats mem;
+
+	memset(st, 0, sizeof(*st));
+	for (int i = 0; i < c->nr_shards; ++i) {
+		CacheShard *s = &c->shards[i];
+
+		st->hits += __atomic_load_n(&s->hits, __ATOMIC_RELAXED);
+		st->misses += __atomic_load_n(&s->misses, __ATOMIC_RELAXED);
+		st->hit_bytes += __atomic_load_n(&s->hit_bytes,
+						 __ATOMIC_RELAXED);
+		st->miss_bytes += __atomic_load_n(&s->miss_bytes,
+						  __ATOMIC_RELAXED);
+		st->evictions += __atomic_load_n(&s->evictions,
+						 __ATOMIC_RELAXED);
+		st->evicted_bytes += __atomic_load_n(&s->evicted_bytes,
+						     __ATOMIC_RELAXED);
+		st->waits += __atomic_load_n(&s->waits, __ATOMIC_RELAXED);
+		st->coalesced += __atomic_load_n(&s->coalesced,
+						 __ATOMIC_RELAXED);
+		st->coalesced_bytes += __atomic_load_n(&s->coalesced_bytes,
+						       __ATOMIC_RELAXED);
+		st->invalidations += __atomic_load_n(&s->invalidations,
+						     __ATOMIC_RELAXED);
+		st->stale += __atomic_load_n(&s->stale, __ATOMIC_RELAXED);
+		st->entries += __atomic_load_n(&s->nr_entries,
+					       __ATOMIC_RELAXED);
+	}
+	st->size = __atomic_load_n(&c->current_cache_size, __ATOMIC_RELAXED);
+	st->max_size = c->max_cache_size;
+	slab_get_stats(c->slab, &mem);
+	st->resident = mem.resident;
+	st->no_room = __atomic_load_n(&c->no_room, __ATOMIC_RELAXED);
+}
+
+void
+cache_print_stats(Cache *c)
+{
+	struct cache_stats st;
+	struct slab_stats mem;
+
+	cache_get_stats(c, &st);
+	// a hit pins the entry and sends from it, so only inserts copy
+	printf("cache: hits = %ld, misses = %ld, hit bytes = %ld, "
+	       "hit copied bytes = 0, inserts = %ld, "
+	       "insert copied bytes = %ld, copied bytes per insert = %.2f\n",
+	       st.hits, st.misses, st.hit_bytes, c->copies, c->copied_bytes,
+	       c->copies ? (double)c->copied_bytes / c->copies : 0.0);
+	printf("policy: %s, hit ratio = %.4f, byte hit ratio = %.4f\n",
+	       policy_name(c->policy),
+	       st.hits + st.misses ?
+	       (double)st.hits / (st.hits + st.misses) : 0.0,
+	       st.hit_bytes + st.miss_bytes ?
+	       (double)st.hit_bytes / (st.hit_bytes + st.miss_bytes) : 0.0);
+	printf("single-flight: waits = %ld, disk reads avoided = %ld, "
+	       "bytes = %ld\n", st.waits, st.coalesced, st.coalesced_bytes);
+	slab_get_stats(c->slab, &mem);
+	printf("memory: charged = %ld, max = %ld, entries = %ld, "
+	       "blocks in use = %ld, resident = %ld, free blocks = %ld, "
+	       "largest free = %ld, not cached for want of a block = %ld\n",
+	       st.size, st.max_size, st.entries, mem.used, st.resident,
+	       mem.free_blocks, mem.largest_free, st.no_room);
+	if (st.invalidations || st.stale)
+		printf("invalidations = %ld, stale loads not cached = %ld\n",
+		       st.invalidations, st.stale);
+}
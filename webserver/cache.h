@@ -0,0 +1,159 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <pthread.h>
+#include "policy.h"
+
+struct file_data;
+struct slab;
+
+/* Cache Implementation */
+/* Cached file_data is immutable once inserted. A hit pins the entry by taking
+ * a reference, sends straight out of the cached buffer, and then drops the
+ * reference with cache_release(). The cache itself holds one reference while
+ * the entry is linked into the hash table, so an evicted entry is only freed
+ * once its last reader is done with it.
+ *
+ * The cache is split into shards by the hash of the file name, each with its
+ * own lock, hash chains and eviction policy (see policy.h), so that lookups of different files
+ * don't contend. Lookups only take a shard's lock for reading. The byte budget
+ * is global: an insert reserves its bytes up front, and evicts from any shard
+ * until the reservation fits.
+ *
+ * Each shard's hash table grows and shrinks with the number of entries it
+ * holds. A resize allocates the new table right away, but moves the entries
+ * over from the old table a few buckets at a time, on each insert and
+ * eviction, with lookups searching both tables in the meantime.
+ *
+ * Concurrent misses on the same file are coalesced (single flight): the
+ * first miss registers an in-flight load in the shard and reads the file,
+ * while later misses wait for it and share its result instead of reading the
+ * file again. A miss that must not block parks on the load instead, and the
+ * loader hands it the result when it is done (see cache_lookup_park).
+ *
+ * Entries can be invalidated, e.g., when their files change on disk. Each
+ * shard counts its invalidations in a generation number, which a miss reads
+ * before it starts reading the file (see cache_generation), and an insert
+ * whose shard has moved on since then is refused, so that a copy read before
+ * the change can't be cached after the invalidation.
+ *
+ * An entry is a single block of the cache's memory (see slab.h), which holds
+ * the CacheNode, its file_data, and a copy of the file's name, header and
+ * contents, so that each name is stored once, and every byte that the
+ * entry takes up, metadata included, is charged to the budget. */
+typedef struct CacheNode {
+	struct file_data *data;
+	int refcount;		// atomic
+	struct CacheNode *next;
+	struct policy_node pnode;	// eviction order, and the name's full
+					// hash, compared before the name
+} CacheNode;
+
+/* a miss parked on another's load, see cache_lookup_park */
+typedef struct CacheWaiter {
+	// called by the loader with the result, pinned for the waiter, or
+	// NULL if the waiter must load the file on its own
+	void (*done)(struct CacheWaiter *w, CacheNode *entry);
+	struct CacheWaiter *next;
+} CacheWaiter;
+
+/* a file being loaded after a miss, see cache_lookup_load */
+typedef struct CacheFlight {
+	unsigned long hash;
+	char *file_name;	// the loader's, valid until cache_load_done
+	int waiters;		// that block on cond
+	CacheWaiter *parked;	// that don't block
+	int done;
+	CacheNode *entry;	// the result, pinned once for each waiter
+	pthread_cond_t cond;
+	struct CacheFlight *next;
+} CacheFlight;
+
+typedef struct CacheTable {
+	CacheNode **array;	// hash chains
+	unsigned long mask;	// number of chains - 1, a power of 2 - 1
+} CacheTable;
+
+typedef struct CacheShard {
+	pthread_rwlock_t lock;
+	CacheTable table;	// new entries go here
+	CacheTable old_table;	// table being resized, if rehash_idx >= 0
+	long rehash_idx;	// next chain of old_table to move over
+	long nr_entries;
+	struct policy *policy;	// eviction order
+	pthread_mutex_t flight_lock;	// protects flights, taken before lock
+	CacheFlight *flights;	// loads in progress
+	unsigned long generation;	// invalidations so far, atomic
+	/* statistics, updated atomically */
+	long hits;
+	long misses;
+	long hit_bytes;		// bytes sent straight out of cached buffers
+	long miss_bytes;	// bytes of files offered to cache_insert
+	long evictions;
+	long evicted_bytes;
+	long waits;		// misses that waited for another's load
+	long coalesced;		// waits that shared the result, i.e., disk
+				// reads avoided
+	long coalesced_bytes;
+	long invalidations;	// entries removed by cache_invalidate
+	long stale;		// inserts refused after an invalidation
+} __attribute__((aligned(64))) CacheShard;
+
+typedef struct Cache {
+	CacheShard *shards;
+	int nr_shards;
+	int policy;	// enum policy_type
+	int max_cache_size;
+	long current_cache_size;	// atomic, includes reserved bytes
+	struct slab *slab;	// where the entries are
+	long no_room;	// atomic, inserts that fit the budget, but found no
+			// free block large enough
+	unsigned int evict_hand;	// next shard to evict from, atomic
+	long copies;	// atomic, files copied in by cache_insert. hits copy
+			// nothing, see cache_lookup
+	long copied_bytes;	// atomic, file, header and name bytes copied in
+} Cache;
+
+#define CACHE_SHARDS 64
+
+/* totals over all shards, see cache_get_stats */
+struct cache_stats {
+	long hits;
+	long misses;
+	long hit_bytes;
+	long miss_bytes;
+	long evictions;
+	long evicted_bytes;
+	long waits;
+	long coalesced;
+	long coalesced_bytes;
+	long invalidations;
+	long stale;
+	long entries;
+	long size;		// bytes cached or reserved
+	long max_size;
+	long resident;		// bytes of the cache's memory in RAM
+	long no_room;		// see Cache
+};
+
+void cache_init(Cache *c, int max_cache_size, int policy);
+void cache_init_shards(Cache *c, int max_cache_size, int policy,
+		       int nr_shards);
+void cache_destroy(Cache *c);
+int cache_use_hugepages(Cache *c);
+CacheNode *cache_lookup(Cache *c, char *file_name);
+CacheNode *cache_lookup_load(Cache *c, char *file_name, CacheFlight **flight);
+CacheNode *cache_lookup_park(Cache *c, char *file_name, CacheFlight **flight,
+			     CacheWaiter *w, int *parked);
+int cache_file_size(Cache *c, char *file_name);
+CacheNode *cache_insert(Cache *c, struct file_data *file);
+CacheNode *cache_load_done(Cache *c, CacheFlight *flight,
+			   struct file_data *file, CacheNode *entry);
+void cache_release(Cache *c, CacheNode *entry);
+unsigned long cache_generation(Cache *c, char *file_name);
+int cache_invalidate(Cache *c, char *file_name);
+void cache_invalidate_all(Cache *c);
+void cache_get_stats(Cache *c, struct cache_stats *st);
+void cache_print_stats(Cache *c);
+
+#endif /* __CACHE_H__ */
@@ -0,0 +1,154 @@
+/*
+ * cache_bench.c: Measures the throughput of cache lookups (cache_lookup and
+ * cache_release of a hit) as the number of threads grows, with the cache
+ * split into shards and with a single shard, i.e., a single lock.
+ */
+
+#include "common.h"
+#include "request.h"
+#include "cache.h"
+
+#define NAME_FMT "./fileset_dir/%05d"
+
+struct bench {
+	Cache *cache;
+	int nr_files;
+	int same_key;		/* all threads look up the same file */
+	long nr_lookups;	/* lookups done by each thread */
+	int seed;
+};
+
+static void *
+lookup_thread(void *arg)
+{
+	struct bench *b = (struct bench *)arg;
+	char name[64];
+	unsigned int seed = b->seed;
+	CacheNode *entry;
+	long i;
+	int fnr = 0;
+
+	for (i = 0; i < b->nr_lookups; i++) {
+		if (!b->same_key)
+			fnr = rand_r(&seed) % b->nr_files;
+		sprintf(name, NAME_FMT, fnr);
+		entry = cache_lookup(b->cache, name);
+		assert(entry);
+		cache_release(b->cache, entry);
+	}
+	return NULL;
+}
+
+/* fills the cache with nr_files small files */
+static void
+fill_cache(Cache *cache, int nr_files)
+{
+	struct file_data *data;
+	CacheNode *entry;
+	int i;
+
+	for (i = 0; i < nr_files; i++) {
+		data = file_data_init(NULL);
+		data->file_name = Malloc(64);
+		sprintf(data->file_name, NAME_FMT, i);
+		data->file_size = 1024;
+		data->file_buf = Malloc(data->file_size);
+		memset(data->file_buf, 'a', data->file_size);
+		entry = cache_insert(cache, data);
+		assert(entry);
+		cache_release(cache, entry);
+		file_data_free(data);
+	}
+}
+
+/* returns the number of lookups per second */
+static double
+run_bench(int policy, int nr_shards, int nr_threads, int nr_files,
+	  int same_key, long nr_lookups)
+{
+	Cache cache;
+	struct bench *b;
+	pthread_t *threads;
+	struct timeval start, end, diff;
+	double secs;
+	int i;
+
+	cache_init_shards(&cache, nr_files * 2048, policy, nr_shards);
+	fill_cache(&cache, nr_files);
+	b = Malloc(sizeof(struct bench) * nr_threads);
+	threads = Malloc(sizeof(pthread_t) * nr_threads);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < nr_threads; i++) {
+		b[i].cache = &cache;
+		b[i].nr_files = nr_files;
+		b[i].same_key = same_key;
+		b[i].nr_lookups = nr_lookups / nr_threads;
+		b[i].seed = i;
+		SYS(pthread_create(&threads[i], NULL, lookup_thread, &b[i]));
+	}
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	gettimeofday(&end, NULL);
+	timersub(&end, &start, &diff);
+	secs = diff.tv_sec + diff.tv_usec / 1e6;
+
+	cache_destroy(&cache);
+	free(threads);
+	free(b);
+	return nr_lookups / nr_threads * nr_threads / secs;
+}
+
+static void
+usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-c policy] [-f nr_files] [-n nr_lookups]\n",
+		program);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	int nr_files = 1000;
+	long nr_lookups = 4000000;
+	int shards[] = { 1, CACHE_SHARDS };
+	int policy = POLICY_LFF;
+	int c, i, j, same_key;
+
+	while ((c = getopt(argc, argv, "c:f:n:")) != -1) {
+		switch (c) {
+		case 'c':
+			policy = policy_parse(optarg);
+			if (policy < 0)
+				usage(argv[0]);
+			break;
+		case 'f':
+			nr_files = atoi(optarg);
+			break;
+		case 'n':
+			nr_lookups = atol(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc || nr_files <= 0 || nr_lookups <= 0) {
+		usage(argv[0]);
+	}
+
+	for (same_key = 0; same_key < 2; same_key++) {
+		for (j = 0; j < 2; j++) {
+			for (i = 1; i <= 32; i *= 2) {
+				printf("keys = %s, shards = %d, threads = %d, "
+				       "Mlookups/s = %.2f\n",
+				       same_key ? "same" : "random", shards[j],
+				       i, run_bench(policy, shards[j], i,
+						    nr_files, same_key,
+						    nr_lookups) / 1e6);
+			}
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,342 @@
+/*
+ * cache_sim.c: Replays a trace of the files the server sent (see the
+ * server's -T, and access_log.h) through the cache eviction policies (see
+ * policy.h), and prints their miss ratio curves, i.e., the miss ratio and
+ * byte miss ratio of the cache at each size, in one pass over the trace.
+ *
+ * To run:
+ *  cache_sim [-c policy[,policy...]] [-r rate] [-s min:max] [-n nr_sizes]
+ *            [trace]
+ *
+ *  -c: the policies to simulate, "lff", "lru", "clock", "s3fifo" or
+ *      "gdsf" (the default is all of them)
+ *  -r: sample rate of the files, out of those in the trace, for a faster,
+ *      rougher curve
+ *  -s: the smallest and largest cache sizes, in bytes (the default is from
+ *      64KB up to the size of all the files in the trace)
+ *  -n: the number of sizes, spaced evenly on a log scale (default 32)
+ *
+ * Reads the trace from stdin if no trace is given. Prints a line of
+ * "policy, cache size, miss ratio, byte miss ratio" per policy and size.
+ *
+ * Each cache is simulated at its size, scaled down by the rate at which
+ * the trace samples the files (SHARDS' miniature simulations), so a trace
+ * of 1% of the files is simulated with caches that are 100 times smaller.
+ * The sample should still hold a few hundred files, or more, for the
+ * curves to be close.
+ * Entries are charged the size of the response, header included, like the
+ * server's cache, less its metadata. The server splits its cache in shards,
+ * each with a policy of its own, the simulator doesn't (see the server's
+ * -S). The server also doesn't cache a file when no free block of its
+ * memory is large enough (see slab.h), which the simulator doesn't model
+ * either.
+ */
+
+#include "common.h"
+#include "policy.h"
+#include "access_log.h"
+
+#define SIM_MIN_SIZE (64 * 1024)
+#define SIM_NR_SIZES 32
+#define SIM_TABLE_MIN_SIZE 1024	/* chains, a power of 2 */
+
+struct sim_entry {
+	struct policy_node pnode;
+	struct sim_entry *next;	/* in its chain of the table */
+};
+
+#define pnode_entry(n) \
+	((struct sim_entry *)((char *)(n) - offsetof(struct sim_entry, pnode)))
+
+/* a cache of one size, with one policy */
+struct sim {
+	int policy_type;
+	long size;		/* of the cache that is simulated */
+	long capacity;		/* of the cache that the sample goes to */
+	long used;
+	struct policy *policy;
+	struct sim_entry **table;	/* by hash */
+	unsigned long mask;	/* chains - 1 */
+	long nr_entries;
+	long accesses;
+	long misses;
+	long bytes;
+	long miss_bytes;
+};
+
+static void
+usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-c policy[,policy...]] [-r rate] "
+		"[-s min:max] [-n nr_sizes] [trace]\n", program);
+	exit(1);
+}
+
+static void
+sim_init(struct sim *s, int policy_type, long size, long capacity)
+{
+	memset(s, 0, sizeof(struct sim));
+	s->policy_type = policy_type;
+	s->size = size;
+	s->capacity = capacity;
+	s->policy = policy_init(policy_type);
+	s->mask = SIM_TABLE_MIN_SIZE - 1;
+	s->table = calloc(s->mask + 1, sizeof(struct sim_entry *));
+	assert(s->table);
+}
+
+static void
+sim_destroy(struct sim *s)
+{
+	struct sim_entry *e, *next;
+	unsigned long i;
+
+	for (i = 0; i <= s->mask; i++) {
+		for (e = s->table[i]; e; e = next) {
+			next = e->next;
+			free(e);
+		}
+	}
+	free(s->table);
+	policy_destroy(s->policy);
+}
+
+/* doubles the table, once it holds more than 2 entries per chain */
+static void
+sim_grow(struct sim *s)
+{
+	unsigned long mask = s->mask * 2 + 1, i;
+	struct sim_entry **table, *e, *next;
+
+	table = calloc(mask + 1, sizeof(struct sim_entry *));
+	assert(table);
+	for (i = 0; i <= s->mask; i++) {
+		for (e = s->table[i]; e; e = next) {
+			next = e->next;
+			e->next = table[e->pnode.hash & mask];
+			table[e->pnode.hash & mask] = e;
+		}
+	}
+	free(s->table);
+	s->table = table;
+	s->mask = mask;
+}
+
+static struct sim_entry **
+sim_find(struct sim *s, unsigned long hash)
+{
+	struct sim_entry **pprev = &s->table[hash & s->mask];
+
+	while (*pprev && (*pprev)->pnode.hash != hash)
+		pprev = &(*pprev)->next;
+	return pprev;
+}
+
+/* drops an entry that the policy no longer holds */
+static void
+sim_unlink(struct sim *s, struct sim_entry *e)
+{
+	struct sim_entry **pprev = sim_find(s, e->pnode.hash);
+
+	assert(*pprev == e);
+	*pprev = e->next;
+	s->nr_entries--;
+	s->used -= e->pnode.size;
+	free(e);
+}
+
+/* a request for the file with hash, of size bytes. a file whose size has
+ * changed is a miss, as the server's cache would have dropped it. */
+static void
+sim_access(struct sim *s, unsigned long hash, long size)
+{
+	struct sim_entry **pprev = sim_find(s, hash), *e = *pprev;
+	struct policy_node *victim;
+
+	s->accesses++;
+	s->bytes += size;
+	if (e && e->pnode.size == size) {
+		policy_hit(s->policy, &e->pnode);
+		return;
+	}
+	s->misses++;
+	s->miss_bytes += size;
+	if (e) {
+		policy_remove(s->policy, &e->pnode);
+		sim_unlink(s, e);
+	}
+	if (size > s->capacity)
+		return;
+	/* evict as much as is needed to make room, see cache_reserve */
+	while (s->used + size > s->capacity) {
+		victim = policy_evict(s->policy);
+		assert(victim);
+		sim_unlink(s, pnode_entry(victim));
+	}
+	e = Malloc(sizeof(struct sim_entry));
+	memset(e, 0, sizeof(struct sim_entry));
+	e->pnode.hash = hash;
+	e->pnode.size = size;
+	e->next = s->table[hash & s->mask];
+	s->table[hash & s->mask] = e;
+	s->nr_entries++;
+	s->used += size;
+	policy_insert(s->policy, &e->pnode);
+	if (s->nr_entries > 2 * (long)(s->mask + 1))
+		sim_grow(s);
+}
+
+/* returns the records of a trace, and their number in nr_records. keeps
+ * the ones sampled at threshold, which is lowered to the trace's if it is
+ * smaller. */
+static struct access_trace_record *
+read_trace(FILE *fp, unsigned int *threshold, long *nr_records)
+{
+	struct access_trace_header header;
+	struct access_trace_record r, *records = NULL;
+	long n = 0, size = 0;
+
+	if (fread(&header, sizeof(header), 1, fp) != 1 ||
+	    memcmp(header.magic, ACCESS_TRACE_MAGIC,
+		   sizeof(header.magic)) != 0) {
+		fprintf(stderr, "not a trace, see the server's -T\n");
+		exit(1);
+	}
+	if (header.version != ACCESS_TRACE_VERSION ||
+	    header.record_size != sizeof(struct access_trace_record)) {
+		fprintf(stderr, "trace version %u, with %u byte records, "
+			"is not supported\n", header.version,
+			header.record_size);
+		exit(1);
+	}
+	if (header.threshold < *threshold)
+		*threshold = header.threshold;
+	while (fread(&r, sizeof(r), 1, fp) == 1) {
+		if (!access_trace_sampled(r.path_hash, *threshold))
+			continue;
+		if (n == size) {
+			size = size ? size * 2 : 4096;
+			records = realloc(records, size * sizeof(r));
+			assert(records);
+		}
+		records[n++] = r;
+	}
+	*nr_records = n;
+	return records;
+}
+
+/* parses a list of policies, and returns how many there are */
+static int
+parse_policies(char *list, int *types)
+{
+	char *name, *save;
+	int n = 0, type;
+
+	for (name = strtok_r(list, ",", &save); name;
+	     name = strtok_r(NULL, ",", &save)) {
+		type = policy_parse(name);
+		if (type < 0 || n == NR_POLICIES)
+			return -1;
+		types[n++] = type;
+	}
+	return n;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct access_trace_record *records;
+	unsigned int threshold = ACCESS_TRACE_SCALE;
+	int types[NR_POLICIES], nr_types = NR_POLICIES;
+	long min_size = SIM_MIN_SIZE, max_size = 0, nr_records, i;
+	int nr_sizes = SIM_NR_SIZES, nr_sims, j, c;
+	double rate;
+	struct sim all, *sims;
+	FILE *fp = stdin;
+
+	for (j = 0; j < NR_POLICIES; j++)
+		types[j] = j;
+	while ((c = getopt(argc, argv, "c:r:s:n:")) != -1) {
+		switch (c) {
+		case 'c':
+			nr_types = parse_policies(optarg, types);
+			if (nr_types <= 0)
+				usage(argv[0]);
+			break;
+		case 'r':
+			rate = atof(optarg);
+			if (rate <= 0 || rate > 1)
+				usage(argv[0]);
+			threshold = access_trace_threshold(rate);
+			break;
+		case 's':
+			if (sscanf(optarg, "%ld:%ld", &min_size,
+				   &max_size) != 2 || min_size <= 0 || max_size < min_size)
+				usage(argv[0]);
+			break;
+		case 'n':
+			nr_sizes = atoi(optarg);
+			if (nr_sizes < 1)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind > 1)
+		usage(argv[0]);
+	if (argc - optind == 1) {
+		fp = fopen(argv[optind], "r");
+		if (!fp) {
+			fprintf(stderr, "%s: %s\n", argv[optind],
+				strerror(errno));
+			exit(1);
+		}
+	}
+	records = read_trace(fp, &threshold, &nr_records);
+	rate = (double)threshold / ACCESS_TRACE_SCALE;
+
+	/* a cache that never evicts finds the size of all the files */
+	sim_init(&all, POLICY_LRU, 0, LONG_MAX);
+	for (i = 0; i < nr_records; i++)
+		sim_access(&all, records[i].path_hash, records[i].size);
+	fprintf(stderr, "%ld records, sampled at %.4f, %ld files, "
+		"%.0f bytes of files, compulsory miss ratio = %.4f\n",
+		nr_records, rate, all.nr_entries, all.used / rate,
+		nr_records ? (double)all.misses / nr_records : 0.0);
+	if (max_size == 0)
+		max_size = all.used / rate;
+	sim_destroy(&all);
+	if (max_size < min_size)
+		max_size = min_size;
+	if (min_size == max_size)
+		nr_sizes = 1;
+
+	/* all the caches see each record in turn */
+	nr_sims = nr_types * nr_sizes;
+	sims = Malloc(nr_sims * sizeof(struct sim));
+	for (j = 0; j < nr_sims; j++) {
+		int k = j % nr_sizes;
+		long size = nr_sizes == 1 ? min_size : min_size *
+			pow((double)max_size / min_size,
+			    (double)k / (nr_sizes - 1)) + 0.5;
+
+		sim_init(&sims[j], types[j / nr_sizes], size, size * rate);
+	}
+	for (i = 0; i < nr_records; i++)
+		for (j = 0; j < nr_sims; j++)
+			sim_access(&sims[j], records[i].path_hash,
+				   records[i].size);
+	for (j = 0; j < nr_sims; j++) {
+		struct sim *s = &sims[j];
+
+		printf("%s, %ld, %.4f, %.4f\n", policy_name(s->policy_type),
+		       s->size,
+		       s->accesses ? (double)s->misses / s->accesses : 0.0,
+		       s->bytes ? (double)s->miss_bytes / s->bytes : 0.0);
+		sim_destroy(s);
+	}
+	free(sims);
+	free(records);
+	return 0;
+}
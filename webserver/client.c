@@ -1,40 +1,48 @@
 /*
  * client.c: A multi-threaded client for testing the HTTP server.
- * 
+ *
+ * By default, each request uses a new connection. With -k, each thread keeps
+ * its connection open with HTTP/1.1 keep-alive, and with -p depth, it sends
+ * depth requests at a time before reading their responses.
  */
 
 #include "common.h"
+#include "csum.h"
 
 /* send an HTTP request for the specified file */
 static void
-client_send(int fd, char *host, char *filename)
+client_send(int fd, char *host, char *filename, int keepalive)
 {
 	char buf[MAXLINE];
 
-	/* create the request line */
-	sprintf(buf, "GET %s HTTP/1.0\r\n", filename);
+	/* create the request line. HTTP/1.1 connections are persistent. */
+	sprintf(buf, "GET %s HTTP/%s\r\n", filename, keepalive ? "1.1" : "1.0");
 	/* create one request header line for the server host, 
 	   and then the empty line */
 	sprintf(buf + strlen(buf), "host: %s\r\n\r\n", host);
 	Rio_write(fd, buf, strlen(buf));
 }
 
-/* read the HTTP response and print it out */
-static void
-client_print(int fd, unsigned int orig_csum, int orig_length, int print)
+/* read the HTTP response and print it out. on a persistent connection, only
+ * the response's Content-Length bytes are read, so that the rest is left in
+ * rio for the next response. returns 0 if the server closes the connection
+ * after this response. sets *rejected if the server turned the request away
+ * because it was overloaded. */
+static int
+client_print(struct rio *rio, unsigned int orig_csum, int orig_length,
+	     int print, int keepalive, int *rejected)
 {
-	struct rio *rio;
 	char buf[MAXBUF];
-	int i, n;
+	int n;
+	int status = 0;
 	int length = 0;
 	int length_received = 0;
 	unsigned int csum = 0;
 	unsigned int csum_received = 0;
-	
-	rio = Rio_init(fd);
 
 	/* read and display the HTTP header */
 	n = Rio_readlineb(rio, buf, MAXBUF);
+	sscanf(buf, "HTTP/%*d.%*d %d", &status);
 	while (strcmp(buf, "\r\n") && (n > 0)) {
 		if (print) {
 			printf("Header: %s", buf);
@@ -48,27 +56,38 @@ client_print(int fd, unsigned int orig_csum, int orig_length, int print)
 		if (sscanf(buf, "Content-Csum: %u ", &csum) == 1) {
 			/* found csum tag */
 		}
+		if (strncasecmp(buf, "Connection: close", 17) == 0) {
+			keepalive = 0;
+		}
 	}
 
 	fflush(stdout);
 	/* read and display the HTTP body */
 	do {
-		n = Rio_readlineb(rio, buf, MAXBUF);
+		if (keepalive) {
+			n = length - length_received;
+			n = Rio_readnb(rio, buf, (n < MAXBUF) ? n : MAXBUF);
+		} else {
+			n = Rio_readlineb(rio, buf, MAXBUF);
+		}
 		if (print) {
 			Rio_write(STDOUT_FILENO, buf, n);
 		}
 		length_received += n;
-		for (i = 0; i < n; i++) {
-			csum_received += (unsigned char)buf[i];
-		}
+		csum_received += csum_bytes(buf, n);
 	} while (n > 0);
 
+	*rejected = (status == 503);
+	if (*rejected) {
+		assert(length == length_received);
+		return keepalive;
+	}
 	assert(orig_csum == csum);
 	assert(orig_length == length);
 
 	assert(length == length_received);
 	assert(csum == csum_received);
-	Rio_destroy(rio);
+	return keepalive;
 }
 
 struct fileinfo {
@@ -85,47 +104,140 @@ struct client {
 	struct fileinfo *fileset;
 	int nr_files;
 	int timing_mode;
+	int keepalive;	/* reuse connections */
+	int depth;	/* requests sent at a time on a connection */
 };
 
-/* open a single connection to the specified host and port */
+/* what each client thread measured */
+struct client_thread {
+	struct client *cl;
+	pthread_t thread;
+	double *latency;	/* of each request that was served, in s */
+	int nr_served;
+	int nr_rejected;	/* requests the server turned away */
+};
+
+static double
+now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* open a connection to the specified host and port, and send it requests.
+ * unless keepalive is set, each request gets its own connection. */
 static void *
 client_request(void *arg)
 {
-	struct client *cl = (struct client *)arg;
-	int clientfd;
-	int i;
+	struct client_thread *ct = (struct client_thread *)arg;
+	struct client *cl = ct->cl;
+	int clientfd = -1;
+	struct rio *rio = NULL;
+	int *fnr;
+	int i, j, batch, open, rejected;
+	double sent;
 
-	for (i = 0; i < cl->nr_times; i++) {
-		int fnr;
-
-		clientfd = open_clientfd(cl->host, cl->port);
-		/* get a random file from the file set */
-		/* we used to use a self similar distribution but that allowed
-		 * using simplistic caching policies. Now we use a uniform
-		 * distribution. */
-		/* fnr = rand_self_similar_int(0.2, cl->nr_files); */
-		fnr = rand_int(cl->nr_files);		
-		fnr--;
-		/* for debugging */
-		// fprintf(stderr, "requesting file: %s\n", 
-		// cl->fileset[fnr].name);
-		client_send(clientfd, cl->host, cl->fileset[fnr].name);
-		/* when timing_mode is 1, then don't print anything */
-		client_print(clientfd, cl->fileset[fnr].csum, 
-			     cl->fileset[fnr].len, (cl->timing_mode == 0));
+	fnr = Malloc(sizeof(int) * cl->depth);
+	ct->latency = Malloc(sizeof(double) * cl->nr_times);
+	ct->nr_served = 0;
+	ct->nr_rejected = 0;
+	for (i = 0; i < cl->nr_times; i += batch) {
+		batch = cl->nr_times - i;
+		if (clientfd < 0) {
+			clientfd = open_clientfd(cl->host, cl->port);
+			rio = Rio_init(clientfd);
+			/* only pipeline once the server has kept the
+			 * connection open, otherwise it may reset the
+			 * connection with requests still unread */
+			batch = 1;
+		}
+		if (batch > cl->depth)
+			batch = cl->depth;
+		/* pipeline a batch of requests, then read the responses */
+		sent = now_sec();
+		for (j = 0; j < batch; j++) {
+			/* get a random file from the file set */
+			/* we used to use a self similar distribution but that
+			 * allowed using simplistic caching policies. Now we use
+			 * a uniform distribution. */
+			/* fnr = rand_self_similar_int(0.2, cl->nr_files); */
+			fnr[j] = rand_int(cl->nr_files) - 1;
+			/* for debugging */
+			// fprintf(stderr, "requesting file: %s\n", 
+			// cl->fileset[fnr[j]].name);
+			client_send(clientfd, cl->host, cl->fileset[fnr[j]].name,
+				    cl->keepalive);
+		}
+		open = cl->keepalive;
+		for (j = 0; j < batch; j++) {
+			/* when timing_mode is 1, then don't print anything */
+			open = client_print(rio, cl->fileset[fnr[j]].csum,
+					    cl->fileset[fnr[j]].len,
+					    (cl->timing_mode == 0),
+					    cl->keepalive, &rejected) && open;
+			if (rejected)
+				ct->nr_rejected++;
+			else
+				ct->latency[ct->nr_served++] = now_sec() - sent;
+		}
+		if (!open) {
+			Rio_destroy(rio);
+			SYS(close(clientfd));
+			clientfd = -1;
+		}
+	}
+	if (clientfd >= 0) {
+		Rio_destroy(rio);
 		SYS(close(clientfd));
 	}
+	free(fnr);
 	return NULL;
 }
 
 static void
 usage(char *program)
 {
-	fprintf(stderr, "Usage: %s [-t] host port nr_times nr_threads fileset\n",
-		program);
+	fprintf(stderr, "Usage: %s [-t] [-k] [-p depth] host port nr_times "
+		"nr_threads fileset\n", program);
 	exit(1);
 }
 
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* prints the mean and 99th percentile of the threads' request latencies,
+ * and how many requests were turned away */
+static void
+print_latency(struct client_thread *ct, int nr_threads)
+{
+	double *all, sum = 0;
+	int i, n = 0, rejected = 0;
+
+	for (i = 0; i < nr_threads; i++)
+		n += ct[i].nr_served;
+	all = Malloc(sizeof(double) * (n ? n : 1));
+	for (n = 0, i = 0; i < nr_threads; i++) {
+		memcpy(all + n, ct[i].latency,
+		       sizeof(double) * ct[i].nr_served);
+		n += ct[i].nr_served;
+		rejected += ct[i].nr_rejected;
+	}
+	qsort(all, n, sizeof(double), cmp_double);
+	for (i = 0; i < n; i++)
+		sum += all[i];
+	printf(", mean latency = %.3f ms, p99 latency = %.3f ms, "
+	       "rejected = %d", n ? sum / n * 1e3 : 0,
+	       n ? all[(int)(0.99 * (n - 1))] * 1e3 : 0, rejected);
+	free(all);
+}
+
 /* filename should have a list of files to be requested, one per line */
 static void
 init_fileset(char *filename, struct client *cl)
@@ -172,20 +284,37 @@ main(int argc, char *argv[])
 {
 	int i;
 	char *filename;
-	pthread_t *threads;
+	struct client_thread *ct;
 	struct client cl;
 	struct timeval start, end, diff;
+	int c;
 
-	if (argc != 6 && argc != 7) {
-		usage(argv[0]);
+	cl.timing_mode = 0;
+	cl.keepalive = 0;
+	cl.depth = 1;
+	while ((c = getopt(argc, argv, "tkp:")) != -1) {
+		switch (c) {
+		case 't':
+			cl.timing_mode = 1;
+			break;
+		case 'k':
+			cl.keepalive = 1;
+			break;
+		case 'p':
+			/* pipelining needs a persistent connection */
+			cl.keepalive = 1;
+			cl.depth = atoi(optarg);
+			if (cl.depth <= 0)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
 	}
-	i = 1;
-	if (strcmp(argv[i], "-t") == 0) {
-		cl.timing_mode = 1;
-		i++;
-	} else {
-		cl.timing_mode = 0;
+	if (argc - optind != 5) {
+		usage(argv[0]);
 	}
+	i = optind;
 	cl.host = argv[i++];
 	cl.port = atoi(argv[i++]);
 	cl.nr_times = atoi(argv[i++]);
@@ -203,20 +332,25 @@ main(int argc, char *argv[])
 
 	init_random();
 
-	threads = Malloc(sizeof(pthread_t) * cl.nr_threads);
+	ct = Malloc(sizeof(struct client_thread) * cl.nr_threads);
 	for (i = 0; i < cl.nr_threads; i++) {
-		SYS(pthread_create(&threads[i], NULL, client_request,
-				   (void *)&cl));
+		ct[i].cl = &cl;
+		SYS(pthread_create(&ct[i].thread, NULL, client_request,
+				   (void *)&ct[i]));
 	}
 	for (i = 0; i < cl.nr_threads; i++) {
-		pthread_join(threads[i], NULL);
+		pthread_join(ct[i].thread, NULL);
 	}
 
 	if (cl.timing_mode) {
 		gettimeofday(&end, NULL);
 		timersub(&end, &start, &diff);
-		printf("client runtime = %.6f seconds\n",
+		/* scripts take the runtime from the fourth field, so the
+		 * latencies go after it */
+		printf("client runtime = %.6f seconds",
 			(float)diff.tv_sec + (float)diff.tv_usec / 1000000);
+		print_latency(ct, cl.nr_threads);
+		printf("\n");
 	}
 	exit(0);
 }
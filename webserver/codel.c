@@ -0,0 +1,100 @@
+/*
+ * codel.c: CoDel-style admission control for the connection queue.
+ */
+
+#include <math.h>
+#include "common.h"
+#include "codel.h"
+
+void
+codel_init(struct codel *q, unsigned long target, unsigned long interval)
+{
+	pthread_mutex_init(&q->lock, NULL);
+	q->target = target;
+	q->interval = interval;
+	q->first_above = 0;
+	q->drop_next = 0;
+	q->dropping = 0;
+	q->count = 0;
+	q->lastcount = 0;
+	q->shed = 0;
+	q->admitted = 0;
+}
+
+void
+codel_destroy(struct codel *q)
+{
+	pthread_mutex_destroy(&q->lock);
+}
+
+/* the next shedding time, sooner the more have been shed */
+static unsigned long
+codel_control_law(struct codel *q, unsigned long t)
+{
+	return t + q->interval / sqrt(q->count);
+}
+
+/* returns whether sojourn times have been above target for an interval */
+static int
+codel_above(struct codel *q, unsigned long sojourn, unsigned long now)
+{
+	if (sojourn < q->target) {
+		q->first_above = 0;
+		return 0;
+	}
+	if (q->first_above == 0) {
+		q->first_above = now + q->interval;
+		return 0;
+	}
+	return now >= q->first_above;
+}
+
+int
+codel_dequeue(struct codel *q, unsigned long sojourn, unsigned long now)
+{
+	int above, shed = 0;
+	unsigned int delta;
+
+	pthread_mutex_lock(&q->lock);
+	above = codel_above(q, sojourn, now);
+	if (q->dropping) {
+		if (!above) {
+			q->dropping = 0;
+		} else if (now >= q->drop_next) {
+			shed = 1;
+			q->count++;
+			q->drop_next = codel_control_law(q, q->drop_next);
+		}
+	} else if (above) {
+		/* start shedding. if the last dropping state ended
+		 * recently, pick up close to the rate it had reached */
+		shed = 1;
+		q->dropping = 1;
+		delta = q->count - q->lastcount;
+		if (delta > 1 && now - q->drop_next < 16 * q->interval)
+			q->count = delta;
+		else
+			q->count = 1;
+		q->lastcount = q->count;
+		q->drop_next = codel_control_law(q, now);
+	}
+	if (shed)
+		q->shed++;
+	else
+		q->admitted++;
+	pthread_mutex_unlock(&q->lock);
+	return shed;
+}
+
+int
+codel_full(struct codel *q)
+{
+	int dropping;
+
+	pthread_mutex_lock(&q->lock);
+	dropping = q->dropping;
+	if (dropping)
+		q->shed++;
+	pthread_mutex_unlock(&q->lock);
+	return dropping;
+}
@@ -0,0 +1,44 @@
+#ifndef __CODEL_H__
+#define __CODEL_H__
+
+/* Admission control based on how long connections wait in the queue, after
+ * CoDel (RFC 8289).
+ *
+ * Each connection's sojourn time, from being accepted to being dequeued by a
+ * worker, is checked as it is dequeued. A queue that drains within target
+ * is fine, however long it is. Once every sojourn time has been above target
+ * for a whole interval, the queue is standing, and connections are shed,
+ * at a rate that grows with the square root of the number shed, until a
+ * sojourn time drops below target again. Shedding a few connections early
+ * keeps the queueing delay of the rest close to target, rather than letting
+ * it grow with the backlog. */
+
+#include <pthread.h>
+
+struct codel {
+	pthread_mutex_t lock;
+	unsigned long target;	/* ns */
+	unsigned long interval;	/* ns */
+	unsigned long first_above;	/* when sojourn times will have been
+					 * above target for interval, or 0 */
+	unsigned long drop_next;	/* when to shed the next connection */
+	int dropping;
+	unsigned int count;	/* connections shed in this dropping state */
+	unsigned int lastcount;	/* and in the previous one */
+	long shed;		/* totals, protected by lock */
+	long admitted;
+};
+
+void codel_init(struct codel *q, unsigned long target, unsigned long interval);
+void codel_destroy(struct codel *q);
+
+/* called as a connection that waited sojourn ns is dequeued at now. returns
+ * 1 if it should be shed, 0 if it should be served. */
+int codel_dequeue(struct codel *q, unsigned long sojourn, unsigned long now);
+
+/* called when a connection finds the queue full. returns 1, counting it as
+ * shed, if the queue is being shed, so that the connection is turned away
+ * rather than waiting for room. returns 0 otherwise. */
+int codel_full(struct codel *q);
+
+#endif /* __CODEL_H__ */
@@ -83,7 +83,7 @@ rio_read(int fd, void *usrbuf, size_t n)
 }
 
 /* rio_write - robustly write n bytes (unbuffered) */
-static ssize_t
+ssize_t
 rio_write(int fd, void *usrbuf, size_t n)
 {
 	size_t nleft = n;
@@ -103,6 +103,62 @@ rio_write(int fd, void *usrbuf, size_t n)
 	return n;
 }
 
+/* rio_writev - robustly write all the buffers in iov. iov is updated to
+ * track partial writes */
+ssize_t
+rio_writev(int fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t nwritten, n = 0;
+
+	while (iovcnt > 0) {
+		if (iov->iov_len == 0) {
+			iov++;
+			iovcnt--;
+			continue;
+		}
+		if ((nwritten = writev(fd, iov, iovcnt)) <= 0) {
+			if (errno == EINTR)	/* interrupted by sig handler return */
+				continue;	/* and call writev() again */
+			else
+				return -1;	/* errno set by writev() */
+		}
+		n += nwritten;
+		/* skip the buffers that were written out */
+		while (nwritten >= iov->iov_len) {
+			nwritten -= iov->iov_len;
+			iov++;
+			if (--iovcnt == 0)
+				break;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + nwritten;
+			iov->iov_len -= nwritten;
+		}
+	}
+	return n;
+}
+
+/* rio_sendfile - robustly send n bytes of in_fd, from its start, to out_fd.
+ * returns fewer than n if the file was truncated */
+ssize_t
+rio_sendfile(int out_fd, int in_fd, size_t n)
+{
+	off_t offset = 0;
+	ssize_t nsent;
+
+	while (offset < n) {
+		if ((nsent = sendfile(out_fd, in_fd, &offset, n - offset)) <= 0) {
+			if (nsent < 0 && errno == EINTR)
+				continue;	/* and call sendfile() again */
+			else if (nsent == 0)
+				break;	/* file was truncated */
+			else
+				return -1;	/* errno set by sendfile() */
+		}
+	}
+	return offset;
+}
+
 /* 
  * rio_read - This is a wrapper for the Unix read() function that
  *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
@@ -138,6 +194,25 @@ rio_readb(struct rio *rp, char *usrbuf, size_t n)
 	return cnt;
 }
 
+/* rio_readnb - robustly read n bytes (buffered) */
+static ssize_t
+rio_readnb(struct rio *rp, void *usrbuf, size_t n)
+{
+	size_t nleft = n;
+	ssize_t nread;
+	char *bufp = usrbuf;
+
+	while (nleft > 0) {
+		if ((nread = rio_readb(rp, bufp, nleft)) < 0)
+			return -1;	/* errno set by read() */
+		else if (nread == 0)
+			break;	/* EOF */
+		nleft -= nread;
+		bufp += nread;
+	}
+	return (n - nleft);	/* return >= 0 */
+}
+
 /* rio_readlineb - robustly read a text line (buffered) */
 static ssize_t
 rio_readlineb(struct rio *rp, void *usrbuf, size_t maxlen)
@@ -145,7 +220,7 @@ rio_readlineb(struct rio *rp, void *usrbuf, size_t maxlen)
 	int n, rc;
 	char c, *bufp = usrbuf;
 
-	for (n = 0; n < maxlen; n++) {
+	for (n = 0; n < maxlen - 1; n++) {	/* leave room for the NUL */
 		if ((rc = rio_readb(rp, &c, 1)) == 1) {
 			*bufp++ = c;
 			if (c == '\n') {
@@ -209,6 +284,16 @@ Rio_readlineb(struct rio * rp, void *usrbuf, size_t maxlen)
 	return rc;
 }
 
+ssize_t
+Rio_readnb(struct rio *rp, void *usrbuf, size_t n)
+{
+	ssize_t rc;
+
+	if ((rc = rio_readnb(rp, usrbuf, n)) < 0)
+		unix_error("Rio_readnb error");
+	return rc;
+}
+
 /******************************** 
  * Client/server helper functions
  ********************************/
@@ -267,9 +352,8 @@ open_clientfd(char *hostname, int port)
 	return clientfd;
 }
 
-/* open and return a listening socket on port */
-int
-open_listenfd(int port)
+static int
+listen_on(int port, int reuseport)
 {
 	int listenfd, optval = 1;
 	struct sockaddr_in serveraddr;
@@ -280,6 +364,11 @@ open_listenfd(int port)
 	/* Eliminates "Address already in use" error from bind. */
 	SYS(setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,
 		       (const void *)&optval, sizeof(int)));
+	/* Lets other sockets listen on the same port, the kernel spreads
+	 * incoming connections across them */
+	if (reuseport)
+		SYS(setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+			       (const void *)&optval, sizeof(int)));
 
 	/* Listenfd will be an endpoint for all requests to port
 	   on any IP address for this host */
@@ -295,6 +384,21 @@ open_listenfd(int port)
 	return listenfd;
 }
 
+/* open and return a listening socket on port */
+int
+open_listenfd(int port)
+{
+	return listen_on(port, 0);
+}
+
+/* open and return a listening socket on port that shares the port with the
+ * other sockets opened by this function */
+int
+open_reuseport_listenfd(int port)
+{
+	return listen_on(port, 1);
+}
+
 /*********************************************************
  * Functions for generating long-tail random distributions
  *********************************************************/
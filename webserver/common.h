@@ -3,6 +3,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <string.h>
 #include <strings.h>
@@ -10,6 +11,7 @@
 #include <setjmp.h>
 #include <signal.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
@@ -22,9 +24,13 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <assert.h>
 #include <poll.h>
+#include <limits.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 
 #define __STR(n) #n
 #define STR(n) __STR(n)
@@ -73,10 +79,18 @@ void Rio_destroy(struct rio *rp);
 ssize_t Rio_read(int fd, void *usrbuf, size_t n);
 void Rio_write(int fd, void *usrbuf, size_t n);
 ssize_t Rio_readlineb(struct rio *rp, void *usrbuf, size_t maxlen);
+ssize_t Rio_readnb(struct rio *rp, void *usrbuf, size_t n);
+
+/* Robust writes that return -1 on errors, rather than exiting, for writing
+ * to a client that may have gone away */
+ssize_t rio_write(int fd, void *usrbuf, size_t n);
+ssize_t rio_writev(int fd, struct iovec *iov, int iovcnt);
+ssize_t rio_sendfile(int out_fd, int in_fd, size_t n);
 
 /* Wrappers for client/server helper functions */
 int open_clientfd(char *hostname, int port);
 int open_listenfd(int port);
+int open_reuseport_listenfd(int port);
 
 /* Random functions */
 void init_random();
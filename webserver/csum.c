@@ -0,0 +1,232 @@
+/*
+ * csum.c: The byte-sum checksum, with SIMD kernels picked at runtime.
+ *
+ * The SIMD kernels use psadbw (sum of absolute differences against zero),
+ * which adds up each group of 8 bytes into a 64-bit lane. The lanes can't
+ * overflow for any buffer that fits in memory, and truncating their total to
+ * an unsigned int gives the same result as adding up the bytes one at a time
+ * in an unsigned int.
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CSUM_X86
+#endif
+#include "common.h"
+#include "csum.h"
+
+typedef unsigned int (*csum_fn)(const void *buf, size_t len);
+
+static unsigned int
+csum_scalar(const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	unsigned int csum = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		csum += p[i];
+	}
+	return csum;
+}
+
+#ifdef CSUM_X86
+
+__attribute__((target("sse2")))
+static unsigned int
+csum_sse2(const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	const __m128i zero = _mm_setzero_si128();
+	__m128i acc0 = zero, acc1 = zero;
+	size_t i = 0;
+
+	/* two accumulators, so that consecutive adds don't wait on each
+	 * other */
+	for (; i + 32 <= len; i += 32) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(p + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(p + i + 16));
+
+		acc0 = _mm_add_epi64(acc0, _mm_sad_epu8(a, zero));
+		acc1 = _mm_add_epi64(acc1, _mm_sad_epu8(b, zero));
+	}
+	for (; i + 16 <= len; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(p + i));
+
+		acc0 = _mm_add_epi64(acc0, _mm_sad_epu8(a, zero));
+	}
+	acc0 = _mm_add_epi64(acc0, acc1);
+	acc0 = _mm_add_epi64(acc0, _mm_unpackhi_epi64(acc0, acc0));
+	return (unsigned int)_mm_cvtsi128_si32(acc0) +
+		csum_scalar(p + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static unsigned int
+csum_avx2(const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i acc0 = zero, acc1 = zero, acc2 = zero, acc3 = zero;
+	__m128i sum;
+	size_t i = 0;
+
+	for (; i + 128 <= len; i += 128) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(p + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(p + i + 32));
+		__m256i c = _mm256_loadu_si256((const __m256i *)(p + i + 64));
+		__m256i d = _mm256_loadu_si256((const __m256i *)(p + i + 96));
+
+		acc0 = _mm256_add_epi64(acc0, _mm256_sad_epu8(a, zero));
+		acc1 = _mm256_add_epi64(acc1, _mm256_sad_epu8(b, zero));
+		acc2 = _mm256_add_epi64(acc2, _mm256_sad_epu8(c, zero));
+		acc3 = _mm256_add_epi64(acc3, _mm256_sad_epu8(d, zero));
+	}
+	for (; i + 32 <= len; i += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(p + i));
+
+		acc0 = _mm256_add_epi64(acc0, _mm256_sad_epu8(a, zero));
+	}
+	acc0 = _mm256_add_epi64(_mm256_add_epi64(acc0, acc1),
+				_mm256_add_epi64(acc2, acc3));
+	sum = _mm_add_epi64(_mm256_castsi256_si128(acc0),
+			    _mm256_extracti128_si256(acc0, 1));
+	sum = _mm_add_epi64(sum, _mm_unpackhi_epi64(sum, sum));
+	return (unsigned int)_mm_cvtsi128_si32(sum) +
+		csum_sse2(p + i, len - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static unsigned int
+csum_avx512(const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	const __m512i zero = _mm512_setzero_si512();
+	__m512i acc0 = zero, acc1 = zero, acc2 = zero, acc3 = zero;
+	size_t i = 0;
+
+	for (; i + 256 <= len; i += 256) {
+		__m512i a = _mm512_loadu_si512(p + i);
+		__m512i b = _mm512_loadu_si512(p + i + 64);
+		__m512i c = _mm512_loadu_si512(p + i + 128);
+		__m512i d = _mm512_loadu_si512(p + i + 192);
+
+		acc0 = _mm512_add_epi64(acc0, _mm512_sad_epu8(a, zero));
+		acc1 = _mm512_add_epi64(acc1, _mm512_sad_epu8(b, zero));
+		acc2 = _mm512_add_epi64(acc2, _mm512_sad_epu8(c, zero));
+		acc3 = _mm512_add_epi64(acc3, _mm512_sad_epu8(d, zero));
+	}
+	/* the last chunks are loaded with a mask, which reads zeros past the
+	 * end of the buffer without touching memory there */
+	for (; i < len; i += 64) {
+		size_t left = len - i;
+		__mmask64 mask = left >= 64 ? ~0ULL : (1ULL << left) - 1;
+		__m512i a = _mm512_maskz_loadu_epi8(mask, p + i);
+
+		acc0 = _mm512_add_epi64(acc0, _mm512_sad_epu8(a, zero));
+	}
+	acc0 = _mm512_add_epi64(_mm512_add_epi64(acc0, acc1),
+				_mm512_add_epi64(acc2, acc3));
+	return (unsigned int)_mm512_reduce_add_epi64(acc0);
+}
+
+static int
+csum_have_sse2(void)
+{
+	return __builtin_cpu_supports("sse2");
+}
+
+static int
+csum_have_avx2(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+static int
+csum_have_avx512(void)
+{
+	return __builtin_cpu_supports("avx512f") &&
+		__builtin_cpu_supports("avx512bw");
+}
+
+#endif /* CSUM_X86 */
+
+static int
+csum_have_scalar(void)
+{
+	return 1;
+}
+
+static const struct csum_kernel {
+	const char *name;
+	csum_fn fn;
+	int (*supported)(void);
+} csum_kernels[] = {
+#ifdef CSUM_X86
+	{ "avx512", csum_avx512, csum_have_avx512 },
+	{ "avx2", csum_avx2, csum_have_avx2 },
+	{ "sse2", csum_sse2, csum_have_sse2 },
+#endif
+	{ "scalar", csum_scalar, csum_have_scalar },
+};
+
+#define NR_KERNELS ((int)(sizeof(csum_kernels) / sizeof(csum_kernels[0])))
+
+/* the kernel in use, or NULL until the first call. racing threads all pick
+ * the same kernel. */
+static const struct csum_kernel *csum_kernel;
+
+static const struct csum_kernel *
+csum_get_kernel(void)
+{
+	const struct csum_kernel *k;
+	int i;
+
+	k = __atomic_load_n(&csum_kernel, __ATOMIC_ACQUIRE);
+	if (k)
+		return k;
+	__builtin_cpu_init();
+	for (i = 0; i < NR_KERNELS; i++) {
+		k = &csum_kernels[i];
+		if (k->supported())
+			break;
+	}
+	__atomic_store_n(&csum_kernel, k, __ATOMIC_RELEASE);
+	return k;
+}
+
+unsigned int
+csum_bytes(const void *buf, size_t len)
+{
+	return csum_get_kernel()->fn(buf, len);
+}
+
+const char *
+csum_kernel_name(int i)
+{
+	return (i >= 0 && i < NR_KERNELS) ? csum_kernels[i].name : NULL;
+}
+
+int
+csum_select(const char *name)
+{
+	int i;
+
+	__builtin_cpu_init();
+	for (i = 0; i < NR_KERNELS; i++) {
+		if (strcmp(csum_kernels[i].name, name) == 0) {
+			if (!csum_kernels[i].supported())
+				return -1;
+			__atomic_store_n(&csum_kernel, &csum_kernels[i],
+					 __ATOMIC_RELEASE);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+const char *
+csum_selected(void)
+{
+	return csum_get_kernel()->name;
+}
@@ -0,0 +1,26 @@
+#ifndef __CSUM_H__
+#define __CSUM_H__
+
+#include <stddef.h>
+
+/* The checksum sent in the Content-Csum header: the sum of all the bytes of
+ * the file, as unsigned chars, in an unsigned int. The sum of two buffers is
+ * the sum of their checksums, so a file can be checksummed in chunks.
+ *
+ * csum_bytes uses the widest SIMD kernel that the CPU supports, picked on
+ * the first call. Every kernel returns exactly the same result. */
+
+unsigned int csum_bytes(const void *buf, size_t len);
+
+/* returns the name of the i-th kernel, from the widest to the portable one,
+ * or NULL if there are fewer kernels */
+const char *csum_kernel_name(int i);
+
+/* makes csum_bytes use the kernel called name. returns -1 if there is no
+ * such kernel, or the CPU doesn't support it. meant for benchmarks. */
+int csum_select(const char *name);
+
+/* returns the name of the kernel that csum_bytes uses */
+const char *csum_selected(void);
+
+#endif /* __CSUM_H__ */
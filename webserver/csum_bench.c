@@ -0,0 +1,106 @@
+/*
+ * csum_bench.c: Measures the throughput of each checksum kernel that the CPU
+ * supports, for buffer sizes from 1KB to 64MB, and checks that every kernel
+ * returns the same checksum as the portable one.
+ */
+
+#include "common.h"
+#include "csum.h"
+
+#define MIN_SIZE (1L << 10)
+#define MAX_SIZE (64L << 20)
+
+/* returns the number of bytes checksummed per second */
+static double
+run_bench(const char *buf, long size, long total, unsigned int expected)
+{
+	struct timeval start, end, diff;
+	long i, reps = total / size;
+	unsigned int csum = 0;
+	double secs;
+
+	if (reps < 1)
+		reps = 1;
+	gettimeofday(&start, NULL);
+	for (i = 0; i < reps; i++) {
+		csum = csum_bytes(buf, size);
+		/* keep the compiler from hoisting the call out of the loop */
+		__asm__ volatile("" : : "r"(csum) : "memory");
+	}
+	gettimeofday(&end, NULL);
+	timersub(&end, &start, &diff);
+	secs = diff.tv_sec + diff.tv_usec / 1e6;
+
+	assert(csum == expected);
+	return secs > 0 ? reps * size / secs : 0.0;
+}
+
+static void
+usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-k kernel] [-n total_mb]\n", program);
+	exit(1);
+}
+
+/* by default, runs every supported kernel, checksumming about 256MB for each
+ * buffer size */
+int
+main(int argc, char **argv)
+{
+	long total = 256L << 20, size;
+	char *kernel = NULL, *buf;
+	const char *name;
+	unsigned int expected[32], want;
+	int c, i, j;
+
+	while ((c = getopt(argc, argv, "k:n:")) != -1) {
+		switch (c) {
+		case 'k':
+			kernel = optarg;
+			break;
+		case 'n':
+			total = atol(optarg) << 20;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc || total <= 0)
+		usage(argv[0]);
+
+	/* random bytes, with the high bit set half the time, so that
+	 * sign-extension bugs would change the checksum. the buffer is off
+	 * by one byte from any alignment. */
+	buf = (char *)Malloc(MAX_SIZE + 1) + 1;
+	srandom(1);
+	for (i = 0; i < MAX_SIZE; i++) {
+		buf[i] = random();
+	}
+	csum_select("scalar");
+	for (size = MIN_SIZE, j = 0; size <= MAX_SIZE; size *= 2, j++) {
+		expected[j] = csum_bytes(buf, size);
+	}
+
+	for (i = 0; (name = csum_kernel_name(i)); i++) {
+		if (kernel && strcmp(kernel, name))
+			continue;
+		if (csum_select(name) < 0) {
+			printf("kernel = %s, not supported\n", name);
+			continue;
+		}
+		/* odd lengths exercise the tail of the kernels */
+		for (j = 0; j < 300; j++) {
+			csum_select("scalar");
+			want = csum_bytes(buf + j, j * 7);
+			csum_select(name);
+			assert(csum_bytes(buf + j, j * 7) == want);
+		}
+		for (size = MIN_SIZE, j = 0; size <= MAX_SIZE; size *= 2, j++) {
+			printf("kernel = %s, size = %ld, GB/s = %.2f\n",
+			       name, size,
+			       run_bench(buf, size, total, expected[j]) / 1e9);
+		}
+	}
+	free(buf - 1);
+	return 0;
+}
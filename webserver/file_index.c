@@ -0,0 +1,204 @@
+/*
+ * file_index.c: Remembers the size, modification time and checksum of files
+ * served by the web server.
+ */
+
+#include "common.h"
+#include "file_index.h"
+#include "csum.h"
+
+#define FILE_INDEX_SIZE 4096	/* number of hash buckets */
+#define CSUM_CHUNK (8 * MAXBUF)	/* bytes read at a time to compute a csum */
+
+struct file_entry {
+	char *file_name;
+	off_t file_size;
+	/* entries loaded from a sidecar index have no modification time, and
+	 * are only checked against the file size */
+	struct timespec mtime;
+	int has_mtime;
+	unsigned int csum;
+	struct file_entry *next;
+};
+
+static struct file_entry **index_table;
+static pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static unsigned int
+file_index_hash(const char *word)
+{
+	unsigned long hash = 5381;
+	int c;
+	while ((c = *word++))
+		hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+	return hash % FILE_INDEX_SIZE;
+}
+
+static struct file_entry *
+file_index_find(const char *file_name, unsigned int k)
+{
+	struct file_entry *e;
+
+	for (e = index_table[k]; e; e = e->next) {
+		if (strcmp(e->file_name, file_name) == 0)
+			return e;
+	}
+	return NULL;
+}
+
+/* adds or updates an entry, must be called with index_lock held for writing */
+static void
+file_index_set(const char *file_name, off_t file_size,
+	       const struct timespec *mtime, unsigned int csum)
+{
+	unsigned int k = file_index_hash(file_name);
+	struct file_entry *e = file_index_find(file_name, k);
+
+	if (!e) {
+		e = Malloc(sizeof(struct file_entry));
+		e->file_name = Malloc(strlen(file_name) + 1);
+		strcpy(e->file_name, file_name);
+		e->next = index_table[k];
+		index_table[k] = e;
+	}
+	e->file_size = file_size;
+	e->has_mtime = (mtime != NULL);
+	if (mtime)
+		e->mtime = *mtime;
+	e->csum = csum;
+}
+
+void
+file_index_init(void)
+{
+	index_table = calloc(FILE_INDEX_SIZE, sizeof(struct file_entry *));
+	assert(index_table);
+}
+
+/* must be called with index_lock held for writing */
+static void
+file_index_clear(void)
+{
+	int i;
+	struct file_entry *e, *next;
+
+	for (i = 0; i < FILE_INDEX_SIZE; i++) {
+		for (e = index_table[i]; e; e = next) {
+			next = e->next;
+			free(e->file_name);
+			free(e);
+		}
+		index_table[i] = NULL;
+	}
+}
+
+void
+file_index_destroy(void)
+{
+	file_index_clear();
+	free(index_table);
+	index_table = NULL;
+}
+
+int
+file_index_load(const char *idx_file)
+{
+	FILE *fp;
+	char name[MAXLINE], file_name[MAXLINE];
+	unsigned int csum;
+	int len, nr_files, n = 0;
+
+	fp = fopen(idx_file, "r");
+	if (!fp)
+		return -1;
+	if (fscanf(fp, "%d", &nr_files) != 1) {
+		fclose(fp);
+		return -1;
+	}
+	pthread_rwlock_wrlock(&index_lock);
+	while (fscanf(fp, "%8191s %u %d", name, &csum, &len) == 3) {
+		/* the server prefixes every uri with ./, see
+		 * request_parse_URI. a name too long for that is never
+		 * asked for. */
+		if (snprintf(file_name, sizeof(file_name), "./%s", name) >=
+		    (int)sizeof(file_name))
+			continue;
+		file_index_set(file_name, len, NULL, csum);
+		n++;
+	}
+	pthread_rwlock_unlock(&index_lock);
+	fclose(fp);
+	return n;
+}
+
+/* computes the checksum with a bounded buffer, however large the file is */
+static unsigned int
+file_index_compute_csum(int fd, off_t file_size)
+{
+	char buf[CSUM_CHUNK];
+	unsigned int csum = 0;
+	off_t off = 0;
+	ssize_t n;
+
+	while (off < file_size) {
+		n = pread(fd, buf, sizeof(buf), off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		SYS(n);
+		if (n == 0)
+			break;
+		csum += csum_bytes(buf, n);
+		off += n;
+	}
+	return csum;
+}
+
+unsigned int
+file_index_csum(const char *file_name, int fd, const struct stat *sbuf)
+{
+	struct file_entry *e;
+	unsigned int csum;
+	int found = 0;
+
+	pthread_rwlock_rdlock(&index_lock);
+	e = file_index_find(file_name, file_index_hash(file_name));
+	if (e && e->file_size == sbuf->st_size &&
+	    (!e->has_mtime ||
+	     (e->mtime.tv_sec == sbuf->st_mtim.tv_sec &&
+	      e->mtime.tv_nsec == sbuf->st_mtim.tv_nsec))) {
+		csum = e->csum;
+		found = 1;
+	}
+	pthread_rwlock_unlock(&index_lock);
+	if (found)
+		return csum;
+
+	csum = file_index_compute_csum(fd, sbuf->st_size);
+	pthread_rwlock_wrlock(&index_lock);
+	file_index_set(file_name, sbuf->st_size, &sbuf->st_mtim, csum);
+	pthread_rwlock_unlock(&index_lock);
+	return csum;
+}
+
+void
+file_index_invalidate(const char *file_name)
+{
+	struct file_entry **pprev, *e;
+
+	pthread_rwlock_wrlock(&index_lock);
+	if (!file_name) {
+		file_index_clear();
+	} else {
+		for (pprev = &index_table[file_index_hash(file_name)]; *pprev;
+		     pprev = &(*pprev)->next) {
+			if (strcmp((*pprev)->file_name, file_name) == 0) {
+				e = *pprev;
+				*pprev = e->next;
+				free(e->file_name);
+				free(e);
+				break;
+			}
+		}
+	}
+	pthread_rwlock_unlock(&index_lock);
+}
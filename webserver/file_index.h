@@ -0,0 +1,29 @@
+#ifndef __FILE_INDEX_H__
+#define __FILE_INDEX_H__
+
+#include <sys/stat.h>
+
+/* Index of per-file metadata, keyed by the file name used by the server
+ * (e.g., "./fileset_dir/00000"). It lets the server send a file without
+ * having the whole file in memory, e.g., when streaming it with sendfile. */
+
+void file_index_init(void);
+void file_index_destroy(void);
+
+/* loads a sidecar index in the format written by the fileset program:
+ * the number of files on the first line, followed by "name csum len" lines.
+ * returns the number of entries loaded, or -1 if the file can't be read. */
+int file_index_load(const char *idx_file);
+
+/* returns the checksum of the open file fd, whose stat is sbuf. the checksum
+ * is taken from the index when it is up to date, otherwise it is computed by
+ * reading the file in fixed-size chunks and remembered for next time. */
+unsigned int file_index_csum(const char *file_name, int fd,
+			     const struct stat *sbuf);
+
+/* forgets file_name's entry, or every entry if file_name is NULL, e.g.,
+ * because the file changed in a way that its size and modification time
+ * may not show */
+void file_index_invalidate(const char *file_name);
+
+#endif /* __FILE_INDEX_H__ */
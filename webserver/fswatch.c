@@ -0,0 +1,243 @@
+/*
+ * fswatch.c: Invalidates cached files when they change on disk.
+ */
+
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <dirent.h>
+#include "common.h"
+#include "cache.h"
+#include "stat_cache.h"
+#include "neg_cache.h"
+#include "file_index.h"
+#include "fswatch.h"
+
+/* what changes a file, or a directory entry. the directories' own events
+ * are reported by their parents, except for the tree's root. */
+#define FSWATCH_MASK (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | \
+		      IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+		      IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+#define FSWATCH_BUF (64 * 1024)	/* bytes of events read at a time */
+
+struct fswatch {
+	struct Cache *cache;
+	int fd;			/* inotify */
+	int exitfd;		/* eventfd, makes the thread exit */
+	pthread_t thread;
+	char **dirs;		/* dirs[wd] is the directory watched by wd */
+	int nr_dirs;		/* size of dirs */
+	/* statistics, only used by the thread */
+	int nr_watches;
+	long nr_files;		/* files invalidated */
+	long nr_all;		/* times everything was invalidated */
+};
+
+static void
+fswatch_invalidate(struct fswatch *w, char *file_name)
+{
+	/* the stat cache goes first, so that a miss that sees the new
+	 * generation of the cache also sees the new metadata */
+	stat_cache_invalidate(file_name);
+	neg_cache_invalidate(file_name);
+	file_index_invalidate(file_name);
+	if (file_name) {
+		cache_invalidate(w->cache, file_name);
+		w->nr_files++;
+	} else {
+		cache_invalidate_all(w->cache);
+		w->nr_all++;
+	}
+}
+
+/* watches dir, and the directories under it, without following symbolic
+ * links */
+static void
+fswatch_add_tree(struct fswatch *w, const char *dir)
+{
+	char path[MAXLINE];
+	struct dirent *de;
+	struct stat sbuf;
+	DIR *dp;
+	int wd;
+
+	wd = inotify_add_watch(w->fd, dir, FSWATCH_MASK);
+	if (wd < 0) {
+		/* it may be gone already */
+		if (errno != ENOENT && errno != ENOTDIR)
+			fprintf(stderr, "fswatch: %s: %s\n", dir,
+				strerror(errno));
+		return;
+	}
+	if (wd >= w->nr_dirs) {
+		int nr = w->nr_dirs ? w->nr_dirs : 16;
+
+		while (nr <= wd)
+			nr *= 2;
+		w->dirs = realloc(w->dirs, nr * sizeof(char *));
+		assert(w->dirs);
+		memset(w->dirs + w->nr_dirs, 0,
+		       (nr - w->nr_dirs) * sizeof(char *));
+		w->nr_dirs = nr;
+	}
+	/* the directory may have been watched under another name */
+	if (w->dirs[wd])
+		free(w->dirs[wd]);
+	else
+		w->nr_watches++;
+	w->dirs[wd] = Malloc(strlen(dir) + 1);
+	strcpy(w->dirs[wd], dir);
+
+	dp = opendir(dir);
+	if (!dp)
+		return;
+	while ((de = readdir(dp))) {
+		if (strcmp(de->d_name, ".") == 0 ||
+		    strcmp(de->d_name, "..") == 0)
+			continue;
+		if (snprintf(path, sizeof(path), "%s/%s", dir, de->d_name) >=
+		    (int)sizeof(path))
+			continue;
+		if (de->d_type == DT_UNKNOWN) {
+			if (lstat(path, &sbuf) < 0 || !S_ISDIR(sbuf.st_mode))
+				continue;
+		} else if (de->d_type != DT_DIR) {
+			continue;
+		}
+		fswatch_add_tree(w, path);
+	}
+	closedir(dp);
+}
+
+/* stops watching dir, and the directories under it, e.g., once it has been
+ * moved away */
+static void
+fswatch_remove_tree(struct fswatch *w, const char *dir)
+{
+	int len = strlen(dir), wd;
+
+	for (wd = 0; wd < w->nr_dirs; wd++) {
+		char *d = w->dirs[wd];
+
+		if (!d || strncmp(d, dir, len) != 0 ||
+		    (d[len] != '\0' && d[len] != '/'))
+			continue;
+		/* fails if the kernel has removed it already */
+		inotify_rm_watch(w->fd, wd);
+		free(d);
+		w->dirs[wd] = NULL;
+		w->nr_watches--;
+	}
+}
+
+static void
+fswatch_event(struct fswatch *w, struct inotify_event *ev)
+{
+	char path[MAXLINE];
+	char *dir;
+
+	if (ev->mask & IN_Q_OVERFLOW) {
+		fswatch_invalidate(w, NULL);
+		return;
+	}
+	if (ev->wd < 0 || ev->wd >= w->nr_dirs || !(dir = w->dirs[ev->wd]))
+		return;
+	if (ev->mask & IN_IGNORED) {
+		/* the directory is gone */
+		free(dir);
+		w->dirs[ev->wd] = NULL;
+		w->nr_watches--;
+		return;
+	}
+	if (ev->len == 0 ||
+	    snprintf(path, sizeof(path), "%s/%s", dir, ev->name) >=
+	    (int)sizeof(path))
+		return;
+	if (!(ev->mask & IN_ISDIR)) {
+		fswatch_invalidate(w, path);
+		return;
+	}
+	/* a directory changing changes the names, or the permissions, of
+	 * everything under it. this is rare, so don't bother working out
+	 * which files those are. */
+	if (ev->mask & (IN_MOVED_FROM | IN_DELETE))
+		fswatch_remove_tree(w, path);
+	if (ev->mask & (IN_MOVED_TO | IN_CREATE))
+		fswatch_add_tree(w, path);
+	fswatch_invalidate(w, NULL);
+}
+
+static void *
+do_fswatch_thread(void *arg)
+{
+	struct fswatch *w = (struct fswatch *)arg;
+	char buf[FSWATCH_BUF]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	struct pollfd fds[] = {
+		{ w->fd, POLLIN },
+		{ w->exitfd, POLLIN },
+	};
+	struct inotify_event *ev;
+	ssize_t n;
+	char *p;
+
+	while (1) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			SYS(-1);
+		}
+		if (fds[1].revents & POLLIN)
+			break;
+		n = read(w->fd, buf, sizeof(buf));
+		if (n < 0 && (errno == EINTR || errno == EAGAIN))
+			continue;
+		SYS(n);
+		for (p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event *)p;
+			fswatch_event(w, ev);
+		}
+	}
+	return NULL;
+}
+
+struct fswatch *
+fswatch_init(const char *dir, struct Cache *cache)
+{
+	struct fswatch *w = Malloc(sizeof(struct fswatch));
+
+	w->cache = cache;
+	SYS(w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC));
+	SYS(w->exitfd = eventfd(0, EFD_CLOEXEC));
+	w->dirs = NULL;
+	w->nr_dirs = 0;
+	w->nr_watches = 0;
+	w->nr_files = 0;
+	w->nr_all = 0;
+	/* the tree is watched before anything is cached */
+	fswatch_add_tree(w, dir);
+	if (w->nr_watches == 0) {
+		fprintf(stderr, "fswatch: can't watch %s\n", dir);
+		exit(1);
+	}
+	SYS(pthread_create(&w->thread, NULL, do_fswatch_thread, w));
+	return w;
+}
+
+void
+fswatch_destroy(struct fswatch *w)
+{
+	uint64_t one = 1;
+	int wd;
+
+	SYS(write(w->exitfd, &one, sizeof(one)));
+	pthread_join(w->thread, NULL);
+	printf("fswatch: directories = %d, files invalidated = %ld, "
+	       "everything invalidated = %ld\n", w->nr_watches, w->nr_files,
+	       w->nr_all);
+	for (wd = 0; wd < w->nr_dirs; wd++)
+		free(w->dirs[wd]);
+	free(w->dirs);
+	SYS(close(w->exitfd));
+	SYS(close(w->fd));
+	free(w);
+}
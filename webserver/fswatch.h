@@ -0,0 +1,26 @@
+#ifndef __FSWATCH_H__
+#define __FSWATCH_H__
+
+/* Watches the files that the web server serves for changes, with inotify,
+ * so that what it remembers about them doesn't go stale.
+ *
+ * A thread watches every directory under the server's directory, including
+ * ones created later. When a file is written, truncated, renamed, deleted,
+ * created or has its permissions changed, it is invalidated in the file
+ * cache, the stat cache (see stat_cache.h), the negative cache (see
+ * neg_cache.h) and the checksum index (see file_index.h), so the next
+ * request for it looks at it again. If the kernel drops events, or a
+ * directory is renamed or deleted, everything is invalidated.
+ *
+ * Files are known by the names that the server gives them, e.g.,
+ * "./fileset_dir/00000". Changes to the target of a symbolic link, or to a
+ * file outside the tree, aren't noticed. */
+
+struct Cache;
+struct fswatch;
+
+/* starts watching the tree under dir, on behalf of cache */
+struct fswatch *fswatch_init(const char *dir, struct Cache *cache);
+void fswatch_destroy(struct fswatch *w);
+
+#endif /* __FSWATCH_H__ */
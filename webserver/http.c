@@ -0,0 +1,145 @@
+/*
+ * http.c: A zero-copy HTTP request head parser.
+ */
+
+#include "common.h"
+#include "http.h"
+
+void
+http_buf_init(struct http_buf *b)
+{
+	b->len = 0;
+	b->scanned = 0;
+	b->head_len = 0;
+}
+
+int
+http_buf_head(struct http_buf *b)
+{
+	const char *p, *end = b->data + b->len;
+
+	if (b->head_len)
+		return 1;
+	/* every line ends with a \n, so only look for the empty line where
+	 * there is one */
+	p = b->data + b->scanned;
+	while ((p = memchr(p, '\n', end - p)) != NULL) {
+		if (p - b->data >= 3 && memcmp(p - 3, "\r\n\r\n", 4) == 0) {
+			b->head_len = p + 1 - b->data;
+			return 1;
+		}
+		p++;
+	}
+	b->scanned = b->len;
+	return b->len == HTTP_BUF_SIZE ? -1 : 0;
+}
+
+int
+http_buf_read(struct http_buf *b, int fd)
+{
+	ssize_t n;
+	int ret;
+
+	while ((ret = http_buf_head(b)) == 0) {
+		n = read(fd, b->data + b->len, HTTP_BUF_SIZE - b->len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return 0;
+		b->len += n;
+	}
+	return ret > 0;
+}
+
+void
+http_buf_consume(struct http_buf *b)
+{
+	assert(b->head_len > 0);
+	b->len -= b->head_len;
+	memmove(b->data, b->data + b->head_len, b->len);
+	b->scanned = 0;
+	b->head_len = 0;
+}
+
+/* returns the slice of [p, end) up to the first c, or all of it, and moves p
+ * past the slice and any c's after it */
+static struct http_slice
+http_token(const char **p, const char *end, char c)
+{
+	struct http_slice s = { *p, 0 };
+	const char *q = memchr(*p, c, end - *p);
+
+	if (!q)
+		q = end;
+	s.len = q - *p;
+	while (q < end && *q == c)
+		q++;
+	*p = q;
+	return s;
+}
+
+static struct http_slice
+http_trim(struct http_slice s)
+{
+	while (s.len > 0 && (*s.ptr == ' ' || *s.ptr == '\t')) {
+		s.ptr++;
+		s.len--;
+	}
+	while (s.len > 0 && (s.ptr[s.len - 1] == ' ' ||
+			     s.ptr[s.len - 1] == '\t'))
+		s.len--;
+	return s;
+}
+
+int
+http_parse(const char *buf, int head_len, struct http_request *req)
+{
+	const char *p = buf, *end = buf + head_len, *eol, *line_end;
+
+	req->method = req->uri = req->version = (struct http_slice){ buf, 0 };
+	req->nr_headers = 0;
+	/* the request line */
+	eol = memchr(p, '\n', end - p);
+	if (!eol)
+		return -1;
+	line_end = (eol > p && eol[-1] == '\r') ? eol - 1 : eol;
+	req->method = http_token(&p, line_end, ' ');
+	req->uri = http_token(&p, line_end, ' ');
+	req->version = http_token(&p, line_end, ' ');
+	if (req->method.len == 0)
+		return -1;
+
+	/* headers, up to the empty line */
+	for (p = eol + 1; p < end; p = eol + 1) {
+		struct http_header *h;
+
+		eol = memchr(p, '\n', end - p);
+		if (!eol)
+			break;
+		line_end = (eol > p && eol[-1] == '\r') ? eol - 1 : eol;
+		if (line_end == p)
+			break;
+		if (req->nr_headers == HTTP_MAX_HEADERS)
+			continue;
+		h = &req->headers[req->nr_headers];
+		h->name = http_token(&p, line_end, ':');
+		/* lines without a colon are not headers */
+		if (p == line_end && h->name.ptr + h->name.len == line_end)
+			continue;
+		h->value = http_trim((struct http_slice){ p, line_end - p });
+		req->nr_headers++;
+	}
+	return 0;
+}
+
+int
+http_slice_eq(struct http_slice s, const char *str)
+{
+	return s.len == strlen(str) && memcmp(s.ptr, str, s.len) == 0;
+}
+
+int
+http_slice_caseeq(struct http_slice s, const char *str)
+{
+	return s.len == strlen(str) && strncasecmp(s.ptr, str, s.len) == 0;
+}
@@ -0,0 +1,64 @@
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+/* Parses HTTP request heads in place.
+ *
+ * A connection's input is read into a struct http_buf. Once the buffer holds
+ * a complete head, http_parse splits it into the method, URI, version and
+ * headers, each returned as a slice of the buffer rather than a copy. The
+ * end of the head, and of each line, is found with memchr, which scans many
+ * bytes at a time. A head may arrive in any number of reads: the search for
+ * its end picks up where the last one left off. */
+
+#define HTTP_BUF_SIZE 8192	/* longest request head, and pipelined bytes */
+#define HTTP_MAX_HEADERS 32	/* headers beyond this are ignored */
+
+/* a part of the buffer, not NUL-terminated */
+struct http_slice {
+	const char *ptr;
+	int len;
+};
+
+struct http_header {
+	struct http_slice name;
+	struct http_slice value;
+};
+
+struct http_request {
+	struct http_slice method;
+	struct http_slice uri;
+	struct http_slice version;	/* empty for HTTP/0.9 style requests */
+	struct http_header headers[HTTP_MAX_HEADERS];
+	int nr_headers;
+};
+
+struct http_buf {
+	char data[HTTP_BUF_SIZE];
+	int len;	/* bytes read into data */
+	int scanned;	/* bytes already searched for the end of the head */
+	int head_len;	/* length of the first head, 0 until it is complete */
+};
+
+void http_buf_init(struct http_buf *b);
+
+/* returns 1 if b holds a complete head, setting b->head_len, 0 if more
+ * bytes are needed, and -1 if the head doesn't fit in the buffer */
+int http_buf_head(struct http_buf *b);
+
+/* reads from fd until b holds a complete head. returns 1 once it does, and
+ * 0 if the connection is closed, fails or times out, or the head doesn't
+ * fit */
+int http_buf_read(struct http_buf *b, int fd);
+
+/* drops the first head, keeping any pipelined bytes after it */
+void http_buf_consume(struct http_buf *b);
+
+/* splits the head of head_len bytes at buf. returns 0, or -1 if there is no
+ * request line */
+int http_parse(const char *buf, int head_len, struct http_request *req);
+
+/* returns whether s is str, or, ignoring case, whether s is str */
+int http_slice_eq(struct http_slice s, const char *str);
+int http_slice_caseeq(struct http_slice s, const char *str);
+
+#endif /* __HTTP_H__ */
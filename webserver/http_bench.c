@@ -0,0 +1,191 @@
+/*
+ * http_bench.c: Measures how many request heads a single thread parses per
+ * second, with the zero-copy parser (http.c) and with the line-at-a-time
+ * parser that the server used before it: a byte-at-a-time buffered read of
+ * each line, and sscanf of the request line into fixed-size buffers.
+ */
+
+#include "common.h"
+#include "http.h"
+
+/* a request like the ones the client sends, and one from a browser */
+static const char *requests[] = {
+	"GET /fileset_dir/00042 HTTP/1.1\r\n"
+	"host: localhost\r\n\r\n",
+	"GET /fileset_dir/00042 HTTP/1.1\r\n"
+	"Host: www.example.com\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) "
+	"Gecko/20100101 Firefox/115.0\r\n"
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+	"image/avif,image/webp,*/*;q=0.8\r\n"
+	"Accept-Language: en-US,en;q=0.5\r\n"
+	"Accept-Encoding: gzip, deflate, br\r\n"
+	"Connection: keep-alive\r\n"
+	"Upgrade-Insecure-Requests: 1\r\n"
+	"Sec-Fetch-Dest: document\r\n"
+	"Sec-Fetch-Mode: navigate\r\n\r\n",
+};
+static const char *request_names[] = { "client", "browser" };
+
+/* the old parser's buffered reader, reading from memory instead of a
+ * socket */
+struct line_reader {
+	const char *src;
+	int src_len;
+	int src_off;
+	char buf[MAXBUF];
+	int cnt;
+	char *bufptr;
+};
+
+static int
+reader_readb(struct line_reader *r, char *usrbuf, int n)
+{
+	int cnt;
+
+	while (r->cnt <= 0) {
+		r->cnt = r->src_len - r->src_off;
+		if (r->cnt > sizeof(r->buf))
+			r->cnt = sizeof(r->buf);
+		if (r->cnt == 0)
+			return 0;
+		memcpy(r->buf, r->src + r->src_off, r->cnt);
+		r->src_off += r->cnt;
+		r->bufptr = r->buf;
+	}
+	cnt = n < r->cnt ? n : r->cnt;
+	memcpy(usrbuf, r->bufptr, cnt);
+	r->bufptr += cnt;
+	r->cnt -= cnt;
+	return cnt;
+}
+
+static int
+reader_readline(struct line_reader *r, char *usrbuf, int maxlen)
+{
+	int n;
+	char c, *bufp = usrbuf;
+
+	for (n = 0; n < maxlen - 1; n++) {
+		if (reader_readb(r, &c, 1) != 1)
+			break;
+		*bufp++ = c;
+		if (c == '\n') {
+			n++;
+			break;
+		}
+	}
+	*bufp = 0;
+	return n;
+}
+
+/* returns whether the request is a keep-alive GET */
+static int
+parse_old(const char *req, int len)
+{
+	struct line_reader r = { req, len, 0, "", 0, NULL };
+	char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+	int keepalive;
+
+	reader_readline(&r, buf, MAXLINE);
+	sscanf(buf, "%s %s %s", method, uri, version);
+	keepalive = strcmp(version, "HTTP/1.1") == 0;
+	do {
+		if (reader_readline(&r, buf, MAXLINE) <= 0)
+			return 0;
+		if (strncasecmp(buf, "Connection:", 11) == 0)
+			keepalive = strncasecmp(buf + 12, "close", 5) != 0;
+	} while (strcmp(buf, "\r\n"));
+	return strcasecmp(method, "GET") == 0 && keepalive;
+}
+
+/* feeds the request into an http_buf chunk bytes at a time, as if it came
+ * in that many reads, then parses it */
+static int
+parse_new(const char *req, int len, int chunk, struct http_buf *b)
+{
+	struct http_request hr;
+	int off, n, keepalive, i;
+
+	http_buf_init(b);
+	for (off = 0; off < len; off += n) {
+		n = len - off < chunk ? len - off : chunk;
+		memcpy(b->data + b->len, req + off, n);
+		b->len += n;
+		if (http_buf_head(b))
+			break;
+	}
+	assert(b->head_len == len);
+	if (http_parse(b->data, b->head_len, &hr) < 0)
+		return 0;
+	keepalive = http_slice_eq(hr.version, "HTTP/1.1");
+	for (i = 0; i < hr.nr_headers; i++) {
+		if (http_slice_caseeq(hr.headers[i].name, "Connection"))
+			keepalive = !http_slice_caseeq(hr.headers[i].value,
+						       "close");
+	}
+	return http_slice_caseeq(hr.method, "GET") && keepalive;
+}
+
+/* returns parsed requests per second. chunk 0 is the old parser */
+static double
+run_bench(const char *req, int chunk, long nr_requests)
+{
+	struct http_buf *b = Malloc(sizeof(struct http_buf));
+	struct timeval start, end, diff;
+	int len = strlen(req), ok = 0;
+	long i;
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < nr_requests; i++) {
+		if (chunk)
+			ok += parse_new(req, len, chunk, b);
+		else
+			ok += parse_old(req, len);
+		__asm__ volatile("" : : : "memory");
+	}
+	gettimeofday(&end, NULL);
+	timersub(&end, &start, &diff);
+	free(b);
+	assert(ok == nr_requests);
+	return nr_requests / (diff.tv_sec + diff.tv_usec / 1e6);
+}
+
+static void
+usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-n nr_requests]\n", program);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	long nr_requests = 1000000;
+	int chunks[] = { 0, HTTP_BUF_SIZE, 64, 16 };
+	int c, i, j;
+
+	while ((c = getopt(argc, argv, "n:")) != -1) {
+		switch (c) {
+		case 'n':
+			nr_requests = atol(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc || nr_requests <= 0)
+		usage(argv[0]);
+
+	for (i = 0; i < 2; i++) {
+		for (j = 0; j < 4; j++) {
+			printf("request = %s, bytes = %zu, parser = %s, "
+			       "read size = %d, Mrequests/s = %.2f\n",
+			       request_names[i], strlen(requests[i]),
+			       chunks[j] ? "http" : "old", chunks[j],
+			       run_bench(requests[i], chunks[j], nr_requests)
+			       / 1e6);
+		}
+	}
+	return 0;
+}
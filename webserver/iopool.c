@@ -0,0 +1,92 @@
+/*
+ * iopool.c: A pool of threads for blocking work.
+ */
+
+#include "common.h"
+#include "iopool.h"
+
+struct iopool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	/* signaled when a job is queued, or on exit */
+	struct iopool_job *head, *tail;	/* queued jobs, oldest first */
+	int exiting;
+	int nr_threads;
+	pthread_t *threads;
+};
+
+static void *
+do_iopool_thread(void *arg)
+{
+	struct iopool *pool = (struct iopool *)arg;
+	struct iopool_job *job;
+
+	pthread_mutex_lock(&pool->lock);
+	while (1) {
+		while (!pool->head && !pool->exiting)
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		/* the queue is drained before exiting */
+		if (!pool->head)
+			break;
+		job = pool->head;
+		pool->head = job->next;
+		if (!pool->head)
+			pool->tail = NULL;
+		pthread_mutex_unlock(&pool->lock);
+		job->run(job);
+		pthread_mutex_lock(&pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+struct iopool *
+iopool_init(int nr_threads)
+{
+	struct iopool *pool = Malloc(sizeof(struct iopool));
+	int i;
+
+	assert(nr_threads > 0);
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	pool->head = pool->tail = NULL;
+	pool->exiting = 0;
+	pool->nr_threads = nr_threads;
+	pool->threads = Malloc(sizeof(pthread_t) * nr_threads);
+	for (i = 0; i < nr_threads; i++)
+		SYS(pthread_create(&pool->threads[i], NULL, do_iopool_thread,
+				   pool));
+	return pool;
+}
+
+void
+iopool_destroy(struct iopool *pool)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->exiting = 1;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+	for (i = 0; i < pool->nr_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+	assert(!pool->head);
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+	free(pool);
+}
+
+void
+iopool_submit(struct iopool *pool, struct iopool_job *job)
+{
+	job->next = NULL;
+	pthread_mutex_lock(&pool->lock);
+	assert(!pool->exiting);
+	if (pool->tail)
+		pool->tail->next = job;
+	else
+		pool->head = job;
+	pool->tail = job;
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+}
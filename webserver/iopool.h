@@ -0,0 +1,27 @@
+#ifndef __IOPOOL_H__
+#define __IOPOOL_H__
+
+/* A pool of threads that run blocking work, e.g., reading files from disk,
+ * on behalf of threads that must not block, e.g., event loops.
+ *
+ * A job is embedded in whatever the caller's work is about, so submitting
+ * one never allocates. The pool runs a job's function on one of its threads,
+ * and the function itself tells the submitter that it is done, typically
+ * through an eventfd that the submitter polls. */
+
+struct iopool;
+
+struct iopool_job {
+	void (*run)(struct iopool_job *job);
+	struct iopool_job *next;	/* used by the pool */
+};
+
+struct iopool *iopool_init(int nr_threads);
+
+/* waits for the submitted jobs to finish, and for the threads to exit */
+void iopool_destroy(struct iopool *pool);
+
+/* runs job->run(job) on one of the pool's threads, in submission order */
+void iopool_submit(struct iopool *pool, struct iopool_job *job);
+
+#endif /* __IOPOOL_H__ */
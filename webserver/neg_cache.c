@@ -0,0 +1,209 @@
+/*
+ * neg_cache.c: Remembers the error responses to requests for files that
+ * can't be served.
+ */
+
+#include "common.h"
+#include "policy.h"
+#include "neg_cache.h"
+
+#define NEG_CACHE_SIZE 4096		/* number of hash buckets */
+#define NEG_CACHE_BYTES (1 << 20)	/* budget, including the entries */
+
+#define pnode_entry(n) \
+	((struct neg_entry *)((char *)(n) - offsetof(struct neg_entry, pnode)))
+
+struct neg_entry {
+	struct policy_node pnode;	/* the name's full hash, and the
+					 * entry's size */
+	char *file_name;	/* allocated with the entry */
+	char *response;		/* same */
+	int len;
+	int status;
+	struct neg_entry *next;
+};
+
+static struct neg_entry **neg_table;	/* NULL while the cache is off */
+static struct policy *neg_policy;
+static long neg_bytes;
+static int neg_entries;
+static unsigned long neg_generation;	/* invalidations so far, atomic */
+static long neg_hits, neg_misses;	/* atomic */
+static pthread_rwlock_t neg_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static unsigned long
+neg_cache_hash(const char *word)
+{
+	unsigned long hash = 5381;
+	int c;
+	while ((c = *word++))
+		hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+	return hash;
+}
+
+static struct neg_entry **
+neg_cache_find(const char *file_name, unsigned long hash)
+{
+	struct neg_entry **pprev;
+
+	for (pprev = &neg_table[hash % NEG_CACHE_SIZE]; *pprev;
+	     pprev = &(*pprev)->next) {
+		if ((*pprev)->pnode.hash == hash &&
+		    strcmp((*pprev)->file_name, file_name) == 0)
+			break;
+	}
+	return pprev;
+}
+
+/* unlinks an entry that the policy has let go of, and frees it. must be
+ * called with neg_lock held for writing. */
+static void
+neg_cache_unlink(struct neg_entry *e)
+{
+	struct neg_entry **pprev = neg_cache_find(e->file_name, e->pnode.hash);
+
+	assert(*pprev == e);
+	*pprev = e->next;
+	neg_bytes -= e->pnode.size;
+	neg_entries--;
+	free(e);
+}
+
+/* must be called with neg_lock held for writing */
+static void
+neg_cache_clear(void)
+{
+	struct policy_node *victim;
+
+	while ((victim = policy_evict(neg_policy)))
+		neg_cache_unlink(pnode_entry(victim));
+	assert(neg_entries == 0 && neg_bytes == 0);
+}
+
+void
+neg_cache_init(void)
+{
+	neg_table = calloc(NEG_CACHE_SIZE, sizeof(struct neg_entry *));
+	assert(neg_table);
+	neg_policy = policy_init(POLICY_S3FIFO);
+	neg_bytes = 0;
+	neg_entries = 0;
+}
+
+void
+neg_cache_destroy(void)
+{
+	if (!neg_table)
+		return;
+	neg_cache_clear();
+	policy_destroy(neg_policy);
+	free(neg_table);
+	neg_table = NULL;
+}
+
+void
+neg_cache_print_stats(void)
+{
+	if (!neg_table)
+		return;
+	printf("negative cache: hits = %ld, misses = %ld, entries = %d, "
+	       "bytes = %ld\n", neg_hits, neg_misses, neg_entries, neg_bytes);
+}
+
+int
+neg_cache_enabled(void)
+{
+	return neg_table != NULL;
+}
+
+unsigned long
+neg_cache_generation(void)
+{
+	return __atomic_load_n(&neg_generation, __ATOMIC_ACQUIRE);
+}
+
+int
+neg_cache_get(const char *file_name, int *status, char *buf, int size)
+{
+	unsigned long hash;
+	struct neg_entry *e;
+	int len = 0;
+
+	if (!neg_table)
+		return 0;
+	hash = neg_cache_hash(file_name);
+	pthread_rwlock_rdlock(&neg_lock);
+	e = *neg_cache_find(file_name, hash);
+	if (e && e->len <= size) {
+		policy_hit(neg_policy, &e->pnode);
+		memcpy(buf, e->response, e->len);
+		*status = e->status;
+		len = e->len;
+	}
+	pthread_rwlock_unlock(&neg_lock);
+	__atomic_fetch_add(len ? &neg_hits : &neg_misses, 1, __ATOMIC_RELAXED);
+	return len;
+}
+
+void
+neg_cache_put(const char *file_name, int status, const char *response,
+	      int len, unsigned long generation)
+{
+	int name_len = strlen(file_name) + 1;
+	unsigned long hash;
+	struct policy_node *victim;
+	struct neg_entry *e;
+
+	if (!neg_table)
+		return;
+	hash = neg_cache_hash(file_name);
+	/* the name and the response are allocated with the entry */
+	e = Malloc(sizeof(struct neg_entry) + name_len + len);
+	e->file_name = (char *)(e + 1);
+	memcpy(e->file_name, file_name, name_len);
+	e->response = e->file_name + name_len;
+	memcpy(e->response, response, len);
+	e->len = len;
+	e->status = status;
+	e->pnode.hash = hash;
+	e->pnode.size = sizeof(struct neg_entry) + name_len + len;
+
+	pthread_rwlock_wrlock(&neg_lock);
+	/* the file may have appeared since it was looked at, or another
+	 * request may have got here first */
+	if (generation != neg_generation || *neg_cache_find(file_name, hash)) {
+		pthread_rwlock_unlock(&neg_lock);
+		free(e);
+		return;
+	}
+	while (neg_bytes + e->pnode.size > NEG_CACHE_BYTES &&
+	       (victim = policy_evict(neg_policy)))
+		neg_cache_unlink(pnode_entry(victim));
+	e->next = neg_table[hash % NEG_CACHE_SIZE];
+	neg_table[hash % NEG_CACHE_SIZE] = e;
+	neg_bytes += e->pnode.size;
+	neg_entries++;
+	policy_insert(neg_policy, &e->pnode);
+	pthread_rwlock_unlock(&neg_lock);
+}
+
+void
+neg_cache_invalidate(const char *file_name)
+{
+	struct neg_entry *e;
+
+	if (!neg_table)
+		return;
+	pthread_rwlock_wrlock(&neg_lock);
+	__atomic_add_fetch(&neg_generation, 1, __ATOMIC_RELEASE);
+	if (!file_name) {
+		neg_cache_clear();
+	} else {
+		e = *neg_cache_find(file_name, neg_cache_hash(file_name));
+		if (e) {
+			policy_remove(neg_policy, &e->pnode);
+			neg_cache_unlink(e);
+		}
+	}
+	pthread_rwlock_unlock(&neg_lock);
+}
@@ -0,0 +1,36 @@
+#ifndef __NEG_CACHE_H__
+#define __NEG_CACHE_H__
+
+/* Negative cache: remembers the error responses to requests for files that
+ * can't be served, e.g., missing files asked for by scanners or broken
+ * links, keyed by file name, so that asking again costs a lookup and a
+ * write, rather than the checks, a stat and formatting the error page.
+ *
+ * The cache holds the response as pre-rendered bytes, along with which
+ * error it is (see request.c), and a byte budget bounds it, with S3-FIFO
+ * evictions (see policy.h), so that names that are only asked for once
+ * don't push out the ones asked for over and over.
+ *
+ * Like the stat cache (see stat_cache.h), it relies on being told when
+ * files are created or change (see fswatch.h), so it is off until
+ * neg_cache_init, and guards against putting a response that was out of
+ * date before the put with a generation. */
+
+void neg_cache_init(void);
+void neg_cache_destroy(void);
+void neg_cache_print_stats(void);
+
+/* returns 1 if the cache is on */
+int neg_cache_enabled(void);
+unsigned long neg_cache_generation(void);
+
+/* copies file_name's response, of up to size bytes, into buf, and returns
+ * its length, with its error in *status, or returns 0 if it isn't cached */
+int neg_cache_get(const char *file_name, int *status, char *buf, int size);
+void neg_cache_put(const char *file_name, int status, const char *response,
+		   int len, unsigned long generation);
+
+/* forgets file_name's response, or every response if file_name is NULL */
+void neg_cache_invalidate(const char *file_name);
+
+#endif /* __NEG_CACHE_H__ */
@@ -0,0 +1,489 @@
+/*
+ * policy.c: Cache eviction policies, see policy.h.
+ */
+
+#include "common.h"
+#include "policy.h"
+
+#define S3FIFO_SMALL_PERCENT 10	/* share of bytes in the small queue */
+#define S3FIFO_MAX_FREQ 3
+#define GHOST_MIN_SIZE 64	/* entries in the S3-FIFO ghost, power of 2 */
+#define HEAP_MIN_SIZE 64
+
+enum { QUEUE_SMALL, QUEUE_MAIN };
+
+struct policy_ops {
+	const char *name;
+	int hit_locked;	/* hits reorder entries, and take the policy lock */
+	void (*insert)(struct policy *p, struct policy_node *n);
+	void (*hit)(struct policy *p, struct policy_node *n);
+	struct policy_node *(*evict)(struct policy *p);
+	void (*remove)(struct policy *p, struct policy_node *n);
+};
+
+struct policy {
+	const struct policy_ops *ops;
+	pthread_mutex_t lock;
+	/* LRU list, most recent first. CLOCK ring. S3-FIFO main queue. */
+	struct policy_node list;
+	struct policy_node *hand;	/* CLOCK */
+	/* S3-FIFO */
+	struct policy_node small;	/* newest first */
+	long small_bytes;
+	long main_bytes;
+	int nr_nodes;
+	unsigned long *ghost;	/* direct-mapped set of recently evicted
+				 * hashes */
+	int ghost_size;
+	/* LFF and GDSF, a min-heap of node priorities */
+	struct policy_node **heap;
+	int heap_len;
+	int heap_size;
+	double inflation;	/* GDSF's L, the priority of the last victim */
+};
+
+/* doubly-linked lists with a sentinel node */
+
+static void
+list_init(struct policy_node *head)
+{
+	head->prev = head;
+	head->next = head;
+}
+
+/* adds n before pos */
+static void
+list_add_before(struct policy_node *pos, struct policy_node *n)
+{
+	n->next = pos;
+	n->prev = pos->prev;
+	pos->prev->next = n;
+	pos->prev = n;
+}
+
+static void
+list_del(struct policy_node *n)
+{
+	n->prev->next = n->next;
+	n->next->prev = n->prev;
+	n->prev = NULL;
+	n->next = NULL;
+}
+
+/* returns the oldest node of a list, or NULL if it's empty */
+static struct policy_node *
+list_tail(struct policy_node *head)
+{
+	return (head->prev == head) ? NULL : head->prev;
+}
+
+/* LRU: a hit moves the node to the front, the victim is at the back */
+
+static void
+lru_insert(struct policy *p, struct policy_node *n)
+{
+	list_add_before(p->list.next, n);
+}
+
+static void
+lru_hit(struct policy *p, struct policy_node *n)
+{
+	list_del(n);
+	list_add_before(p->list.next, n);
+}
+
+static struct policy_node *
+lru_evict(struct policy *p)
+{
+	struct policy_node *n = list_tail(&p->list);
+
+	if (n)
+		list_del(n);
+	return n;
+}
+
+static void
+lru_remove(struct policy *p, struct policy_node *n)
+{
+	list_del(n);
+}
+
+/* CLOCK: a hit sets the node's reference bit. the hand clears reference bits
+ * until it finds a node without one. new nodes go just behind the hand. */
+
+static void
+clock_insert(struct policy *p, struct policy_node *n)
+{
+	n->freq = 0;
+	list_add_before(p->hand, n);
+}
+
+static void
+clock_hit(struct policy *p, struct policy_node *n)
+{
+	if (__atomic_load_n(&n->freq, __ATOMIC_RELAXED) == 0)
+		__atomic_store_n(&n->freq, 1, __ATOMIC_RELAXED);
+}
+
+static struct policy_node *
+clock_evict(struct policy *p)
+{
+	struct policy_node *n;
+
+	if (p->list.next == &p->list)
+		return NULL;
+	while (1) {
+		if (p->hand == &p->list)
+			p->hand = p->list.next;
+		n = p->hand;
+		p->hand = n->next;
+		if (n->freq == 0)
+			break;
+		n->freq = 0;
+	}
+	list_del(n);
+	return n;
+}
+
+static void
+clock_remove(struct policy *p, struct policy_node *n)
+{
+	if (p->hand == n)
+		p->hand = n->next;
+	list_del(n);
+}
+
+/* S3-FIFO: new nodes go to a small FIFO queue. nodes that are hit again
+ * before they leave it move to the main FIFO queue, the others are evicted
+ * and remembered in a ghost set, so that they go straight to the main queue
+ * if they come back. nodes at the end of the main queue are reinserted while
+ * they have hits left. */
+
+static int
+ghost_slot(struct policy *p, unsigned long hash)
+{
+	return hash & (p->ghost_size - 1);
+}
+
+static void
+ghost_resize(struct policy *p, int size)
+{
+	unsigned long *old = p->ghost;
+	int i, old_size = p->ghost_size;
+
+	p->ghost = calloc(size, sizeof(unsigned long));
+	assert(p->ghost);
+	p->ghost_size = size;
+	for (i = 0; i < old_size; i++) {
+		if (old[i])
+			p->ghost[ghost_slot(p, old[i])] = old[i];
+	}
+	free(old);
+}
+
+static void
+s3fifo_insert(struct policy *p, struct policy_node *n)
+{
+	int k = ghost_slot(p, n->hash);
+
+	n->freq = 0;
+	if (n->hash && p->ghost[k] == n->hash) {
+		p->ghost[k] = 0;
+		n->queue = QUEUE_MAIN;
+		list_add_before(p->list.next, n);
+		p->main_bytes += n->size;
+	} else {
+		n->queue = QUEUE_SMALL;
+		list_add_before(p->small.next, n);
+		p->small_bytes += n->size;
+	}
+	/* the ghost remembers about as many nodes as the cache holds */
+	if (++p->nr_nodes > p->ghost_size)
+		ghost_resize(p, p->ghost_size * 2);
+}
+
+static void
+s3fifo_hit(struct policy *p, struct policy_node *n)
+{
+	if (__atomic_load_n(&n->freq, __ATOMIC_RELAXED) < S3FIFO_MAX_FREQ)
+		__atomic_fetch_add(&n->freq, 1, __ATOMIC_RELAXED);
+}
+
+static void
+s3fifo_remove(struct policy *p, struct policy_node *n)
+{
+	list_del(n);
+	if (n->queue == QUEUE_SMALL)
+		p->small_bytes -= n->size;
+	else
+		p->main_bytes -= n->size;
+	p->nr_nodes--;
+}
+
+static struct policy_node *
+s3fifo_evict(struct policy *p)
+{
+	struct policy_node *n;
+	long total;
+
+	while (1) {
+		total = p->small_bytes + p->main_bytes;
+		n = list_tail(&p->small);
+		if (n && (p->small_bytes * 100 >= total * S3FIFO_SMALL_PERCENT
+			  || !list_tail(&p->list))) {
+			list_del(n);
+			p->small_bytes -= n->size;
+			if (n->freq > 1) {
+				/* hit again while in the small queue */
+				n->freq = 0;
+				n->queue = QUEUE_MAIN;
+				list_add_before(p->list.next, n);
+				p->main_bytes += n->size;
+				continue;
+			}
+			p->nr_nodes--;
+			if (n->hash)
+				p->ghost[ghost_slot(p, n->hash)] = n->hash;
+			return n;
+		}
+		n = list_tail(&p->list);
+		if (!n)
+			return NULL;
+		list_del(n);
+		if (n->freq > 0) {
+			n->freq--;
+			list_add_before(p->list.next, n);
+			continue;
+		}
+		p->main_bytes -= n->size;
+		p->nr_nodes--;
+		return n;
+	}
+}
+
+/* LFF and GDSF keep the nodes in a min-heap of their priorities */
+
+static void
+heap_set(struct policy *p, int i, struct policy_node *n)
+{
+	p->heap[i] = n;
+	n->heap_index = i;
+}
+
+static void
+heap_sift_up(struct policy *p, int i)
+{
+	struct policy_node *n = p->heap[i];
+	int parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (p->heap[parent]->priority <= n->priority)
+			break;
+		heap_set(p, i, p->heap[parent]);
+		i = parent;
+	}
+	heap_set(p, i, n);
+}
+
+static void
+heap_sift_down(struct policy *p, int i)
+{
+	struct policy_node *n = p->heap[i];
+	int child;
+
+	while ((child = 2 * i + 1) < p->heap_len) {
+		if (child + 1 < p->heap_len &&
+		    p->heap[child + 1]->priority < p->heap[child]->priority)
+			child++;
+		if (n->priority <= p->heap[child]->priority)
+			break;
+		heap_set(p, i, p->heap[child]);
+		i = child;
+	}
+	heap_set(p, i, n);
+}
+
+static void
+heap_insert(struct policy *p, struct policy_node *n)
+{
+	if (p->heap_len == p->heap_size) {
+		p->heap_size = p->heap_size ? p->heap_size * 2 : HEAP_MIN_SIZE;
+		p->heap = realloc(p->heap,
+				  sizeof(struct policy_node *) * p->heap_size);
+		assert(p->heap);
+	}
+	heap_set(p, p->heap_len++, n);
+	heap_sift_up(p, n->heap_index);
+}
+
+static void
+heap_remove(struct policy *p, struct policy_node *n)
+{
+	int i = n->heap_index;
+	struct policy_node *last = p->heap[--p->heap_len];
+
+	if (last != n) {
+		heap_set(p, i, last);
+		heap_sift_up(p, i);
+		heap_sift_down(p, last->heap_index);
+	}
+	n->heap_index = -1;
+}
+
+static struct policy_node *
+heap_evict(struct policy *p)
+{
+	struct policy_node *n;
+
+	if (p->heap_len == 0)
+		return NULL;
+	n = p->heap[0];
+	heap_remove(p, n);
+	return n;
+}
+
+static void
+lff_insert(struct policy *p, struct policy_node *n)
+{
+	n->priority = -(double)n->size;
+	heap_insert(p, n);
+}
+
+static void
+lff_hit(struct policy *p, struct policy_node *n)
+{
+}
+
+/* GDSF: priority = L + frequency * cost / size, with a cost of 1. L is the
+ * priority of the last victim, which ages the nodes that aren't hit. */
+
+static void
+gdsf_set_priority(struct policy *p, struct policy_node *n)
+{
+	n->priority = p->inflation + (double)n->freq /
+		(n->size > 0 ? n->size : 1);
+}
+
+static void
+gdsf_insert(struct policy *p, struct policy_node *n)
+{
+	n->freq = 1;
+	gdsf_set_priority(p, n);
+	heap_insert(p, n);
+}
+
+static void
+gdsf_hit(struct policy *p, struct policy_node *n)
+{
+	n->freq++;
+	gdsf_set_priority(p, n);
+	heap_sift_down(p, n->heap_index);
+}
+
+static struct policy_node *
+gdsf_evict(struct policy *p)
+{
+	struct policy_node *n = heap_evict(p);
+
+	if (n)
+		p->inflation = n->priority;
+	return n;
+}
+
+static const struct policy_ops policy_ops[NR_POLICIES] = {
+	[POLICY_LFF] = { "lff", 0, lff_insert, lff_hit, heap_evict,
+			 heap_remove },
+	[POLICY_LRU] = { "lru", 1, lru_insert, lru_hit, lru_evict,
+			 lru_remove },
+	[POLICY_CLOCK] = { "clock", 0, clock_insert, clock_hit, clock_evict,
+			   clock_remove },
+	[POLICY_S3FIFO] = { "s3fifo", 0, s3fifo_insert, s3fifo_hit,
+			    s3fifo_evict, s3fifo_remove },
+	[POLICY_GDSF] = { "gdsf", 1, gdsf_insert, gdsf_hit, gdsf_evict,
+			  heap_remove },
+};
+
+int
+policy_parse(const char *name)
+{
+	int i;
+
+	for (i = 0; i < NR_POLICIES; i++) {
+		if (strcmp(name, policy_ops[i].name) == 0)
+			return i;
+	}
+	return -1;
+}
+
+const char *
+policy_name(int type)
+{
+	return policy_ops[type].name;
+}
+
+struct policy *
+policy_init(int type)
+{
+	struct policy *p;
+
+	assert(type >= 0 && type < NR_POLICIES);
+	p = Malloc(sizeof(struct policy));
+	p->ops = &policy_ops[type];
+	pthread_mutex_init(&p->lock, NULL);
+	list_init(&p->list);
+	p->hand = &p->list;
+	list_init(&p->small);
+	p->small_bytes = 0;
+	p->main_bytes = 0;
+	p->nr_nodes = 0;
+	p->ghost = NULL;
+	p->ghost_size = 0;
+	if (type == POLICY_S3FIFO)
+		ghost_resize(p, GHOST_MIN_SIZE);
+	p->heap = NULL;
+	p->heap_len = 0;
+	p->heap_size = 0;
+	p->inflation = 0;
+	return p;
+}
+
+/* the nodes themselves belong to the caller */
+void
+policy_destroy(struct policy *p)
+{
+	pthread_mutex_destroy(&p->lock);
+	free(p->ghost);
+	free(p->heap);
+	free(p);
+}
+
+void
+policy_insert(struct policy *p, struct policy_node *n)
+{
+	p->ops->insert(p, n);
+}
+
+void
+policy_hit(struct policy *p, struct policy_node *n)
+{
+	if (p->ops->hit_locked) {
+		pthread_mutex_lock(&p->lock);
+		p->ops->hit(p, n);
+		pthread_mutex_unlock(&p->lock);
+	} else {
+		p->ops->hit(p, n);
+	}
+}
+
+struct policy_node *
+policy_evict(struct policy *p)
+{
+	return p->ops->evict(p);
+}
+
+void
+policy_remove(struct policy *p, struct policy_node *n)
+{
+	p->ops->remove(p, n);
+}
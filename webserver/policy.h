@@ -0,0 +1,54 @@
+#ifndef __POLICY_H__
+#define __POLICY_H__
+
+#include <pthread.h>
+
+/* Cache eviction policies. A policy keeps track of the entries of a cache
+ * (or of one cache shard) and picks the next entry to evict. Each entry
+ * embeds a struct policy_node, and the policy only ever looks at the node,
+ * so the policies can also be used to simulate a cache.
+ *
+ * Every operation is O(1), except for the heap-based policies (LFF and
+ * GDSF), which are O(log n).
+ *
+ * policy_insert, policy_evict and policy_remove must be serialized by the
+ * caller. policy_hit may run concurrently with other hits (but not with the
+ * other operations): policies that reorder entries on a hit serialize hits
+ * with an internal lock, the others only update the node atomically. */
+
+enum policy_type {
+	POLICY_LFF,	/* largest file first */
+	POLICY_LRU,
+	POLICY_CLOCK,
+	POLICY_S3FIFO,
+	POLICY_GDSF,	/* GreedyDual-Size-Frequency */
+	NR_POLICIES
+};
+
+struct policy_node {
+	struct policy_node *prev;
+	struct policy_node *next;
+	unsigned long hash;	/* hash of the key, set by the caller */
+	long size;		/* set by the caller */
+	int freq;		/* hits, or reference bit for CLOCK */
+	int queue;		/* S3-FIFO queue that holds the node */
+	int heap_index;
+	double priority;
+};
+
+struct policy;
+
+/* returns the policy type called name, or -1 if there is none */
+int policy_parse(const char *name);
+const char *policy_name(int type);
+
+struct policy *policy_init(int type);
+void policy_destroy(struct policy *p);
+
+void policy_insert(struct policy *p, struct policy_node *n);
+void policy_hit(struct policy *p, struct policy_node *n);
+/* removes and returns the next entry to evict, or NULL if there is none */
+struct policy_node *policy_evict(struct policy *p);
+void policy_remove(struct policy *p, struct policy_node *n);
+
+#endif /* __POLICY_H__ */
@@ -4,21 +4,161 @@
 
 #include "common.h"
 #include "request.h"
+#include "file_index.h"
+#include "stat_cache.h"
+#include "neg_cache.h"
+#include "csum.h"
+#include "stats.h"
+#include "http.h"
+#include "arena.h"
+#include "access_log.h"
 
 struct request {
 	int fd;		 /* descriptor for client connection */
 	struct file_data *data;
+	int file_fd;	 /* open file to stream, or -1 if data is in memory */
+	struct response_buf *out; /* if not NULL, responses are put here */
+	int http11;	 /* client speaks HTTP/1.1 */
+	int keepalive;	 /* keep the connection open after this request */
+	int status_page; /* 0, or the format of the status page asked for */
+	unsigned long neg_gen; /* the negative cache's, before the checks */
+	/* for the access log, see request_destroy */
+	unsigned long start; /* when the request started, see stats_now */
+	int status;	 /* of the response, 0 until one is sent */
+	long bytes;	 /* of the response */
+	int cache;	 /* enum access_cache */
+	struct arena *arena; /* rq was allocated from this, or NULL */
 };
 
-/* requestError(fd, filename, "404", "Not found", 
- *		"OS server could not find this file");
- */
+/* initialize file data */
+struct file_data *
+file_data_init(struct arena *arena)
+{
+	struct file_data *data;
+
+	if (arena)
+		data = arena_alloc(arena, sizeof(struct file_data));
+	else
+		data = Malloc(sizeof(struct file_data));
+	data->file_name = NULL;
+	data->file_buf = NULL;
+	data->file_size = 0;
+	data->file_csum = 0;
+	data->file_type = NULL;
+	data->file_header = NULL;
+	data->file_header_len = 0;
+	data->cache_gen = 0;
+	data->arena = arena;
+	return data;
+}
+
+/* returns data, moved out of its arena, if any, so that it can outlive the
+ * request, e.g., when it is shared with the requests waiting for the same
+ * file (see cache_load_done). the copy in the arena is left empty. */
+struct file_data *
+file_data_detach(struct file_data *data)
+{
+	struct file_data *copy;
+
+	if (!data->arena)
+		return data;
+	copy = Malloc(sizeof(struct file_data));
+	*copy = *data;
+	copy->arena = NULL;
+	if (data->file_name) {
+		copy->file_name = Malloc(strlen(data->file_name) + 1);
+		strcpy(copy->file_name, data->file_name);
+	}
+	data->file_buf = NULL;
+	data->file_header = NULL;
+	return copy;
+}
+
+/* free all file data */
+void
+file_data_free(struct file_data *data)
+{
+	free(data->file_buf);
+	free(data->file_header);
+	/* the arena frees the rest */
+	if (data->arena)
+		return;
+	free(data->file_name);
+	free(data);
+}
+
+/* a write to the client failed, e.g., because it went away. only its
+ * connection is closed, by not keeping it open after this request. */
 static void
-request_error(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg)
+request_write_failed(struct request *rq)
 {
-	char buf[MAXLINE], body[MAXBUF];
-	int i;
-	unsigned int csum = 0;
+	rq->keepalive = 0;
+}
+
+/* sends n bytes of the response to the client, or buffers them */
+static void
+request_write(struct request *rq, void *buf, size_t n)
+{
+	struct response_buf *out = rq->out;
+
+	if (!out) {
+		if (rio_write(rq->fd, buf, n) != n)
+			request_write_failed(rq);
+		return;
+	}
+	assert(out->len + n <= out->size);
+	memcpy(out->buf + out->len, buf, n);
+	out->len += n;
+}
+
+/* the version we answer with, the same as the client's */
+static const char *
+request_version(struct request *rq)
+{
+	return rq->http11 ? "HTTP/1.1" : "HTTP/1.0";
+}
+
+static const char *
+request_connection(struct request *rq)
+{
+	return rq->keepalive ? "Connection: keep-alive\r\n" :
+		"Connection: close\r\n";
+}
+
+/* sends an error response, whose status and Connection lines are head, and
+ * the rest tail, in one write */
+static void
+request_send_error(struct request *rq, const char *head, const char *tail,
+		   int len)
+{
+	struct iovec iov[2];
+
+	/* the status code follows the version */
+	rq->status = atoi(head + strlen("HTTP/1.x "));
+	rq->bytes = strlen(head) + len;
+	stats_response(rq->bytes);
+	if (rq->out) {
+		request_write(rq, (char *)head, strlen(head));
+		request_write(rq, (char *)tail, len);
+		return;
+	}
+	iov[0].iov_base = (char *)head;
+	iov[0].iov_len = strlen(head);
+	iov[1].iov_base = (char *)tail;
+	iov[1].iov_len = len;
+	if (rio_writev(rq->fd, iov, 2) < 0)
+		request_write_failed(rq);
+}
+
+/* formats the rest of an error response, after the status and Connection
+ * lines, into buf, which has room for MAXBUF + MAXLINE bytes. returns its
+ * length. */
+static int
+request_format_error(char *buf, char *cause, char *errnum, char *shortmsg,
+		     char *longmsg)
+{
+	char body[MAXBUF];
+	unsigned int csum;
 
 	/* create the body of the error message */
 	sprintf(body, "<html><title>OS Web Server Error</title>");
@@ -27,46 +167,130 @@ request_error(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg)
 	sprintf(body + strlen(body), "<p>%s: %s</p>\r\n", longmsg, cause);
 	sprintf(body + strlen(body), "</body></html>\r\n");
 
-	/* write out the header information for this response */
-	sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-	Rio_write(fd, buf, strlen(buf));
-	printf("%s", buf);
+	/* generate a very trivial checksum */
+	csum = csum_bytes(body, strlen(body));
+	return sprintf(buf, "Content-Type: text/html\r\n"
+		       "Content-Length: %ld\r\n"
+		       "Content-Csum: %u\r\n\r\n%s", strlen(body), csum, body);
+}
 
-	sprintf(buf, "Content-Type: text/html\r\n");
-	Rio_write(fd, buf, strlen(buf));
-	printf("%s", buf);
+/* requestError(rq, filename, "404", "Not found", 
+ *		"OS server could not find this file");
+ */
+static void
+request_error(struct request *rq, char *cause, char *errnum, char *shortmsg,
+	      char *longmsg)
+{
+	char head[MAXLINE], tail[MAXBUF + MAXLINE];
+	int len;
 
-	sprintf(buf, "Content-Length: %ld\r\n", strlen(body));
-	Rio_write(fd, buf, strlen(buf));
-	printf("%s", buf);
+	len = request_format_error(tail, cause, errnum, shortmsg, longmsg);
+	sprintf(head, "%s %s %s\r\n%s", request_version(rq), errnum, shortmsg,
+		request_connection(rq));
+	request_send_error(rq, head, tail, len);
+}
 
-	/* generate a very trivial checksum */
-	for (i = 0; i < strlen(body); i++) {
-		csum += (unsigned char)(body[i]);
-	}
-	sprintf(buf, "Content-Csum: %u\r\n\r\n", csum);
-	Rio_write(fd, buf, strlen(buf));
-	printf("%s", buf);
+/* the errors about files, which the negative cache remembers */
+enum request_file_error {
+	ERROR_NOT_FOUND,
+	ERROR_FORBIDDEN,
+	NR_FILE_ERRORS
+};
 
-	/* write out the content */
-	Rio_write(fd, body, strlen(body));
-	printf("%s", body);
+static const struct {
+	char *errnum;
+	char *shortmsg;
+} request_file_errors[NR_FILE_ERRORS] = {
+	[ERROR_NOT_FOUND] = { "404", "Not found" },
+	[ERROR_FORBIDDEN] = { "403", "Forbidden" },
+};
 
-}
+/* the status and Connection lines of those errors, indexed by the error,
+ * http11 and keepalive, as request_error would format them */
+static const char *request_file_error_head[NR_FILE_ERRORS][2][2] = {
+	[ERROR_NOT_FOUND] = {
+		{ "HTTP/1.0 404 Not found\r\nConnection: close\r\n",
+		  "HTTP/1.0 404 Not found\r\nConnection: keep-alive\r\n" },
+		{ "HTTP/1.1 404 Not found\r\nConnection: close\r\n",
+		  "HTTP/1.1 404 Not found\r\nConnection: keep-alive\r\n" },
+	},
+	[ERROR_FORBIDDEN] = {
+		{ "HTTP/1.0 403 Forbidden\r\nConnection: close\r\n",
+		  "HTTP/1.0 403 Forbidden\r\nConnection: keep-alive\r\n" },
+		{ "HTTP/1.1 403 Forbidden\r\nConnection: close\r\n",
+		  "HTTP/1.1 403 Forbidden\r\nConnection: keep-alive\r\n" },
+	},
+};
 
-/* reads and discards everything up to an empty text line */
+/* like request_error, for an error about rq's file. if cache is set, and the
+ * negative cache is on, the response is remembered for the next request
+ * for the same file. */
 static void
-request_read_headers(struct rio *rp)
+request_file_error(struct request *rq, int error, char *longmsg, int cache)
 {
-	char buf[MAXLINE];
+	struct file_data *data = rq->data;
+	const char *head = request_file_error_head[error][rq->http11]
+		[rq->keepalive];
+	char tail[MAXBUF + MAXLINE];
+	int len;
+
+	len = request_format_error(tail, data->file_name,
+				   request_file_errors[error].errnum,
+				   request_file_errors[error].shortmsg,
+				   longmsg);
+	request_send_error(rq, head, tail, len);
+	if (cache)
+		neg_cache_put(data->file_name, error, tail, len, rq->neg_gen);
+}
 
-	Rio_readlineb(rp, buf, MAXLINE);
-	while (strcmp(buf, "\r\n")) {
-		Rio_readlineb(rp, buf, MAXLINE);
+/* turns the client on connfd away with a 503, without reading its request.
+ * this is the cheap way of saying no, for when the server is overloaded, so
+ * it never blocks. the caller closes connfd. */
+void
+request_reject(int connfd)
+{
+	static const char response[] = "HTTP/1.0 503 Service Unavailable\r\n"
+		"Server: OS Web Server\r\nConnection: close\r\n"
+		"Retry-After: 1\r\nContent-Length: 0\r\n\r\n";
+	unsigned long start = stats_now();
+	char buf[MAXBUF];
+	int i;
+
+	/* take in the request, if it has arrived, since closing a socket
+	 * with unread data resets the connection, and the client might
+	 * never see the response. a client that sends more than a few
+	 * buffers' worth gets reset anyway, rather than hold up the caller */
+	for (i = 0; i < 8; i++) {
+		if (recv(connfd, buf, sizeof(buf), MSG_DONTWAIT) <= 0)
+			break;
 	}
-	return;
+	/* the response is best effort. if the client has gone already, or
+	 * the send fails for any other reason, there is nobody left to tell */
+	send(connfd, response, sizeof(response) - 1,
+	     MSG_DONTWAIT | MSG_NOSIGNAL);
+	stats_shed();
+	access_log_record(start, NULL, 503, sizeof(response) - 1, ACCESS_NONE,
+			  0);
 }
 
+/* looks at the headers. the Connection header overrides the default for
+ * the HTTP version */
+static void
+request_parse_headers(struct request *rq, struct http_request *req)
+{
+	int i;
+
+	for (i = 0; i < req->nr_headers; i++) {
+		struct http_header *h = &req->headers[i];
+
+		if (!http_slice_caseeq(h->name, "Connection"))
+			continue;
+		if (http_slice_caseeq(h->value, "close"))
+			rq->keepalive = 0;
+		else if (http_slice_caseeq(h->value, "keep-alive"))
+			rq->keepalive = 1;
+	}
+}
 
 /* Calculates filename from uri. 
  * for this simple server, filename = .uri
@@ -74,61 +298,191 @@ request_read_headers(struct rio *rp)
  * Adding the "./" means that files will only be served from the directory in
  * which the webserver is running.
  *
- * Also, we don't serve files with a .. in the path (see request_readfile). */
+ * Every spelling of a path gets the same name, e.g., "/a//./b" and "a/b" are
+ * both "./a/b", so that a file is only cached once, and is known by the name
+ * that fswatch.c invalidates it by.
+ *
+ * Also, we don't serve files with a .. in the path (see request_readfile).
+ * filename needs room for uri.len + 3 bytes. */
 static void
-request_parse_URI(char *uri, char *filename, size_t max)
+request_format_file_name(char *filename, struct http_slice uri)
+{
+	const char *p = uri.ptr, *end = uri.ptr + uri.len;
+
+	*filename++ = '.';
+	*filename++ = '/';
+	while (p < end) {
+		/* at the start of a path component */
+		if (*p == '/') {
+			p++;
+		} else if (*p == '.' && (p + 1 == end || p[1] == '/')) {
+			p++;
+		} else {
+			while (p < end && *p != '/')
+				*filename++ = *p++;
+			if (p < end)
+				*filename++ = *p++;
+		}
+	}
+	*filename = '\0';
+}
+
+static char *
+request_parse_URI(struct arena *arena, struct http_slice uri)
 {
-	snprintf(filename, max, "./%s", uri);
+	char *filename = arena ? arena_alloc(arena, uri.len + 3) :
+		Malloc(uri.len + 3);
+
+	request_format_file_name(filename, uri);
+	return filename;
 }
 
-/* Fills in the filetype given the filename */
-static void
-request_get_file_type(char *filename, char *filetype)
+/* looks at the request line on connfd, if it has arrived, without taking
+ * it off the socket. returns 1 after putting the name of the file that is
+ * asked for, as request_parse_URI would, in file_name, and 0 if the request
+ * line hasn't arrived, or doesn't fit in size bytes. */
+int
+request_peek_file_name(int connfd, char *file_name, int size)
+{
+	char buf[MAXLINE];
+	struct http_request req;
+	const char *eol;
+	ssize_t n;
+
+	n = recv(connfd, buf, sizeof(buf), MSG_PEEK | MSG_DONTWAIT);
+	if (n <= 0)
+		return 0;
+	eol = memchr(buf, '\n', n);
+	if (!eol || http_parse(buf, eol + 1 - buf, &req) < 0 ||
+	    req.uri.len + 3 > size)
+		return 0;
+	request_format_file_name(file_name, req.uri);
+	return 1;
+}
+
+/* Returns the filetype given the filename */
+static const char *
+request_get_file_type(char *filename)
 {
 	if (strstr(filename, ".html"))
-		strcpy(filetype, "text/html");
+		return "text/html";
 	else if (strstr(filename, ".gif"))
-		strcpy(filetype, "image/gif");
+		return "image/gif";
 	else if (strstr(filename, ".jpg"))
-		strcpy(filetype, "image/jpeg");
+		return "image/jpeg";
 	else
-		strcpy(filetype, "text/plain");
+		return "text/plain";
 }
 
-/* entry point to this file */
-/* returns a pointer to a request struct, filling rq->fd with connfd,
- * and rq->file_name with the file that is being requested.
- * Returns NULL on failure.
- */
-struct request *
-request_init(int connfd, struct file_data *data)
+static struct request *
+request_alloc(int connfd, struct file_data *data, struct response_buf *out)
 {
-	char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-	struct rio *rio;
 	struct request *rq;
 
 	assert(data);
-	rq = Malloc(sizeof(struct request));
+	if (data->arena)
+		rq = arena_alloc(data->arena, sizeof(struct request));
+	else
+		rq = Malloc(sizeof(struct request));
+	rq->arena = data->arena;
 	rq->fd = connfd;
 	rq->data = data;
-	data->file_name = Malloc(MAXLINE);
+	rq->file_fd = -1;
+	rq->out = out;
+	rq->http11 = 0;
+	rq->keepalive = 0;
+	rq->status_page = 0;
+	rq->neg_gen = 0;
+	rq->start = stats_now();
+	rq->status = 0;
+	rq->bytes = 0;
+	rq->cache = ACCESS_NONE;
+	data->file_name = NULL;
 	data->file_buf = NULL;
 	data->file_size = 0;
-	rio = Rio_init(rq->fd);
-	Rio_readlineb(rio, buf, MAXLINE);
-	sscanf(buf, "%s %s %s", method, uri, version);
+	return rq;
+}
 
-	// printf("%s %s %s, fd = %d\n", method, uri, version, connfd);
-	if (strcasecmp(method, "GET")) {
-		request_error(rq->fd, method, "501", "Not Implemented",
+/* fills rq->file_name from the request head of head_len bytes at buf.
+ * returns 0 after sending an error to the client. */
+static int
+request_parse(struct request *rq, const char *buf, int head_len)
+{
+	struct http_request req;
+	char method[MAXLINE];
+	unsigned long start = rq->start;
+
+	if (http_parse(buf, head_len, &req) < 0)
+		req.method.len = 0;
+	rq->http11 = http_slice_eq(req.version, "HTTP/1.1");
+	if (!http_slice_caseeq(req.method, "GET")) {
+		/* we don't know where this request ends, so we can't find
+		 * the next one either */
+		rq->keepalive = 0;
+		snprintf(method, sizeof(method), "%.*s", req.method.len,
+			 req.method.ptr);
+		request_error(rq, method, "501", "Not Implemented",
 			     "OS Web Server does not implement this method");
-		Rio_destroy(rio);
+		return 0;
+	}
+	/* HTTP/1.1 connections are persistent unless the client says
+	 * otherwise, see request_parse_headers */
+	rq->keepalive = rq->http11;
+	request_parse_headers(rq, &req);
+	if (http_slice_eq(req.uri, STATUS_URI))
+		rq->status_page = STATS_TEXT;
+	else if (http_slice_eq(req.uri, STATUS_URI "?json"))
+		rq->status_page = STATS_JSON;
+	rq->data->file_name = request_parse_URI(rq->arena, req.uri);
+	stats_time(PHASE_PARSE, start);
+	return 1;
+}
+
+/* entry point to this file */
+/* returns a pointer to a request struct, filling rq->fd with connfd,
+ * and rq->file_name with the file that is being requested.
+ * The request head is read into in, which belongs to the connection, so on
+ * a persistent connection it holds on to the start of any request that the
+ * client pipelined behind this one. The caller drops the head from in with
+ * http_buf_consume once done with the request.
+ * Returns NULL on failure, or when the client closed the connection.
+ * Either way, the caller closes connfd.
+ */
+struct request *
+request_init(int connfd, struct http_buf *in, struct file_data *data)
+{
+	struct request *rq;
+
+	if (!http_buf_read(in, connfd)) {
+		/* connection closed, reset, or idle for too long */
+		return NULL;
+	}
+	rq = request_alloc(connfd, data, NULL);
+	if (!request_parse(rq, in->data, in->head_len)) {
+		request_destroy(rq);
+		return NULL;
+	}
+	return rq;
+}
+
+/* like request_init, for front ends that do their own non-blocking socket
+ * I/O. in holds a complete request head (see http_buf_head) that was read
+ * from connfd, possibly followed by pipelined requests. Responses are
+ * formatted into out rather than written to connfd, except for the file
+ * body (see request_file_fd).
+ * Returns NULL on failure, after putting an error response in out. */
+struct request *
+request_init_buf(int connfd, struct http_buf *in, struct file_data *data,
+		 struct response_buf *out)
+{
+	struct request *rq;
+
+	assert(in->head_len > 0);
+	rq = request_alloc(connfd, data, out);
+	if (!request_parse(rq, in->data, in->head_len)) {
 		request_destroy(rq);
 		return NULL;
 	}
-	request_read_headers(rio);
-	request_parse_URI(uri, data->file_name, MAXLINE);
-	Rio_destroy(rio);
 	return rq;
 }
 
@@ -136,78 +490,231 @@ void
 request_destroy(struct request *rq)
 {
 	assert(rq);
-	/* close the connection fd */
-	SYS(close(rq->fd));
-	free(rq);
+	if (rq->status)
+		access_log_record(rq->start, rq->data->file_name, rq->status,
+				  rq->bytes, rq->cache, rq->http11);
+	if (rq->file_fd >= 0) {
+		/* the streamed file is no longer needed, see request_readfile */
+		SYS(posix_fadvise(rq->file_fd, 0, rq->data->file_size,
+				  POSIX_FADV_DONTNEED));
+		SYS(close(rq->file_fd));
+	}
+	/* the connection fd belongs to the caller */
+	if (!rq->arena)
+		free(rq);
 }
 
-/* read in filename corresponding to request. 
- * Returns 1 on success, and fills rq->file_buf, and rq->file_size.
- * Returns 0 on failure, sends error to client. */
-int
-request_readfile(struct request *rq)
+/* formats the header lines that only depend on the file, once per file
+ * read. see request_sendfile for the rest of the header. */
+static void
+request_prepare_header(struct file_data *data)
 {
-	int srcfd;
-	struct stat sbuf;
-	struct file_data *data;
-	char *ext;
+	char buf[MAXLINE];
 
-	data = rq->data;
-	assert(data);
+	data->file_type = request_get_file_type(data->file_name);
+	data->file_header_len = snprintf(buf, sizeof(buf),
+					 "Content-Type: %s\r\n"
+					 "Content-Length: %d\r\n"
+					 "Content-Csum: %u\r\n\r\n",
+					 data->file_type, data->file_size,
+					 data->file_csum);
+	data->file_header = Malloc(data->file_header_len + 1);
+	memcpy(data->file_header, buf, data->file_header_len + 1);
+}
 
+/* checks that the file asked for may be served at all, before looking at
+ * it. returns 0 after sending an error to the client, which may be one that
+ * the negative cache remembers from an earlier request for the file. */
+int
+request_check_name(struct request *rq)
+{
+	struct file_data *data = rq->data;
+	char *ext, tail[MAXBUF + MAXLINE];
+	int error, len;
+
+	if (neg_cache_enabled()) {
+		/* before looking at the file, see request_file_error */
+		rq->neg_gen = neg_cache_generation();
+		len = neg_cache_get(data->file_name, &error, tail,
+				    sizeof(tail));
+		if (len) {
+			rq->cache = ACCESS_NEGATIVE;
+			request_send_error(rq, request_file_error_head[error]
+					   [rq->http11][rq->keepalive],
+					   tail, len);
+			return 0;
+		}
+	}
+	rq->cache = ACCESS_MISS;
 	/* don't serve files that start with /, or .., or end in .c */
 	if (data->file_name[0] == '/') {
 		/* this shouldn't really happen because we add a "./" at the
 		 * beginning of the file path */
-		request_error(rq->fd, data->file_name, "404", "Not found",
-			      "OS Web Server doesn't serve files "
-			      "with absolute paths");
+		request_file_error(rq, ERROR_NOT_FOUND,
+				   "OS Web Server doesn't serve files "
+				   "with absolute paths", 1);
 		return 0;
 	}
 	if (strstr(data->file_name, "..") != NULL) {
-		request_error(rq->fd, data->file_name, "404", "Not found",
-			      "OS Web Server doesn't serve files "
-			      "with .. in the path");
+		request_file_error(rq, ERROR_NOT_FOUND,
+				   "OS Web Server doesn't serve files "
+				   "with .. in the path", 1);
 		return 0;
 	}
 	if (((ext = strrchr(data->file_name, '.')) != NULL) && 
 	    ((strcmp(ext, ".c") == 0) || (strcmp(ext, ".h") == 0))) {
-		request_error(rq->fd, data->file_name, "404", "Not found",
-			      "OS Web Server doesn't serve C or header files ");
+		request_file_error(rq, ERROR_NOT_FOUND,
+				   "OS Web Server doesn't serve C or header "
+				   "files ", 1);
 		return 0;
 	}
+	return 1;
+}
 
-	if (stat(data->file_name, &sbuf) < 0) {
-		request_error(rq->fd, data->file_name, "404", "Not found",
-			      "OS Web Server could not find this file");
+/* checks that the file can be served, given the error from stat'ing it,
+ * or 0 and its mode. returns 0 after sending an error to the client. */
+int
+request_check_file(struct request *rq, int stat_errno, unsigned int mode)
+{
+	if (stat_errno) {
+		/* errors that may go away by themselves, e.g., EIO, aren't
+		 * remembered */
+		request_file_error(rq, ERROR_NOT_FOUND,
+				   "OS Web Server could not find this file",
+				   stat_errno == ENOENT || stat_errno == ENOTDIR ||
+				   stat_errno == EACCES ||
+				   stat_errno == ENAMETOOLONG);
 		return 0;
 	}
-	if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
-		request_error(rq->fd, data->file_name, "403", "Forbidden",
-			      "OS Web Server could not read this file");
+	if (!(S_ISREG(mode)) || !(S_IRUSR & mode)) {
+		request_file_error(rq, ERROR_FORBIDDEN,
+				   "OS Web Server could not read this file", 1);
 		return 0;
 	}
+	return 1;
+}
 
-	data->file_size = sbuf.st_size;
+/* sends the error for err, once the file has changed since it was stat'ed,
+ * e.g., it went away, or shrank. its metadata is out of date, so it is
+ * forgotten. returns 0. */
+static int
+request_file_changed(struct request *rq, int err)
+{
+	stat_cache_invalidate(rq->data->file_name);
+	return request_check_file(rq, err, 0);
+}
+
+/* finishes reading a file whose file_size bytes have been read into
+ * file_buf by the caller, rather than by request_readfile */
+void
+request_file_loaded(struct request *rq)
+{
+	struct file_data *data = rq->data;
+	unsigned long start = stats_now();
 
 	if (data->file_size) {
-		SYS(srcfd = open(data->file_name, O_RDONLY, 0));
+		data->file_csum = csum_bytes(data->file_buf, data->file_size);
+		stats_time(PHASE_CSUM, start);
+	}
+	request_prepare_header(data);
+}
+
+/* read in filename corresponding to request. 
+ * Returns 1 on success, and fills rq->file_buf, and rq->file_size.
+ * Returns 0 on failure, sends error to client.
+ *
+ * Files of max_read bytes or more are not read into memory. They are left
+ * open, with file_buf set to NULL, and request_sendfile streams them to the
+ * client with sendfile(2), so a request never needs more than a bounded
+ * amount of memory. Use INT_MAX to always read the file. */
+int
+request_readfile(struct request *rq, int max_read)
+{
+	int srcfd;
+	ssize_t n;
+	struct stat sbuf;
+	struct file_data *data;
+	unsigned long start = stats_now();
+
+	data = rq->data;
+	assert(data);
+
+	if (!request_check_name(rq))
+		return 0;
+	if (stat_cache_stat(data->file_name, &sbuf) < 0)
+		return request_check_file(rq, errno, 0);
+	if (!request_check_file(rq, 0, sbuf.st_mode))
+		return 0;
+
+	data->file_size = sbuf.st_size;
+
+	if (data->file_size >= max_read) {
+		rq->file_fd = open(data->file_name, O_RDONLY, 0);
+		if (rq->file_fd < 0)
+			return request_file_changed(rq, errno);
+		start = stats_time(PHASE_READ, start);
+		/* the checksum is sent ahead of the file, so it must be known
+		 * without having the file in memory */
+		data->file_csum = file_index_csum(data->file_name,
+						  rq->file_fd, &sbuf);
+		stats_time(PHASE_CSUM, start);
+	} else if (data->file_size) {
+		srcfd = open(data->file_name, O_RDONLY, 0);
+		if (srcfd < 0)
+			return request_file_changed(rq, errno);
 		data->file_buf = Malloc(data->file_size);
-		Rio_read(srcfd, data->file_buf, data->file_size);
+		n = Rio_read(srcfd, data->file_buf, data->file_size);
 		/* ask the kernel to stop caching the file */
 		SYS(posix_fadvise(srcfd, 0, data->file_size, 
 				  POSIX_FADV_DONTNEED));
 		SYS(close(srcfd));
+		/* the rest of file_buf would be sent uninitialized */
+		if (n != data->file_size) {
+			free(data->file_buf);
+			data->file_buf = NULL;
+			data->file_size = 0;
+			return request_file_changed(rq, EIO);
+		}
 		/* we add this delay to simulate a disk. otherwise, file caching
 		 * doesn't have much benefit because a lot of the time is spent
 		 * in processing (see request_processfile below) and so
 		 * request_readfile does not have much impact. */
 		/* we don't need to add this delay any longer. */
 		/* usleep(1000); */
+		start = stats_time(PHASE_READ, start);
+		data->file_csum = csum_bytes(data->file_buf,
+					     data->file_size);
+		stats_time(PHASE_CSUM, start);
+	} else {
+		stats_time(PHASE_READ, start);
 	}
+	request_prepare_header(data);
 	return 1;
 }
 
+/* returns whether the connection stays open for another request */
+int
+request_keepalive(struct request *rq)
+{
+	return rq->keepalive;
+}
+
+/* lets the server refuse to keep the connection open, must be called before
+ * a response is sent */
+void
+request_set_keepalive(struct request *rq, int keepalive)
+{
+	rq->keepalive = rq->keepalive && keepalive;
+}
+
+/* returns the open file that request_readfile left for streaming, or -1 if
+ * the file is in rq->data->file_buf */
+int
+request_file_fd(struct request *rq)
+{
+	return rq->file_fd;
+}
+
 /* if you have previous file data, you can reuse it */
 void
 request_set_data(struct request *rq, struct file_data *data)
@@ -215,6 +722,10 @@ request_set_data(struct request *rq, struct file_data *data)
 	rq->data = data;
 }
 
+/* whether request_sendfile runs request_processfile, see
+ * request_set_processing */
+static int request_processing = 1;
+
 /* add some file processing delay.
  *
  * previously, the main reason for this function was that if we didn't do enough
@@ -237,37 +748,115 @@ request_processfile(struct request *rq)
 	}
 }
 
-/* send filename to the fd connection */
+/* turns the processing delay of every response that is sent from memory on
+ * (the default) or off. must be called before any request is served. */
 void
+request_set_processing(int processing)
+{
+	request_processing = processing;
+}
+
+/* the status line and the header lines that don't depend on the file,
+ * indexed by http11 and keepalive */
+static const char *request_status[2][2] = {
+	{ "HTTP/1.0 200 OK\r\nServer: OS Web Server\r\nConnection: close\r\n",
+	  "HTTP/1.0 200 OK\r\nServer: OS Web Server\r\n"
+	  "Connection: keep-alive\r\n" },
+	{ "HTTP/1.1 200 OK\r\nServer: OS Web Server\r\nConnection: close\r\n",
+	  "HTTP/1.1 200 OK\r\nServer: OS Web Server\r\n"
+	  "Connection: keep-alive\r\n" },
+};
+
+/* send filename to the fd connection. the header is put together from
+ * precomputed parts, so a response costs no work proportional to the file
+ * size, apart from request_processfile. returns 0 if the response could not
+ * be sent in full, in which case the connection must be closed. */
+int
 request_sendfile(struct request *rq)
 {
-	char filetype[MAXLINE], buf[MAXBUF];
-	int i;
-	unsigned int csum = 0;
 	struct file_data *data;
-	long size = 0;
+	const char *status;
+	struct iovec iov[3];
+	unsigned long start;
+	ssize_t sent;
+	int ok;
 
 	data = rq->data;
-	assert(data);
-
-	request_get_file_type(data->file_name, filetype);
-	/* generate a very trivial checksum */
-	for (i = 0; i < data->file_size; i++) {
-		csum += (unsigned char)(data->file_buf[i]);
+	assert(data && data->file_header);
+
+	/* streamed files are never in memory, so they are not processed */
+	if (rq->file_fd < 0 && request_processing) {
+		/* do some processing */
+		start = stats_now();
+		request_processfile(rq);
+		stats_time(PHASE_PROCESS, start);
+	}
+	status = request_status[rq->http11][rq->keepalive];
+	rq->status = 200;
+	rq->bytes = strlen(status) + data->file_header_len + data->file_size;
+	if (rq->cache == ACCESS_NONE)
+		rq->cache = ACCESS_HIT;
+	stats_response(rq->bytes);
+
+	/* buffered responses leave the body to the front end */
+	if (rq->out) {
+		request_write(rq, (char *)status, strlen(status));
+		request_write(rq, data->file_header, data->file_header_len);
+		return 1;
 	}
-	/* do some processing */
-	request_processfile(rq);
-	/* put together response */
-	size += sprintf(buf + size, "HTTP/1.0 200 OK\r\n");
-	size += sprintf(buf + size, "Server: OS Web Server\r\n");
-	size += sprintf(buf + size, "Content-Type: %s\r\n", filetype);
-	size += sprintf(buf + size, "Content-Length: %d\r\n", data->file_size);
-	size += sprintf(buf + size, "Content-Csum: %u\r\n\r\n", csum);
-
-	Rio_write(rq->fd, buf, strlen(buf));
-
-	/* writes data->file_buf to the client socket */
-	if (data->file_size > 0) {
-		Rio_write(rq->fd, data->file_buf, data->file_size);
+	/* writes the header and data->file_buf to the client socket */
+	start = stats_now();
+	iov[0].iov_base = (char *)status;
+	iov[0].iov_len = strlen(status);
+	iov[1].iov_base = data->file_header;
+	iov[1].iov_len = data->file_header_len;
+	if (rq->file_fd >= 0) {
+		ok = rio_writev(rq->fd, iov, 2) >= 0;
+		if (ok) {
+			sent = rio_sendfile(rq->fd, rq->file_fd,
+					    data->file_size);
+			ok = sent == data->file_size;
+			/* the file was truncated after the stat, and the
+			 * client got a short response */
+			if (sent >= 0 && !ok)
+				stat_cache_invalidate(data->file_name);
+		}
+	} else {
+		iov[2].iov_base = data->file_buf;
+		iov[2].iov_len = data->file_size;
+		ok = rio_writev(rq->fd, iov, 3) >= 0;
 	}
+	stats_time(PHASE_SEND, start);
+	return ok;
+}
+
+/* returns the format of the status page that the client asked for (see
+ * stats.h), or 0 if it asked for a file */
+int
+request_status_page(struct request *rq)
+{
+	return rq->status_page;
+}
+
+/* sends a response with len bytes of body, generated by the server, rather
+ * than read from a file. the body must be less than MAXBUF bytes. */
+void
+request_sendbuf(struct request *rq, const char *type, const char *body,
+		int len)
+{
+	char buf[MAXLINE];
+	int size;
+
+	assert(len < MAXBUF);
+	size = snprintf(buf, sizeof(buf), "%s"
+			"Content-Type: %s\r\n"
+			"Content-Length: %d\r\n"
+			"Content-Csum: %u\r\n\r\n",
+			request_status[rq->http11][rq->keepalive], type, len,
+			csum_bytes(body, len));
+	rq->status = 200;
+	rq->bytes = size + len;
+	stats_response(rq->bytes);
+	request_write(rq, buf, size);
+	request_write(rq, (char *)body, len);
 }
@@ -1,16 +1,61 @@
 #ifndef __REQUEST_H__
 #define __REQUEST_H__
 
+struct http_buf;
+struct arena;
+
 struct file_data {
 	char *file_name; /* name of file being requested */
 	char *file_buf;	 /* file is read into this buffer in memory */
 	int file_size;	 /* file size */
+	/* filled in once by request_readfile, so that every response that
+	 * sends this file, e.g., from the cache, reuses them */
+	unsigned int file_csum;
+	const char *file_type;	/* MIME type */
+	char *file_header;	/* the header lines that depend on the file */
+	int file_header_len;
+	/* the cache's generation for this file before it was read, see
+	 * cache_generation. cache_insert refuses it if it has changed. */
+	unsigned long cache_gen;
+	/* if not NULL, this struct and file_name are allocated from arena,
+	 * see file_data_detach */
+	struct arena *arena;
+};
+
+/* a buffer that responses are formatted into, rather than being written to
+ * the client, see request_init_buf */
+struct response_buf {
+	char *buf;
+	int size;	/* size of buf */
+	int len;	/* bytes in buf */
 };
 
-struct request *request_init(int connfd, struct file_data *data);
-int request_readfile(struct request *rq);
+/* if arena is not NULL, the file data, and the request that is started
+ * with it, are allocated from arena until file_data_detach */
+struct file_data *file_data_init(struct arena *arena);
+struct file_data *file_data_detach(struct file_data *data);
+void file_data_free(struct file_data *data);
+
+struct request *request_init(int connfd, struct http_buf *in,
+			     struct file_data *data);
+struct request *request_init_buf(int connfd, struct http_buf *in,
+				 struct file_data *data,
+				 struct response_buf *out);
+void request_reject(int connfd);
+int request_peek_file_name(int connfd, char *file_name, int size);
+int request_readfile(struct request *rq, int max_read);
+int request_check_name(struct request *rq);
+int request_check_file(struct request *rq, int stat_errno, unsigned int mode);
+void request_file_loaded(struct request *rq);
 void request_set_data(struct request *rq, struct file_data *data);
-void request_sendfile(struct request *rq);
+int request_sendfile(struct request *rq);
+void request_set_processing(int processing);
+int request_status_page(struct request *rq);
+void request_sendbuf(struct request *rq, const char *type, const char *body,
+		     int len);
+int request_file_fd(struct request *rq);
+int request_keepalive(struct request *rq);
+void request_set_keepalive(struct request *rq, int keepalive);
 void request_destroy(struct request *rq);
 
 #endif
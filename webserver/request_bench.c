@@ -0,0 +1,191 @@
+/*
+ * request_bench.c: Measures the cost of serving cache hits on one thread,
+ * from parsing the request head to formatting the response header, the way
+ * the epoll front end does it (see conn_start_response), with the request's
+ * objects allocated from an arena and with malloc.
+ *
+ * It is linked with malloc, calloc, realloc and free wrapped (see the
+ * Makefile), so that it can count allocator calls per request.
+ */
+
+#include "common.h"
+#include "request.h"
+#include "cache.h"
+#include "http.h"
+#include "arena.h"
+
+#define NAME_FMT "fileset_dir/%05d"
+
+static long nr_alloc_calls;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+void *
+__wrap_malloc(size_t size)
+{
+	nr_alloc_calls++;
+	return __real_malloc(size);
+}
+
+void *
+__wrap_calloc(size_t nmemb, size_t size)
+{
+	nr_alloc_calls++;
+	return __real_calloc(nmemb, size);
+}
+
+void *
+__wrap_realloc(void *ptr, size_t size)
+{
+	nr_alloc_calls++;
+	return __real_realloc(ptr, size);
+}
+
+/* free(NULL) does no work, so it isn't counted */
+void
+__wrap_free(void *ptr)
+{
+	if (ptr)
+		nr_alloc_calls++;
+	__real_free(ptr);
+}
+
+/* fills the cache with nr_files small files, as request_readfile would */
+static void
+fill_cache(Cache *cache, int nr_files)
+{
+	struct file_data *data;
+	CacheNode *entry;
+	char header[MAXLINE];
+	int i;
+
+	for (i = 0; i < nr_files; i++) {
+		data = file_data_init(NULL);
+		data->file_name = Malloc(64);
+		sprintf(data->file_name, "./" NAME_FMT, i);
+		data->file_size = 1024;
+		data->file_buf = Malloc(data->file_size);
+		memset(data->file_buf, 'a', data->file_size);
+		data->file_header_len = sprintf(header, "Content-Type: "
+						"text/plain\r\nContent-Length: "
+						"%d\r\n\r\n", data->file_size);
+		data->file_header = Malloc(data->file_header_len + 1);
+		strcpy(data->file_header, header);
+		entry = cache_insert(cache, data);
+		assert(entry);
+		cache_release(cache, entry);
+		file_data_free(data);
+	}
+}
+
+/* serves one hit for the request head in, and drops the head */
+static void
+serve_hit(Cache *cache, struct http_buf *in, struct arena *arena,
+	  struct response_buf *out)
+{
+	struct file_data *data;
+	struct request *rq;
+	CacheNode *entry;
+	CacheFlight *flight;
+
+	data = file_data_init(arena);
+	rq = request_init_buf(-1, in, data, out);
+	assert(rq);
+	entry = cache_lookup_load(cache, data->file_name, &flight);
+	assert(entry);
+	request_set_data(rq, entry->data);
+	request_sendfile(rq);
+	request_destroy(rq);
+	cache_release(cache, entry);
+	file_data_free(data);
+	if (arena)
+		arena_reset(arena);
+	http_buf_consume(in);
+	out->len = 0;
+}
+
+/* returns the number of requests per second, and sets *alloc_calls to the
+ * allocator calls per request */
+static double
+run_bench(int use_arena, int nr_files, long nr_requests, double *alloc_calls)
+{
+	Cache cache;
+	struct http_buf *in = Malloc(sizeof(struct http_buf));
+	struct arena *arena = Malloc(sizeof(struct arena));
+	struct response_buf out;
+	char out_buf[MAXBUF];
+	struct timeval start, end, diff;
+	unsigned int seed = 1;
+	long i, calls;
+
+	cache_init(&cache, nr_files * 2048, POLICY_LFF);
+	fill_cache(&cache, nr_files);
+	arena_init(arena);
+	http_buf_init(in);
+	out.buf = out_buf;
+	out.size = sizeof(out_buf);
+	out.len = 0;
+
+	calls = nr_alloc_calls;
+	gettimeofday(&start, NULL);
+	for (i = 0; i < nr_requests; i++) {
+		in->len = sprintf(in->data, "GET " NAME_FMT " HTTP/1.1\r\n"
+				  "host: localhost\r\n\r\n",
+				  rand_r(&seed) % nr_files);
+		http_buf_head(in);
+		serve_hit(&cache, in, use_arena ? arena : NULL, &out);
+	}
+	gettimeofday(&end, NULL);
+	timersub(&end, &start, &diff);
+	*alloc_calls = (double)(nr_alloc_calls - calls) / nr_requests;
+
+	cache_destroy(&cache);
+	free(arena);
+	free(in);
+	return nr_requests / (diff.tv_sec + diff.tv_usec / 1e6);
+}
+
+static void
+usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-f nr_files] [-n nr_requests]\n", program);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	int nr_files = 1000;
+	long nr_requests = 2000000;
+	double alloc_calls, rate;
+	int c, use_arena;
+
+	while ((c = getopt(argc, argv, "f:n:")) != -1) {
+		switch (c) {
+		case 'f':
+			nr_files = atoi(optarg);
+			break;
+		case 'n':
+			nr_requests = atol(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc || nr_files <= 0 || nr_requests <= 0)
+		usage(argv[0]);
+
+	request_set_processing(0);
+	for (use_arena = 0; use_arena < 2; use_arena++) {
+		rate = run_bench(use_arena, nr_files, nr_requests,
+				 &alloc_calls);
+		printf("allocation = %s, Mrequests/s = %.2f, "
+		       "allocator calls per request = %.2f\n",
+		       use_arena ? "arena" : "malloc", rate / 1e6,
+		       alloc_calls);
+	}
+	return 0;
+}
@@ -0,0 +1,288 @@
+/*
+ * ring.c: A bounded lock-free MPMC queue, based on Dmitry Vyukov's
+ * sequence-numbered array queue, with futex-based waiting.
+ */
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include "common.h"
+#include "ring.h"
+
+#define CACHE_LINE 64
+
+/* Slot i is free for the enqueue at position pos when its seq is 2 * pos,
+ * and holds the item for the dequeue at position pos when its seq is
+ * 2 * pos + 1. The dequeue then sets seq to 2 * (pos + size), for the next
+ * enqueue position that maps to the same slot. (Vyukov's queue uses pos and
+ * pos + 1, which can't tell a full slot from a free one when size is 1.) */
+struct ring_cell {
+	unsigned long seq;
+	int item;
+};
+
+/* Threads that wait for the ring to become non-empty (or non-full) sleep on
+ * epoch, which is bumped by every wakeup. A thread reads epoch before it
+ * checks the ring one last time, so a wakeup between the check and the
+ * futex wait makes the wait return immediately.
+ *
+ * state holds the number of waiters in its upper half, and in its lower
+ * half, the number of wakeups that haven't been consumed by a waiter
+ * checking the ring again. They are updated together so that a burst of
+ * items doesn't make a futex call per item, but never skips a wakeup that a
+ * waiter needs. */
+struct ring_waitq {
+	int epoch;
+	unsigned long state;
+};
+
+#define WAITER (1UL << 32)
+#define NR_WAITERS(state) ((state) >> 32)
+#define NR_WAKEUPS(state) ((state) & (WAITER - 1))
+
+struct ring {
+	/* the producer and consumer positions are on separate cache lines */
+	unsigned long head __attribute__((aligned(CACHE_LINE)));
+	unsigned long tail __attribute__((aligned(CACHE_LINE)));
+	struct ring_waitq not_empty __attribute__((aligned(CACHE_LINE)));
+	struct ring_waitq not_full;
+	int closed;
+	int size;
+	struct ring_cell *cells;
+};
+
+static void
+futex_wait(int *addr, int val)
+{
+	/* EAGAIN (the epoch has changed) and EINTR simply mean that the
+	 * caller should check the ring again */
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void
+futex_wake(int *addr, int nr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, nr, NULL, NULL, 0);
+}
+
+static void
+ring_wakeup(struct ring_waitq *q, int nr)
+{
+	unsigned long state, next;
+
+	/* orders the ring update before reading state. pairs with the fence
+	 * in ring_wait_begin. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	state = __atomic_load_n(&q->state, __ATOMIC_SEQ_CST);
+	do {
+		/* when there are as many wakeups as waiters, every waiter
+		 * will check the ring again anyway */
+		if (NR_WAKEUPS(state) >= NR_WAITERS(state))
+			return;
+		if (nr == INT_MAX)
+			next = state - NR_WAKEUPS(state) + NR_WAITERS(state);
+		else
+			next = state + 1;
+	} while (!__atomic_compare_exchange_n(&q->state, &state, next, 0,
+					      __ATOMIC_SEQ_CST,
+					      __ATOMIC_SEQ_CST));
+	__atomic_fetch_add(&q->epoch, 1, __ATOMIC_SEQ_CST);
+	futex_wake(&q->epoch, nr);
+}
+
+/* registers the caller as a waiter, and returns the epoch to wait on. the
+ * caller must check the ring again before calling ring_wait_end. */
+static int
+ring_wait_begin(struct ring_waitq *q)
+{
+	int epoch = __atomic_load_n(&q->epoch, __ATOMIC_SEQ_CST);
+
+	__atomic_fetch_add(&q->state, WAITER, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return epoch;
+}
+
+/* the caller must check the ring again after this */
+static void
+ring_wait_end(struct ring_waitq *q, int epoch, int sleep)
+{
+	unsigned long state, next;
+
+	if (sleep)
+		futex_wait(&q->epoch, epoch);
+	/* consume a wakeup, whether or not it was meant for this waiter. at
+	 * worst, a later ring_wakeup makes an extra futex call. */
+	state = __atomic_load_n(&q->state, __ATOMIC_SEQ_CST);
+	do {
+		next = state - WAITER;
+		if (NR_WAKEUPS(state) > 0)
+			next--;
+	} while (!__atomic_compare_exchange_n(&q->state, &state, next, 0,
+					      __ATOMIC_SEQ_CST,
+					      __ATOMIC_SEQ_CST));
+}
+
+struct ring *
+ring_init(int size)
+{
+	struct ring *r;
+	int i;
+
+	assert(size > 0);
+	r = aligned_alloc(CACHE_LINE, sizeof(struct ring));
+	assert(r);
+	r->head = 0;
+	r->tail = 0;
+	r->not_empty.epoch = 0;
+	r->not_empty.state = 0;
+	r->not_full.epoch = 0;
+	r->not_full.state = 0;
+	r->closed = 0;
+	r->size = size;
+	r->cells = Malloc(sizeof(struct ring_cell) * size);
+	for (i = 0; i < size; i++) {
+		r->cells[i].seq = 2 * i;
+		r->cells[i].item = -1;
+	}
+	return r;
+}
+
+void
+ring_destroy(struct ring *r)
+{
+	free(r->cells);
+	free(r);
+}
+
+static int
+ring_enqueue(struct ring *r, int item)
+{
+	struct ring_cell *cell;
+	unsigned long pos, seq;
+	long dif;
+
+	pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	while (1) {
+		cell = &r->cells[pos % r->size];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		dif = (long)(seq - 2 * pos);
+		if (dif == 0) {
+			/* the slot is free, claim it. on failure, pos is
+			 * updated to the current head. */
+			if (__atomic_compare_exchange_n(&r->head, &pos, pos + 1,
+							1, __ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0) {
+			/* the slot still holds an item from the previous
+			 * round, the ring is full */
+			return 0;
+		} else {
+			/* another producer got here first */
+			pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+		}
+	}
+	cell->item = item;
+	__atomic_store_n(&cell->seq, 2 * pos + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+static int
+ring_dequeue(struct ring *r, int *item)
+{
+	struct ring_cell *cell;
+	unsigned long pos, seq;
+	long dif;
+
+	pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+	while (1) {
+		cell = &r->cells[pos % r->size];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		dif = (long)(seq - (2 * pos + 1));
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&r->tail, &pos, pos + 1,
+							1, __ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0) {
+			/* the slot hasn't been filled yet, the ring is
+			 * empty */
+			return 0;
+		} else {
+			pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+		}
+	}
+	*item = cell->item;
+	__atomic_store_n(&cell->seq, 2 * (pos + r->size), __ATOMIC_RELEASE);
+	return 1;
+}
+
+int
+ring_tryput(struct ring *r, int item)
+{
+	if (!ring_enqueue(r, item))
+		return 0;
+	ring_wakeup(&r->not_empty, 1);
+	return 1;
+}
+
+int
+ring_tryget(struct ring *r, int *item)
+{
+	if (!ring_dequeue(r, item))
+		return 0;
+	ring_wakeup(&r->not_full, 1);
+	return 1;
+}
+
+void
+ring_put(struct ring *r, int item)
+{
+	int epoch, ok;
+
+	while (!ring_enqueue(r, item)) {
+		/* ring is full */
+		epoch = ring_wait_begin(&r->not_full);
+		ok = ring_enqueue(r, item);
+		ring_wait_end(&r->not_full, epoch, !ok);
+		if (ok)
+			break;
+	}
+	ring_wakeup(&r->not_empty, 1);
+}
+
+int
+ring_get(struct ring *r, int *item)
+{
+	int epoch, ok, closed;
+
+	while (!ring_dequeue(r, item)) {
+		/* ring is empty */
+		epoch = ring_wait_begin(&r->not_empty);
+		ok = ring_dequeue(r, item);
+		closed = __atomic_load_n(&r->closed, __ATOMIC_ACQUIRE);
+		ring_wait_end(&r->not_empty, epoch, !ok && !closed);
+		if (ok)
+			break;
+		if (closed)
+			return 0;
+	}
+	ring_wakeup(&r->not_full, 1);
+	return 1;
+}
+
+int
+ring_count(struct ring *r)
+{
+	unsigned long tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+	unsigned long head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+
+	/* the positions are read separately, so a get can slip in between */
+	return head > tail ? head - tail : 0;
+}
+
+void
+ring_close(struct ring *r)
+{
+	__atomic_store_n(&r->closed, 1, __ATOMIC_RELEASE);
+	ring_wakeup(&r->not_empty, INT_MAX);
+}
@@ -0,0 +1,39 @@
+#ifndef __RING_H__
+#define __RING_H__
+
+/* Bounded multi-producer/multi-consumer queue of ints (e.g., connection fds).
+ *
+ * The ring is lock-free: each slot carries a sequence number that tells
+ * producers and consumers whose turn it is to use the slot, so an enqueue or
+ * dequeue is a single compare-and-swap on the head or tail position. Threads
+ * only sleep, on a futex, when the ring is full (producers) or empty
+ * (consumers), and they are only woken up when somebody is actually
+ * sleeping. */
+
+struct ring;
+
+/* creates a ring that holds at most size items */
+struct ring *ring_init(int size);
+void ring_destroy(struct ring *r);
+
+/* non-blocking versions, return 1 on success and 0 if the ring is full or
+ * empty. like the blocking ones, they wake up a waiting thread on the other
+ * side. */
+int ring_tryput(struct ring *r, int item);
+int ring_tryget(struct ring *r, int *item);
+
+/* adds item to the ring, waiting while the ring is full */
+void ring_put(struct ring *r, int item);
+
+/* removes the oldest item from the ring, waiting while the ring is empty.
+ * returns 0 once the ring has been closed and all its items removed. */
+int ring_get(struct ring *r, int *item);
+
+/* returns roughly how many items are in the ring. it may be off while
+ * items are being added or removed. */
+int ring_count(struct ring *r);
+
+/* wakes up all waiting consumers. no items may be added after this. */
+void ring_close(struct ring *r);
+
+#endif /* __RING_H__ */
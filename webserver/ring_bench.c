@@ -0,0 +1,246 @@
+/*
+ * ring_bench.c: Measures the throughput of handing off items from producer
+ * threads to consumer threads, as the server does with connection fds, using
+ * the lock-free ring and using a mutex/condition variable queue.
+ */
+
+#include "common.h"
+#include "ring.h"
+
+/* the queue that the server used before the ring: a circular buffer guarded
+ * by a mutex, with one condition variable for producers and one for
+ * consumers */
+struct mutex_queue {
+	int *buf;
+	int size;	/* holds at most size - 1 items */
+	int head;
+	int tail;
+	int closed;
+	pthread_mutex_t mutex;
+	pthread_cond_t prod_cond;
+	pthread_cond_t cons_cond;
+};
+
+static struct mutex_queue *
+mutex_queue_init(int size)
+{
+	struct mutex_queue *q = Malloc(sizeof(struct mutex_queue));
+
+	q->size = size + 1;
+	q->buf = Malloc(sizeof(int) * q->size);
+	q->head = 0;
+	q->tail = 0;
+	q->closed = 0;
+	pthread_mutex_init(&q->mutex, NULL);
+	pthread_cond_init(&q->prod_cond, NULL);
+	pthread_cond_init(&q->cons_cond, NULL);
+	return q;
+}
+
+static void
+mutex_queue_destroy(struct mutex_queue *q)
+{
+	pthread_mutex_destroy(&q->mutex);
+	pthread_cond_destroy(&q->prod_cond);
+	pthread_cond_destroy(&q->cons_cond);
+	free(q->buf);
+	free(q);
+}
+
+static void
+mutex_queue_put(struct mutex_queue *q, int item)
+{
+	pthread_mutex_lock(&q->mutex);
+	while ((q->head - q->tail + q->size) % q->size == q->size - 1) {
+		/* queue is full */
+		pthread_cond_wait(&q->prod_cond, &q->mutex);
+	}
+	q->buf[q->head] = item;
+	q->head = (q->head + 1) % q->size;
+	pthread_cond_signal(&q->cons_cond);
+	pthread_mutex_unlock(&q->mutex);
+}
+
+static int
+mutex_queue_get(struct mutex_queue *q, int *item)
+{
+	pthread_mutex_lock(&q->mutex);
+	while (q->head == q->tail) {
+		/* queue is empty */
+		if (q->closed) {
+			pthread_mutex_unlock(&q->mutex);
+			return 0;
+		}
+		pthread_cond_wait(&q->cons_cond, &q->mutex);
+	}
+	*item = q->buf[q->tail];
+	q->tail = (q->tail + 1) % q->size;
+	pthread_cond_signal(&q->prod_cond);
+	pthread_mutex_unlock(&q->mutex);
+	return 1;
+}
+
+static void
+mutex_queue_close(struct mutex_queue *q)
+{
+	pthread_mutex_lock(&q->mutex);
+	q->closed = 1;
+	pthread_cond_broadcast(&q->cons_cond);
+	pthread_mutex_unlock(&q->mutex);
+}
+
+struct bench {
+	int use_ring;
+	struct ring *ring;
+	struct mutex_queue *mq;
+	long nr_items;		/* items added by each producer */
+	long total;		/* sum of the items removed */
+	long count;		/* number of items removed */
+};
+
+static void *
+producer(void *arg)
+{
+	struct bench *b = (struct bench *)arg;
+	long i;
+
+	for (i = 0; i < b->nr_items; i++) {
+		/* the items are small ints, like fds */
+		if (b->use_ring)
+			ring_put(b->ring, i & 1023);
+		else
+			mutex_queue_put(b->mq, i & 1023);
+	}
+	return NULL;
+}
+
+static void *
+consumer(void *arg)
+{
+	struct bench *b = (struct bench *)arg;
+	long total = 0, count = 0;
+	int item;
+
+	while (b->use_ring ? ring_get(b->ring, &item) :
+	       mutex_queue_get(b->mq, &item)) {
+		total += item;
+		count++;
+	}
+	__atomic_fetch_add(&b->total, total, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&b->count, count, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+/* returns the number of seconds taken to hand off all the items */
+static double
+run_bench(int use_ring, int nr_producers, int nr_consumers, int size,
+	  long nr_items)
+{
+	struct bench b;
+	pthread_t *threads;
+	struct timeval start, end, diff;
+	long i, expected = 0;
+
+	b.use_ring = use_ring;
+	b.ring = use_ring ? ring_init(size) : NULL;
+	b.mq = use_ring ? NULL : mutex_queue_init(size);
+	b.nr_items = nr_items / nr_producers;
+	b.total = 0;
+	b.count = 0;
+	threads = Malloc(sizeof(pthread_t) * (nr_producers + nr_consumers));
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < nr_consumers; i++) {
+		SYS(pthread_create(&threads[i], NULL, consumer, &b));
+	}
+	for (i = 0; i < nr_producers; i++) {
+		SYS(pthread_create(&threads[nr_consumers + i], NULL, producer,
+				   &b));
+	}
+	for (i = 0; i < nr_producers; i++) {
+		pthread_join(threads[nr_consumers + i], NULL);
+	}
+	if (use_ring)
+		ring_close(b.ring);
+	else
+		mutex_queue_close(b.mq);
+	for (i = 0; i < nr_consumers; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	gettimeofday(&end, NULL);
+	timersub(&end, &start, &diff);
+
+	/* every item must be handed off exactly once */
+	for (i = 0; i < b.nr_items; i++) {
+		expected += i & 1023;
+	}
+	assert(b.count == b.nr_items * nr_producers);
+	assert(b.total == expected * nr_producers);
+
+	if (use_ring)
+		ring_destroy(b.ring);
+	else
+		mutex_queue_destroy(b.mq);
+	free(threads);
+	return diff.tv_sec + diff.tv_usec / 1e6;
+}
+
+static void
+usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-p nr_producers] [-c nr_consumers] "
+		"[-s size] [-n nr_items]\n", program);
+	exit(1);
+}
+
+/* by default, runs with 1 producer, like the server's accept loop, and 1 to
+ * 16 consumers */
+int
+main(int argc, char **argv)
+{
+	int nr_producers = 1, nr_consumers = 0, size = 64;
+	long nr_items = 2000000;
+	int c, i, q;
+	double t;
+
+	while ((c = getopt(argc, argv, "p:c:s:n:")) != -1) {
+		switch (c) {
+		case 'p':
+			nr_producers = atoi(optarg);
+			break;
+		case 'c':
+			nr_consumers = atoi(optarg);
+			break;
+		case 's':
+			size = atoi(optarg);
+			break;
+		case 'n':
+			nr_items = atol(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc || nr_producers <= 0 || nr_consumers < 0 ||
+	    size <= 0 || nr_items <= 0) {
+		usage(argv[0]);
+	}
+
+	for (i = 1; i <= 16; i *= 2) {
+		int consumers = nr_consumers ? nr_consumers : i;
+
+		for (q = 0; q < 2; q++) {
+			t = run_bench(q, nr_producers, consumers, size,
+				      nr_items);
+			printf("queue = %s, producers = %d, consumers = %d, "
+			       "size = %d, items = %ld, seconds = %f, "
+			       "Mitems/s = %.2f\n", q ? "ring" : "mutex",
+			       nr_producers, consumers, size,
+			       nr_items / nr_producers * nr_producers, t,
+			       nr_items / nr_producers * nr_producers / t / 1e6);
+		}
+		if (nr_consumers)
+			break;
+	}
+	return 0;
+}
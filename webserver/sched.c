@@ -0,0 +1,158 @@
+/*
+ * sched.c: A priority queue of pending connections.
+ */
+
+#include "common.h"
+#include "sched.h"
+
+struct sched_job {
+	unsigned long key;
+	int fd;
+};
+
+struct sched {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	/* the epoch has moved on */
+	unsigned long epoch;
+	int nr_waiters;
+	int closed;
+	struct sched_job *heap;	/* heap[0] has the smallest key */
+	int nr_jobs;
+	int size;		/* of heap */
+};
+
+struct sched *
+sched_init(void)
+{
+	struct sched *q = Malloc(sizeof(struct sched));
+
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->cond, NULL);
+	q->epoch = 0;
+	q->nr_waiters = 0;
+	q->closed = 0;
+	q->size = 64;
+	q->nr_jobs = 0;
+	q->heap = Malloc(sizeof(struct sched_job) * q->size);
+	return q;
+}
+
+void
+sched_destroy(struct sched *q)
+{
+	assert(q->nr_jobs == 0);
+	assert(q->nr_waiters == 0);
+	pthread_cond_destroy(&q->cond);
+	pthread_mutex_destroy(&q->lock);
+	free(q->heap);
+	free(q);
+}
+
+/* called with the lock held */
+static void
+sched_wakeup(struct sched *q)
+{
+	/* pairs with sched_epoch, so a waiter that sees the new epoch sees
+	 * what was queued before it */
+	__atomic_store_n(&q->epoch, q->epoch + 1, __ATOMIC_RELEASE);
+	if (q->nr_waiters > 0)
+		pthread_cond_signal(&q->cond);
+}
+
+void
+sched_push(struct sched *q, int fd, unsigned long key)
+{
+	struct sched_job *heap;
+	int i, parent;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->nr_jobs == q->size) {
+		q->size *= 2;
+		q->heap = realloc(q->heap, sizeof(struct sched_job) * q->size);
+		assert(q->heap);
+	}
+	heap = q->heap;
+	/* sift up from the end */
+	for (i = q->nr_jobs++; i > 0; i = parent) {
+		parent = (i - 1) / 2;
+		if (heap[parent].key <= key)
+			break;
+		heap[i] = heap[parent];
+	}
+	heap[i].key = key;
+	heap[i].fd = fd;
+	sched_wakeup(q);
+	pthread_mutex_unlock(&q->lock);
+}
+
+int
+sched_pop(struct sched *q, int *fd)
+{
+	struct sched_job *heap, last;
+	int i, child;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->nr_jobs == 0) {
+		pthread_mutex_unlock(&q->lock);
+		return 0;
+	}
+	heap = q->heap;
+	*fd = heap[0].fd;
+	/* sift the last job down from the top */
+	last = heap[--q->nr_jobs];
+	for (i = 0; (child = 2 * i + 1) < q->nr_jobs; i = child) {
+		if (child + 1 < q->nr_jobs &&
+		    heap[child + 1].key < heap[child].key)
+			child++;
+		if (last.key <= heap[child].key)
+			break;
+		heap[i] = heap[child];
+	}
+	heap[i] = last;
+	pthread_mutex_unlock(&q->lock);
+	return 1;
+}
+
+int
+sched_count(struct sched *q)
+{
+	return __atomic_load_n(&q->nr_jobs, __ATOMIC_RELAXED);
+}
+
+unsigned long
+sched_epoch(struct sched *q)
+{
+	return __atomic_load_n(&q->epoch, __ATOMIC_ACQUIRE);
+}
+
+int
+sched_wait(struct sched *q, unsigned long epoch)
+{
+	int moved;
+
+	pthread_mutex_lock(&q->lock);
+	q->nr_waiters++;
+	while (q->epoch == epoch && !q->closed)
+		pthread_cond_wait(&q->cond, &q->lock);
+	q->nr_waiters--;
+	moved = q->epoch != epoch;
+	pthread_mutex_unlock(&q->lock);
+	return moved;
+}
+
+void
+sched_kick(struct sched *q)
+{
+	pthread_mutex_lock(&q->lock);
+	sched_wakeup(q);
+	pthread_mutex_unlock(&q->lock);
+}
+
+void
+sched_close(struct sched *q)
+{
+	pthread_mutex_lock(&q->lock);
+	q->closed = 1;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
@@ -0,0 +1,46 @@
+#ifndef __SCHED_H__
+#define __SCHED_H__
+
+/* A priority queue of pending connections, for size-aware scheduling.
+ *
+ * Each connection is queued with a key, and the one with the smallest key is
+ * served first. The server uses its arrival time plus a cost for the size of
+ * its response as the key, so small responses go first, and a large one
+ * still gets its turn once it has waited as long as its size is worth. The
+ * queue is a binary heap under a mutex, which grows as needed.
+ *
+ * Idle workers wait on the queue, rather than on whatever feeds it, so that
+ * a connection that is pushed wakes one of them. A waiter takes the epoch
+ * first, checks for work, and then waits for the epoch to move on, so that
+ * it can't miss a push, or a kick, in between. */
+
+struct sched;
+
+struct sched *sched_init(void);
+void sched_destroy(struct sched *q);
+
+/* queues fd, and wakes up a waiter */
+void sched_push(struct sched *q, int fd, unsigned long key);
+
+/* removes the connection with the smallest key. returns 0 if there is
+ * none. */
+int sched_pop(struct sched *q, int *fd);
+
+/* returns roughly how many connections are queued */
+int sched_count(struct sched *q);
+
+/* returns the epoch, which moves on with each push and kick */
+unsigned long sched_epoch(struct sched *q);
+
+/* waits until the epoch moves on from epoch. returns 0, without waiting, if
+ * the queue is closed and the epoch hasn't moved on. */
+int sched_wait(struct sched *q, unsigned long epoch);
+
+/* wakes up a waiter, e.g., once a connection is queued elsewhere for the
+ * waiters to move here */
+void sched_kick(struct sched *q);
+
+/* wakes up every waiter, and stops sched_wait from waiting */
+void sched_close(struct sched *q);
+
+#endif /* __SCHED_H__ */
@@ -2,12 +2,68 @@
 #include "common.h"
 #include "request.h"
 #include "server_thread.h"
+#include "server_event.h"
+#include "server_uring.h"
+#include "file_index.h"
+#include "stat_cache.h"
+#include "neg_cache.h"
+#include "policy.h"
+#include "cache.h"
+#include "stats.h"
+#include "access_log.h"
 
 /* 
  * server.c: A very, very simple web server
  *
  * To run:
- *  server portnum nr_threads max_requests max_cache_size
+ *  server [-m mode] [-k secs] [-z] [-x index] [-c policy] [-S nr_shards]
+ *         [-n] [-a min:max] [-q target_ms[:interval_ms]] [-s] [-i nr_io]
+ *         [-w] [-l|-L file] [-T file[:rate]] [-H] portnum
+ *         nr_threads max_requests max_cache_size
+ *
+ *  -m: "threads" (the default) hands each connection to a pool of nr_threads
+ *      worker threads through a queue of max_requests connections.
+ *      "epoll" serves connections from nr_threads event loops instead, and
+ *      ignores max_requests.
+ *      "reuseport" has each of nr_threads worker threads accept and serve
+ *      connections on its own socket, and ignores max_requests.
+ *      "uring" serves connections from nr_threads io_uring loops, and
+ *      ignores max_requests and -z.
+ *  -k: keep connections open for more requests, as long as they don't idle
+ *      for more than secs seconds (0, the default, closes every connection
+ *      after one request)
+ *  -z: stream files that are too large for the cache with sendfile, instead
+ *      of reading them into memory
+ *  -x: read precomputed file checksums from index (e.g., fileset_dir.idx)
+ *  -c: evict files from the cache with policy "lff" (largest file first, the
+ *      default), "lru", "clock", "s3fifo" or "gdsf"
+ *  -S: split the cache in nr_shards shards, each with a lock and an
+ *      eviction policy of its own (default 64). eviction takes from the
+ *      shards in turn, so with more than one, a policy only orders the
+ *      files within a shard.
+ *  -n: don't add the simulated processing delay (request_processfile) to
+ *      responses sent from memory
+ *  -a: in threads mode, grow and shrink the pool of worker threads between
+ *      min and max threads as the load changes, starting from nr_threads
+ *  -q: in threads mode, turn connections away with a 503 once they have
+ *      waited in the queue for more than target_ms for a whole interval_ms
+ *      (100 by default), after CoDel. the queue then holds at least LISTENQ
+ *      connections.
+ *  -s: in threads mode, serve the queued connections whose responses are
+ *      smallest first, rather than in the order they arrived. a large one
+ *      still gets its turn once it has waited as long as its size is worth.
+ *  -i: in epoll mode, read files for cache misses on a pool of nr_io
+ *      threads, so that the event loops go on serving hits meanwhile
+ *  -w: watch the files for changes with inotify (see fswatch.h), and drop
+ *      what is remembered about a file once it changes. this also turns on
+ *      the stat cache and the cache of error responses, which can only be
+ *      kept while the files are watched.
+ *  -l: log every response to file, as binary records (see access_log.h,
+ *      and access_log_decode)
+ *  -L: same, in Common Log Format
+ *  -T: instead, record a trace of the files sent, for cache_sim, sampling
+ *      rate of them (0.01 samples 1%, the default is all of them)
+ *  -H: back the cache's memory with (transparent) huge pages
  *
  * Repeatedly handles HTTP requests sent to this port number. Most of the work
  * is done within routines written in server_thread.c and request.c
@@ -16,8 +72,11 @@
 static void
 usage(char *program)
 {
-	fprintf(stderr, "Usage: %s port nr_threads max_requests "
-		"max_cache_size\n", program);
+	fprintf(stderr, "Usage: %s [-m threads|epoll|reuseport|uring] [-k secs] [-z] "
+		"[-x index] [-c lff|lru|clock|s3fifo|gdsf] [-S nr_shards] [-n] "
+		"[-a min:max] [-q target_ms[:interval_ms]] [-s] [-i nr_io] "
+		"[-w] [-l|-L file] [-T file[:rate]] [-H] port nr_threads "
+		"max_requests max_cache_size\n", program);
 	exit(1);
 }
 
@@ -52,6 +111,35 @@ close_fifo(void)
 	unlink(fifo);
 }
 
+/* in epoll and uring modes, the loops accept connections themselves, and the
+ * main thread only waits for an exit event */
+static void
+run_event_server(int port, int nr_threads, int max_cache_size)
+{
+	struct event_server *sv = NULL;
+	struct uring_server *usv = NULL;
+	int listenfd;
+	struct pollfd fds[1];
+
+	listenfd = open_listenfd(port);
+	if (server_opts.mode == SERVER_URING)
+		usv = uring_server_init(nr_threads, max_cache_size, listenfd);
+	else
+		sv = event_server_init(nr_threads, max_cache_size, listenfd);
+	fds[0].fd = open_fifo();
+	fds[0].events = POLLIN;
+	do {
+		SYS(poll(fds, 1, -1));
+	} while (!(fds[0].revents & POLLIN));
+
+	close_fifo();
+	if (usv)
+		uring_server_exit(usv);
+	else
+		event_server_exit(sv);
+	SYS(close(listenfd));
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -60,13 +148,106 @@ main(int argc, char *argv[])
 	int exitfd;
 	struct sockaddr_in clientaddr;
 	struct server *sv;
+	char *access_log = NULL;
+	int access_format = ACCESS_LOG_BINARY;
+	double access_rate = 1;
+	char *p;
+	int c;
 
-	if (argc != 5)
+	server_opts.cache_shards = CACHE_SHARDS;
+	while ((c = getopt(argc, argv, "m:k:zx:c:S:na:q:si:wl:L:T:H")) != -1) {
+		switch (c) {
+		case 'm':
+			if (strcmp(optarg, "threads") == 0)
+				server_opts.mode = SERVER_THREADS;
+			else if (strcmp(optarg, "epoll") == 0)
+				server_opts.mode = SERVER_EPOLL;
+			else if (strcmp(optarg, "reuseport") == 0)
+				server_opts.mode = SERVER_REUSEPORT;
+			else if (strcmp(optarg, "uring") == 0)
+				server_opts.mode = SERVER_URING;
+			else
+				usage(argv[0]);
+			break;
+		case 'k':
+			server_opts.idle_timeout = atoi(optarg);
+			break;
+		case 'z':
+			server_opts.zerocopy = 1;
+			break;
+		case 'x':
+			server_opts.csum_index = optarg;
+			break;
+		case 'c':
+			server_opts.cache_policy = policy_parse(optarg);
+			if (server_opts.cache_policy < 0)
+				usage(argv[0]);
+			break;
+		case 'S':
+			server_opts.cache_shards = atoi(optarg);
+			if (server_opts.cache_shards < 1)
+				usage(argv[0]);
+			break;
+		case 'n':
+			request_set_processing(0);
+			break;
+		case 'a':
+			if (sscanf(optarg, "%d:%d", &server_opts.pool_min,
+				   &server_opts.pool_max) != 2 ||
+			    server_opts.pool_min < 1 ||
+			    server_opts.pool_max < server_opts.pool_min)
+				usage(argv[0]);
+			break;
+		case 's':
+			server_opts.sched = 1;
+			break;
+		case 'w':
+			server_opts.watch = 1;
+			break;
+		case 'H':
+			server_opts.hugepages = 1;
+			break;
+		case 'l':
+		case 'L':
+			access_log = optarg;
+			access_format = c == 'l' ? ACCESS_LOG_BINARY :
+				ACCESS_LOG_CLF;
+			break;
+		case 'T':
+			access_log = optarg;
+			access_format = ACCESS_LOG_TRACE;
+			p = strrchr(optarg, ':');
+			if (p) {
+				*p = '\0';
+				access_rate = atof(p + 1);
+				if (access_rate <= 0 || access_rate > 1)
+					usage(argv[0]);
+			}
+			break;
+		case 'i':
+			server_opts.io_threads = atoi(optarg);
+			if (server_opts.io_threads < 0)
+				usage(argv[0]);
+			break;
+		case 'q':
+			/* CoDel's defaults are 5 and 100 ms */
+			server_opts.codel_interval = 100;
+			if (sscanf(optarg, "%d:%d", &server_opts.codel_target,
+				   &server_opts.codel_interval) < 1 ||
+			    server_opts.codel_target <= 0 ||
+			    server_opts.codel_interval <= 0)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 4)
 		usage(argv[0]);
-	port = atoi(argv[1]);
-	nr_threads = atoi(argv[2]);
-	max_requests = atoi(argv[3]);
-	max_cache_size = atoi(argv[4]);
+	port = atoi(argv[optind]);
+	nr_threads = atoi(argv[optind + 1]);
+	max_requests = atoi(argv[optind + 2]);
+	max_cache_size = atoi(argv[optind + 3]);
 	if (port < 1024) {
 		fprintf(stderr, "port = %d, should be >= 1024\n", port);
 		usage(argv[0]);
@@ -75,10 +256,69 @@ main(int argc, char *argv[])
 		fprintf(stderr, "arguments should be > 0\n");
 		usage(argv[0]);
 	}
+	/* the other modes have no pool of workers to resize, */
+	if (server_opts.mode != SERVER_THREADS && server_opts.pool_max > 0) {
+		fprintf(stderr, "-a needs threads mode\n");
+		usage(argv[0]);
+	}
+	/* nor a queue where connections wait */
+	if (server_opts.mode != SERVER_THREADS &&
+	    server_opts.codel_target > 0) {
+		fprintf(stderr, "-q needs threads mode\n");
+		usage(argv[0]);
+	}
+	if (server_opts.mode != SERVER_THREADS && server_opts.sched) {
+		fprintf(stderr, "-s needs threads mode\n");
+		usage(argv[0]);
+	}
+	/* only the event loops hand file reads to I/O threads */
+	if (server_opts.mode != SERVER_EPOLL && server_opts.io_threads > 0) {
+		fprintf(stderr, "-i needs epoll mode\n");
+		usage(argv[0]);
+	}
+	if (server_opts.mode == SERVER_REUSEPORT && nr_threads == 0) {
+		fprintf(stderr, "reuseport needs nr_threads > 0\n");
+		usage(argv[0]);
+	}
+	server_opts.port = port;
+
+	file_index_init();
+	/* stats and errors are only remembered while changes to the files
+	 * are */
+	if (server_opts.watch) {
+		stat_cache_init();
+		neg_cache_init();
+	}
+	stats_init();
+	if (access_log)
+		access_log_init(access_log, access_format, access_rate);
+	if (server_opts.csum_index &&
+	    file_index_load(server_opts.csum_index) < 0) {
+		fprintf(stderr, "%s: %s\n", server_opts.csum_index,
+			strerror(errno));
+		exit(1);
+	}
+
+	if (server_opts.mode == SERVER_EPOLL ||
+	    server_opts.mode == SERVER_URING) {
+		run_event_server(port, nr_threads, max_cache_size);
+		file_index_destroy();
+		stat_cache_destroy();
+		neg_cache_print_stats();
+		neg_cache_destroy();
+		access_log_destroy();
+		stats_destroy();
+		pthread_exit(0);
+	}
 
 	sv = server_init(nr_threads, max_requests, max_cache_size);
 
-	listenfd = open_listenfd(port);
+	/* in reuseport mode, the workers accept connections themselves, and
+	 * poll ignores the missing listenfd */
+	if (server_opts.mode == SERVER_REUSEPORT)
+		listenfd = -1;
+	else
+		listenfd = open_listenfd(port);
 	exitfd = open_fifo();
 
 	struct pollfd fds[] = {
@@ -106,6 +346,12 @@ main(int argc, char *argv[])
 
 	close_fifo();
 	server_exit(sv);
+	file_index_destroy();
+	stat_cache_destroy();
+	neg_cache_print_stats();
+	neg_cache_destroy();
+	access_log_destroy();
+	stats_destroy();
 
 	/* we don't check for memory leaks using mallinfo() because pthreads
 	 * caches thread state even after a thread exits so that it can reuse
@@ -0,0 +1,736 @@
+/*
+ * server_event.c: An event-driven front end for the web server.
+ *
+ * A small number of event loop threads share the listening socket. Each loop
+ * multiplexes many non-blocking connections with epoll, and moves every
+ * connection through a small state machine, so a slow client only costs a
+ * connection slot instead of a whole thread. Persistent connections go back
+ * to reading once a response is sent, starting with whatever the client has
+ * pipelined.
+ *
+ * With I/O threads (server_opts.io_threads > 0), a loop hands the file read
+ * for a cache miss to the I/O pool and goes on serving other connections,
+ * mostly hits, until the file is in memory.
+ *
+ * A loop never waits for a miss on a file that another thread is reading.
+ * The connection is parked on that read instead (see cache_lookup_park), and
+ * handed back to its loop once the file is in memory, like one that an I/O
+ * thread has read.
+ */
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "common.h"
+#include "request.h"
+#include "cache.h"
+#include "server_thread.h"
+#include "server_event.h"
+#include "stats.h"
+#include "http.h"
+#include "arena.h"
+#include "iopool.h"
+#include "fswatch.h"
+
+#define MAX_EVENTS 64	/* events handled per epoll_wait */
+
+enum conn_state {
+	CONN_READING,		/* reading the request head */
+	CONN_SENDING_HEADER,	/* sending the response header */
+	CONN_SENDING_BODY,	/* sending the file */
+	CONN_LOADING,		/* waiting for an I/O thread, or another's
+				 * miss, to read the file */
+	CONN_CLOSED,		/* closed, but events for it may still be
+				 * pending, see conn_close */
+};
+
+struct conn {
+	int fd;
+	enum conn_state state;
+	unsigned int events;	/* events we are polling for */
+	time_t last_active;	/* when we last made progress, in seconds */
+	struct conn *prev, *next; /* list of the loop's connections */
+	struct http_buf in;	/* request head read so far */
+	/* the response header, or a complete error response */
+	char out_buf[2 * MAXBUF];
+	struct response_buf out;
+	int out_sent;
+	struct request *rq;
+	/* the request's objects. a loop has many requests in flight, so
+	 * each connection has its own */
+	struct arena arena;
+	struct file_data *data;	/* file_data allocated for this request */
+	struct file_data *body;	/* file to send, NULL on errors */
+	CacheNode *entry;	/* pinned cache entry, if body is cached */
+	off_t body_sent;
+	unsigned long send_start;	/* when the response was ready */
+	/* while CONN_LOADING, only the I/O thread touches the request */
+	struct event_loop *loop;
+	struct iopool_job job;	/* reads the file, see conn_load */
+	CacheFlight *flight;	/* the miss that is being read */
+	int loaded;		/* whether the file could be read */
+	CacheWaiter wait;	/* parked on another's miss */
+	int parked;		/* whether the file was read by another */
+	struct conn *done_next;	/* list of loaded connections */
+};
+
+struct event_loop {
+	pthread_t thread;
+	int epfd;
+	int nr_conns;		/* open connections */
+	struct conn *conns;
+	struct conn *closed;	/* closed during this batch of events */
+	int exiting;
+	time_t last_sweep;	/* when we last closed idle connections */
+	struct event_server *sv;
+	/* connections whose files the I/O threads have read */
+	pthread_mutex_t done_lock;
+	struct conn *done;
+	int donefd;		/* eventfd, readable while done isn't empty */
+};
+
+struct event_server {
+	int nr_loops;
+	int listenfd;
+	int exitfd;		/* eventfd, stays readable once we are exiting */
+	Cache cache;
+	struct event_loop *loops;
+	struct iopool *io;	/* NULL if misses are read by the loops */
+	struct fswatch *watch;	/* with server_opts.watch */
+};
+
+static time_t
+now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static void
+conn_poll(struct event_loop *loop, struct conn *conn, unsigned int events)
+{
+	struct epoll_event ev = { .events = events, .data.ptr = conn };
+
+	if (conn->events == events)
+		return;
+	conn->events = events;
+	SYS(epoll_ctl(loop->epfd, EPOLL_CTL_MOD, conn->fd, &ev));
+}
+
+static void
+conn_open(struct event_loop *loop, int fd)
+{
+	struct conn *conn;
+	struct epoll_event ev;
+
+	conn = Malloc(sizeof(struct conn));
+	conn->fd = fd;
+	conn->state = CONN_READING;
+	conn->events = EPOLLIN;
+	conn->last_active = now_sec();
+	http_buf_init(&conn->in);
+	arena_init(&conn->arena);
+	conn->out.buf = conn->out_buf;
+	conn->out.size = sizeof(conn->out_buf);
+	conn->out.len = 0;
+	conn->out_sent = 0;
+	conn->rq = NULL;
+	conn->data = NULL;
+	conn->body = NULL;
+	conn->entry = NULL;
+	conn->body_sent = 0;
+	conn->loop = loop;
+	conn->flight = NULL;
+	conn->loaded = 0;
+	conn->parked = 0;
+	if (server_opts.idle_timeout > 0) {
+		/* the header and body are separate writes, don't let the
+		 * body wait for the ack of the previous response */
+		int one = 1;
+
+		SYS(setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one,
+			       sizeof(one)));
+	}
+
+	ev.events = conn->events;
+	ev.data.ptr = conn;
+	SYS(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev));
+	conn->prev = NULL;
+	conn->next = loop->conns;
+	if (loop->conns)
+		loop->conns->prev = conn;
+	loop->conns = conn;
+	loop->nr_conns++;
+}
+
+/* lets go of the last request's response */
+static void
+conn_end_request(struct event_loop *loop, struct conn *conn)
+{
+	struct event_server *sv = loop->sv;
+
+	if (conn->rq)
+		request_destroy(conn->rq);
+	if (conn->entry) {
+		/* the cache owns data once it has been inserted */
+		if (conn->entry->data == conn->data)
+			conn->data = NULL;
+		cache_release(&sv->cache, conn->entry);
+	}
+	if (conn->data)
+		file_data_free(conn->data);
+	arena_reset(&conn->arena);
+	conn->rq = NULL;
+	conn->data = NULL;
+	conn->body = NULL;
+	conn->entry = NULL;
+}
+
+static void
+conn_close(struct event_loop *loop, struct conn *conn)
+{
+	conn_end_request(loop, conn);
+	/* closing the socket also removes it from the epoll set */
+	SYS(close(conn->fd));
+	if (conn->prev)
+		conn->prev->next = conn->next;
+	else
+		loop->conns = conn->next;
+	if (conn->next)
+		conn->next->prev = conn->prev;
+	loop->nr_conns--;
+	/* the rest of this batch of events may still point at conn, so it
+	 * is freed once the batch is done, see conn_free_closed */
+	conn->state = CONN_CLOSED;
+	conn->next = loop->closed;
+	loop->closed = conn;
+}
+
+static void
+conn_free_closed(struct event_loop *loop)
+{
+	struct conn *conn, *next;
+
+	for (conn = loop->closed; conn; conn = next) {
+		next = conn->next;
+		free(conn);
+	}
+	loop->closed = NULL;
+}
+
+/* gets a persistent connection ready for its next request. the input buffer
+ * may already hold some, or all, of it. */
+static void
+conn_next_request(struct event_loop *loop, struct conn *conn)
+{
+	conn_end_request(loop, conn);
+	http_buf_consume(&conn->in);
+	conn->out.len = 0;
+	conn->out_sent = 0;
+	conn->body_sent = 0;
+	conn->state = CONN_READING;
+}
+
+/* closes connections that have made no progress for the idle timeout */
+static void
+conn_sweep(struct event_loop *loop)
+{
+	struct conn *conn, *next;
+	time_t now = now_sec();
+
+	if (server_opts.idle_timeout <= 0 || now == loop->last_sweep)
+		return;
+	loop->last_sweep = now;
+	for (conn = loop->conns; conn; conn = next) {
+		next = conn->next;
+		if (conn->state == CONN_READING &&
+		    now - conn->last_active >= server_opts.idle_timeout)
+			conn_close(loop, conn);
+	}
+}
+
+/* accepts all pending connections */
+static void
+conn_accept(struct event_loop *loop)
+{
+	int fd;
+
+	while (1) {
+		fd = accept4(loop->sv->listenfd, NULL, NULL, SOCK_NONBLOCK);
+		if (fd >= 0) {
+			conn_open(loop, fd);
+			continue;
+		}
+		if (errno == EINTR || errno == ECONNABORTED)
+			continue;
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return;
+		/* e.g., out of file descriptors. leave the rest in the
+		 * backlog until connections are closed. */
+		if (errno == EMFILE || errno == ENFILE)
+			return;
+		SYS(fd);
+	}
+}
+
+/* reads the file for a miss, and hands it to the cache, and to the loops
+ * waiting for it. the I/O threads do this too, so that a loop waiting for
+ * a file never waits for another loop. returns 0 if the file couldn't be
+ * read, with the error response in conn->out. */
+static int
+conn_readfile(Cache *cache, struct conn *conn, CacheFlight *flight)
+{
+	conn->data->cache_gen = cache_generation(cache, conn->data->file_name);
+	if (!request_readfile(conn->rq, server_opts.zerocopy ?
+			      cache->max_cache_size : INT_MAX)) {
+		if (flight)
+			cache_load_done(cache, flight, NULL, NULL);
+		return 0;
+	}
+	/* the cache keeps a copy, if it has room for one */
+	conn->body = conn->data;
+	conn->entry = cache_insert(cache, conn->data);
+	if (flight) {
+		/* if it wasn't cached, the loops waiting for the file share
+		 * this copy, which can't stay in the arena */
+		if (!conn->entry) {
+			conn->data = file_data_detach(conn->data);
+			request_set_data(conn->rq, conn->data);
+			conn->body = conn->data;
+		}
+		conn->entry = cache_load_done(cache, flight, conn->data,
+					      conn->entry);
+	}
+	return 1;
+}
+
+/* formats the response header for a file that is in memory, or open for
+ * streaming. on errors, the response is already in conn->out. */
+static void
+conn_finish_response(struct conn *conn, int loaded)
+{
+	conn->state = CONN_SENDING_HEADER;
+	if (loaded)
+		request_sendfile(conn->rq);
+	/* sending takes as long as the client takes to drain it */
+	conn->send_start = stats_now();
+}
+
+/* hands conn, whose file has been read on another thread, back to its
+ * loop, see conn_handle_loaded */
+static void
+conn_pass_back(struct event_loop *loop, struct conn *conn)
+{
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&loop->done_lock);
+	conn->done_next = loop->done;
+	loop->done = conn;
+	/* under the lock, so that the loop can't have exited yet */
+	SYS(write(loop->donefd, &one, sizeof(one)));
+	pthread_mutex_unlock(&loop->done_lock);
+}
+
+/* runs on an I/O thread. reads the file for conn, and passes conn back to
+ * its loop. */
+static void
+conn_load(struct iopool_job *job)
+{
+	struct conn *conn = (struct conn *)((char *)job -
+					    offsetof(struct conn, job));
+	struct event_loop *loop = conn->loop;
+
+	conn->loaded = conn_readfile(&loop->sv->cache, conn, conn->flight);
+	conn->flight = NULL;
+	conn_pass_back(loop, conn);
+}
+
+/* runs on whichever thread read the file that conn is parked on, see
+ * cache_lookup_park. passes conn back to its loop, with the file pinned in
+ * entry, or NULL if conn must read it on its own. */
+static void
+conn_flight_done(CacheWaiter *w, CacheNode *entry)
+{
+	struct conn *conn = (struct conn *)((char *)w -
+					    offsetof(struct conn, wait));
+
+	conn->entry = entry;
+	conn->parked = 1;
+	conn_pass_back(conn->loop, conn);
+}
+
+/* sends the file from conn->entry, if it is cached, or else reads it, on an
+ * I/O thread, or on this loop. flight is the miss to finish, if conn was the
+ * first to miss. */
+static void
+conn_get_file(struct event_loop *loop, struct conn *conn, CacheFlight *flight)
+{
+	if (conn->entry) {
+		request_set_data(conn->rq, conn->entry->data);
+		conn->body = conn->entry->data;
+		conn_finish_response(conn, 1);
+	} else if (loop->sv->io) {
+		/* the socket isn't polled until the file has been read,
+		 * but edge-triggered, so a hang up doesn't keep waking us */
+		conn->state = CONN_LOADING;
+		conn->flight = flight;
+		conn_poll(loop, conn, EPOLLET);
+		conn->job.run = conn_load;
+		iopool_submit(loop->sv->io, &conn->job);
+	} else {
+		/* reading the file blocks this loop, like a page fault
+		 * would, but only for as long as the disk takes */
+		conn_finish_response(conn, conn_readfile(&loop->sv->cache,
+							 conn, flight));
+	}
+}
+
+/* looks the file up and formats the response header into conn->out */
+static void
+conn_start_response(struct event_loop *loop, struct conn *conn)
+{
+	Cache *cache = &loop->sv->cache;
+	struct request *rq;
+	CacheFlight *flight;
+	CacheNode *entry;
+	unsigned long start;
+	int parked;
+
+	conn->data = file_data_init(&conn->arena);
+	rq = request_init_buf(conn->fd, &conn->in, conn->data, &conn->out);
+	conn->rq = rq;
+	conn->state = CONN_SENDING_HEADER;
+	if (!rq) /* the error response is in conn->out */
+		return;
+	request_set_keepalive(rq, server_opts.idle_timeout > 0 &&
+			      !loop->exiting);
+	if (request_status_page(rq)) {
+		char buf[MAXBUF];
+		int len = stats_report(buf, sizeof(buf), cache,
+				       request_status_page(rq));
+
+		request_sendbuf(rq, request_status_page(rq) == STATS_JSON ?
+				"application/json" : "text/plain", buf, len);
+		conn->send_start = stats_now();
+		return;
+	}
+
+	/* a miss on a file that another thread is reading is parked on
+	 * that read, and the loop goes on with other connections */
+	start = stats_now();
+	conn->wait.done = conn_flight_done;
+	entry = cache_lookup_park(cache, conn->data->file_name, &flight,
+				  &conn->wait, &parked);
+	stats_time(PHASE_LOOKUP, start);
+	if (parked) {
+		/* the reader may already have set conn->entry, and queued
+		 * conn for this loop, which only looks at it once we are
+		 * done here */
+		conn->state = CONN_LOADING;
+		conn_poll(loop, conn, EPOLLET);
+		return;
+	}
+	conn->entry = entry;
+	conn_get_file(loop, conn, flight);
+}
+
+/* reads as much of the request head as is available.
+ * returns 1 once the head is complete, 0 otherwise. */
+static int
+conn_read(struct event_loop *loop, struct conn *conn)
+{
+	struct http_buf *in = &conn->in;
+	ssize_t n;
+	int ret;
+
+	/* a pipelined request may have arrived with the previous one */
+	while ((ret = http_buf_head(in)) == 0) {
+		n = read(conn->fd, in->data + in->len, HTTP_BUF_SIZE - in->len);
+		if (n > 0) {
+			in->len += n;
+			conn->last_active = now_sec();
+			continue;
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			conn_poll(loop, conn, EPOLLIN);
+			return 0;
+		}
+		/* EOF or error before a complete request */
+		conn_close(loop, conn);
+		return 0;
+	}
+	if (ret < 0) {
+		/* request head is too long */
+		conn_close(loop, conn);
+		return 0;
+	}
+	return 1;
+}
+
+/* sends as much of the response as the socket takes. the connection is
+ * closed when the response is done, unless it is persistent, or when the
+ * client went away. returns 1 if the connection is ready for its next
+ * request. */
+static int
+conn_send(struct event_loop *loop, struct conn *conn)
+{
+	ssize_t n, header;
+	int file_fd;
+	struct iovec iov[2];
+	struct msghdr msg = { .msg_iov = iov };
+
+	file_fd = conn->rq ? request_file_fd(conn->rq) : -1;
+	while (conn->state == CONN_SENDING_HEADER) {
+		if (conn->out_sent == conn->out.len) {
+			conn->state = CONN_SENDING_BODY;
+			break;
+		}
+		/* a body in memory goes out with the header, in one call */
+		iov[0].iov_base = conn->out.buf + conn->out_sent;
+		iov[0].iov_len = conn->out.len - conn->out_sent;
+		msg.msg_iovlen = 1;
+		if (conn->body && file_fd < 0 && conn->body->file_size > 0) {
+			iov[1].iov_base = conn->body->file_buf;
+			iov[1].iov_len = conn->body->file_size;
+			msg.msg_iovlen = 2;
+		}
+		n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+		if (n >= 0) {
+			header = n < iov[0].iov_len ? n : iov[0].iov_len;
+			conn->out_sent += header;
+			conn->body_sent += n - header;
+			conn->last_active = now_sec();
+			continue;
+		}
+		if (errno == EINTR)
+			continue;
+		goto blocked;
+	}
+
+	while (conn->body && conn->body_sent < conn->body->file_size) {
+		if (file_fd >= 0) {
+			n = sendfile(conn->fd, file_fd, &conn->body_sent,
+				     conn->body->file_size - conn->body_sent);
+		} else {
+			n = send(conn->fd, conn->body->file_buf + conn->body_sent,
+				 conn->body->file_size - conn->body_sent,
+				 MSG_NOSIGNAL);
+			if (n > 0)
+				conn->body_sent += n;
+		}
+		if (n > 0) {
+			conn->last_active = now_sec();
+			continue;
+		}
+		if (n == 0) {	/* file was truncated under us */
+			conn_close(loop, conn);
+			return 0;
+		}
+		if (errno == EINTR)
+			continue;
+		goto blocked;
+	}
+	if (conn->rq)
+		stats_time(PHASE_SEND, conn->send_start);
+	if (conn->rq && request_keepalive(conn->rq) && !loop->exiting) {
+		conn_next_request(loop, conn);
+		return 1;
+	}
+	conn_close(loop, conn);
+	return 0;
+
+blocked:
+	if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		/* partial write, continue when the socket drains */
+		conn_poll(loop, conn, EPOLLOUT);
+	} else {
+		conn_close(loop, conn);
+	}
+	return 0;
+}
+
+static void
+conn_handle(struct event_loop *loop, struct conn *conn)
+{
+	do {
+		if (conn->state == CONN_READING) {
+			if (!conn_read(loop, conn))
+				return;
+			conn_start_response(loop, conn);
+		}
+		if (conn->state == CONN_LOADING)
+			return;
+	} while (conn_send(loop, conn));
+}
+
+/* sends the responses whose files the I/O threads, or other misses, have
+ * read. a connection that is closed here may still have a hang up pending
+ * later in this batch of events, so, like any other, it is only freed once
+ * the batch is done, see conn_close. */
+static void
+conn_handle_loaded(struct event_loop *loop)
+{
+	struct conn *conn, *next;
+	uint64_t count;
+
+	if (read(loop->donefd, &count, sizeof(count)) < 0)
+		assert(errno == EAGAIN);
+	pthread_mutex_lock(&loop->done_lock);
+	conn = loop->done;
+	loop->done = NULL;
+	pthread_mutex_unlock(&loop->done_lock);
+	for (; conn; conn = next) {
+		next = conn->done_next;
+		if (conn->parked) {
+			/* the file may not be shared, e.g., when it is
+			 * streamed, and then it is read for conn too */
+			conn->parked = 0;
+			conn_get_file(loop, conn, NULL);
+		} else {
+			conn_finish_response(conn, conn->loaded);
+		}
+		conn_handle(loop, conn);
+	}
+}
+
+static void *
+do_event_loop(void *arg)
+{
+	struct event_loop *loop = (struct event_loop *)arg;
+	struct event_server *sv = loop->sv;
+	struct epoll_event events[MAX_EVENTS];
+	struct conn *conn, *next;
+	int i, n;
+	/* wake up every second to close idle connections */
+	int timeout = (server_opts.idle_timeout > 0) ? 1000 : -1;
+
+	/* on exit, stop accepting, and finish the open requests */
+	while (!loop->exiting || loop->nr_conns > 0) {
+		n = epoll_wait(loop->epfd, events, MAX_EVENTS, timeout);
+		if (n < 0 && errno == EINTR)
+			continue;
+		SYS(n);
+		for (i = 0; i < n; i++) {
+			void *ptr = events[i].data.ptr;
+
+			if (ptr == &sv->exitfd) {
+				loop->exiting = 1;
+				SYS(epoll_ctl(loop->epfd, EPOLL_CTL_DEL,
+					      sv->listenfd, NULL));
+				SYS(epoll_ctl(loop->epfd, EPOLL_CTL_DEL,
+					      sv->exitfd, NULL));
+				/* persistent connections waiting for their
+				 * next request are closed right away */
+				for (conn = loop->conns; conn; conn = next) {
+					next = conn->next;
+					if (conn->state == CONN_READING &&
+					    conn->in.len == 0)
+						conn_close(loop, conn);
+				}
+			} else if (ptr == &sv->listenfd) {
+				if (!loop->exiting)
+					conn_accept(loop);
+			} else if (ptr == &loop->donefd) {
+				conn_handle_loaded(loop);
+			} else {
+				conn = (struct conn *)ptr;
+				/* closed earlier in this batch */
+				if (conn->state != CONN_CLOSED)
+					conn_handle(loop, conn);
+			}
+		}
+		conn_sweep(loop);
+		conn_free_closed(loop);
+	}
+	return NULL;
+}
+
+/* entry point functions */
+
+struct event_server *
+event_server_init(int nr_loops, int max_cache_size, int listenfd)
+{
+	struct event_server *sv;
+	struct epoll_event ev;
+	int i, flags;
+
+	sv = Malloc(sizeof(struct event_server));
+	sv->nr_loops = (nr_loops > 0) ? nr_loops : 1;
+	sv->listenfd = listenfd;
+	SYS(sv->exitfd = eventfd(0, EFD_NONBLOCK));
+	cache_init_shards(&sv->cache, max_cache_size, server_opts.cache_policy,
+			  server_opts.cache_shards);
+	if (server_opts.hugepages)
+		SYS(cache_use_hugepages(&sv->cache));
+	sv->watch = server_opts.watch ? fswatch_init(".", &sv->cache) : NULL;
+
+	/* the loops must never block in accept */
+	SYS(flags = fcntl(listenfd, F_GETFL, 0));
+	SYS(fcntl(listenfd, F_SETFL, flags | O_NONBLOCK));
+	/* we use MSG_NOSIGNAL for send, but sendfile can raise SIGPIPE too */
+	signal(SIGPIPE, SIG_IGN);
+	sv->io = server_opts.io_threads > 0 ?
+		iopool_init(server_opts.io_threads) : NULL;
+
+	sv->loops = Malloc(sizeof(struct event_loop) * sv->nr_loops);
+	for (i = 0; i < sv->nr_loops; i++) {
+		struct event_loop *loop = &sv->loops[i];
+
+		loop->sv = sv;
+		loop->nr_conns = 0;
+		loop->conns = NULL;
+		loop->closed = NULL;
+		loop->exiting = 0;
+		loop->last_sweep = 0;
+		SYS(loop->epfd = epoll_create1(0));
+		/* only wake up one loop per new connection */
+		ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+		ev.data.ptr = &sv->listenfd;
+		SYS(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, listenfd, &ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = &sv->exitfd;
+		SYS(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, sv->exitfd, &ev));
+		pthread_mutex_init(&loop->done_lock, NULL);
+		loop->done = NULL;
+		SYS(loop->donefd = eventfd(0, EFD_NONBLOCK));
+		ev.data.ptr = &loop->donefd;
+		SYS(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->donefd, &ev));
+	}
+	for (i = 0; i < sv->nr_loops; i++) {
+		SYS(pthread_create(&sv->loops[i].thread, NULL, do_event_loop,
+				   &sv->loops[i]));
+	}
+	return sv;
+}
+
+void
+event_server_exit(struct event_server *sv)
+{
+	uint64_t one = 1;
+	int i;
+
+	/* wakes up every loop, since we never read the eventfd */
+	SYS(write(sv->exitfd, &one, sizeof(one)));
+	for (i = 0; i < sv->nr_loops; i++) {
+		pthread_join(sv->loops[i].thread, NULL);
+		SYS(close(sv->loops[i].epfd));
+		/* the loops only exit once their files have been read */
+		assert(!sv->loops[i].done);
+		SYS(close(sv->loops[i].donefd));
+		pthread_mutex_destroy(&sv->loops[i].done_lock);
+	}
+	SYS(close(sv->exitfd));
+	if (sv->io)
+		iopool_destroy(sv->io);
+	if (sv->watch)
+		fswatch_destroy(sv->watch);
+
+	cache_print_stats(&sv->cache);
+	cache_destroy(&sv->cache);
+
+	free(sv->loops);
+	free(sv);
+}
@@ -0,0 +1,10 @@
+#ifndef __SERVER_EVENT_H__
+#define __SERVER_EVENT_H__
+
+struct event_server;
+
+struct event_server *event_server_init(int nr_loops, int max_cache_size,
+				       int listenfd);
+void event_server_exit(struct event_server *sv);
+
+#endif /* __SERVER_EVENT_H__ */
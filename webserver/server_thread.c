@@ -1,403 +1,477 @@
+#include <sys/eventfd.h>
 #include "request.h"
 #include "server_thread.h"
+#include "cache.h"
+#include "ring.h"
 #include "common.h"
+#include "stats.h"
+#include "http.h"
+#include "arena.h"
+#include "codel.h"
+#include "sched.h"
+#include "stat_cache.h"
+#include "fswatch.h"
+
+struct server_options server_opts;
+
+/* With autoscaling (server_opts.pool_max > 0), a pool thread checks every
+ * POOL_TICK how busy the workers are. It adds workers when connections are
+ * queued while all workers are busy, or when connections wait in the queue
+ * for POOL_WAIT_TARGET or longer on average, and it retires a worker every
+ * tick once some have been idle for POOL_COOLDOWN. */
+#define POOL_TICK 100000000UL		/* ns */
+#define POOL_WAIT_TARGET 1000000UL	/* ns */
+#define POOL_COOLDOWN 2000000000UL	/* ns */
+
+/* queued in place of a connection, makes the worker that gets it exit */
+#define RETIRE_FD -1
+
+/* with size-aware scheduling, how long a byte of response is worth
+ * waiting. a connection waits behind ones that arrived up to this much
+ * later per byte that its response is larger. */
+#define SCHED_NS_PER_BYTE 100
+
+/* in reuseport mode, how often an idle worker looks for connections waiting
+ * on the other workers' sockets */
+#define STEAL_INTERVAL 1	/* ms */
+
+/* a worker thread, and the memory it serves its requests with */
+struct worker {
+	struct http_buf in;	/* the current connection's input */
+	struct arena arena;	/* the current request's objects */
+	struct server *sv;
+	int id;			/* in reuseport mode, its socket in listenfds */
+	pthread_t thread;
+	int retired;		/* exited, waiting to be joined */
+	struct worker *next;	/* list of the pool's workers */
+};
 
 struct server {
-	int nr_threads;
+	int nr_threads;		/* workers, not counting retiring ones */
 	int max_requests;
 	int max_cache_size;
 	int exiting;
 	/* add any other parameters you need */
-	int *conn_buf;
-	pthread_t *threads;
-	int request_head;
-	int request_tail;
-	pthread_mutex_t mutex;
-	pthread_cond_t prod_cond;
-	pthread_cond_t cons_cond;	
+	struct ring *conn_ring;	/* accepted connections waiting for a worker */
+	unsigned long *accept_time;	/* when each fd was queued */
+	int nr_fds;			/* size of accept_time */
+	struct worker *worker;	/* the main thread's, with no worker threads */
+	/* the pool. workers, nr_threads and exiting are protected by
+	 * pool_lock, though reuseport workers only read exiting */
+	pthread_mutex_t pool_lock;
+	pthread_cond_t pool_cond;	/* wakes up the pool thread to exit */
+	pthread_t pool_thread;
+	struct worker *workers;
+	int min_threads;
+	int max_threads;	/* 0 without worker threads */
+	int nr_busy;		/* workers serving a connection */
+	long queue_wait;	/* ns dequeued connections waited, and */
+	long nr_dequeued;	/* how many, since the pool's last check */
+	struct codel codel;	/* with server_opts.codel_target > 0 */
+	struct sched *sched;	/* with server_opts.sched, connections taken
+				 * off conn_ring, in the order to serve them */
+	/* in reuseport mode, each worker listens on its own socket */
+	int *listenfds;
+	int nr_listenfds;
+	int exitfd;		/* eventfd, stays readable once we are exiting */
+	long nr_accepted;	/* connections accepted, and how many of them */
+	long nr_stolen;		/* from another worker's socket */
+	struct fswatch *watch;	/* with server_opts.watch */
 };
 
-/* Cache Implementation */
-typedef struct CacheNode {
-	struct file_data *data;
-	struct CacheNode *next;
-} CacheNode;
-
-typedef struct Cache {
-	CacheNode **array; // array of CacheNodes
-	int array_size;	// initialized to max_cache_size/average_file_size (12kB)
-	int max_cache_size;
-	int current_cache_size;
-	pthread_mutex_t mutex;
-	// should probably add a mutex lock here too?
-} Cache;
-
-typedef struct Node {
-	char *file_name;	// could use static array instead
-	int file_size;
-	struct Node *next;
-} Node;
-
-typedef struct Queue {
-	struct Node *head;
-	struct Node *tail;	// this is probably unnecessary Largest File First Implementation
-	int size;
-} Queue;
-
-/* Some function declarations */
-static void file_data_free(struct file_data *data);
-int cache_evict(Cache *c, Queue *q, int num_bytes);
-void q_insert_sorted(Queue *q, char *file_name, int file_size);
-
-int hash_func(const char *word, int size) {
-	unsigned long hash = 5381;
-	int c;
-	while ((c = *word++))
-		hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
-	return hash % size;
-}
+/* Globals */
 
-CacheNode *linear_search(CacheNode *head, char *word){
-	while (head) {
-		if (strcmp(word, head->data->file_name) == 0)
-			return head;
-		head = head->next;
-	}
-	return NULL;
-}
+Cache FileCache;
 
-void
-cache_init(Cache *c, int max_cache_size)
-{	
-	// initialize hash table
-	// int ht_size = max_cache_size/(4096 * 3);
-	int ht_size = 1000;
-	printf("ht_size: %d\n", ht_size);
-	c->array_size = ht_size;
-	c->max_cache_size = 0.9 * max_cache_size;
-	c->current_cache_size = 0;
-	c->array = (CacheNode **)calloc(ht_size, sizeof(CacheNode *));
-	pthread_mutex_init(&c->mutex, NULL);
-	assert(c);
-	return;
-}
+/* static functions */
 
-struct file_data *
-copy_file_data(struct file_data *data)
+/* serves one request on connfd, returns whether the connection stays open */
+static int
+do_server_request(struct server *sv, int connfd, struct worker *w)
 {
-	struct file_data *new_data;
-	new_data = (struct file_data *)malloc(sizeof(struct file_data));
-	new_data->file_name = (char *)malloc(strlen(data->file_name) + 1);
-	strcpy(new_data->file_name, data->file_name);
-	new_data->file_buf = (char *)malloc(data->file_size);
-	memcpy(new_data->file_buf, data->file_buf, data->file_size);
-	new_data->file_size = data->file_size;
-	return new_data;
-}
-
-/* Searches the hashtable for file_data of file_name, and returns a copy */
-struct file_data *cache_lookup(Cache *c, char *file_name) {
-
-	pthread_mutex_lock(&c->mutex);
-
-	// if the word is empty, ignore
-	if(strlen(file_name) == 0) return NULL;
-
-	int k = hash_func(file_name, c->array_size);
-	// get the linked list at index k of the hash table
-	CacheNode *head = c->array[k];
-	CacheNode *element = linear_search(head, file_name);
-
-	pthread_mutex_unlock(&c->mutex);
-	return (element) ? copy_file_data(element->data) : NULL;
-}
-
-/* Handles logic for file eviction as well. 
-	This is the only place cache_evict is called */
-void cache_insert(Cache *c, Queue *q, struct file_data *file){
+	struct http_buf *in = &w->in;
+	int ret, keepalive = 0;
+	struct request *rq;
+	struct file_data *data;
+	CacheNode *entry;
+	CacheFlight *flight;
+	unsigned long start;
 
-	pthread_mutex_lock(&c->mutex);
+	data = file_data_init(&w->arena);
 
-	// check if there is enough space in the cache
-	if (file->file_size >= c->max_cache_size) {
-		pthread_mutex_unlock(&c->mutex);
-		return;
-	}
-
-	// and evict if necessary
-	if (c->current_cache_size + file->file_size > c->max_cache_size) {
-		assert(cache_evict(c, q, file->file_size) >= file->file_size);
+	/* fill data->file_name with name of the file being requested */
+	rq = request_init(connfd, in, data);
+	if (!rq) {
+		file_data_free(data);
+		arena_reset(&w->arena);
+		return 0;
 	}
+	request_set_keepalive(rq, server_opts.idle_timeout > 0);
 
-	// make sure we're not inserting into a full cache
-	assert(c->current_cache_size + file->file_size <= c->max_cache_size);
-	// if (c->current_cache_size + file->file_size >= c->max_cache_size)
-	// 	printf("Cache is full!\n");
-
-	// get the linked list at index k of the hash table
-	int k = hash_func(file->file_name, c->array_size);
-	CacheNode *head = c->array[k];
-
-	// initialize the new node
-	CacheNode *entry = malloc(sizeof(CacheNode));
-	entry->data = copy_file_data(file);
-	entry->next = head;
-
-	// insert entry at the head of wc[k]
-	c->array[k] = entry;
-	c->current_cache_size += file->file_size;
+	entry = NULL;
+	if (request_status_page(rq)) {
+		char buf[MAXBUF];
+		int len = stats_report(buf, sizeof(buf), &FileCache,
+				       request_status_page(rq));
 
-	// add to LFF queue
-	q_insert_sorted(q, file->file_name, file->file_size);
-
-	pthread_mutex_unlock(&c->mutex);
-}
+		request_sendbuf(rq, request_status_page(rq) == STATS_JSON ?
+				"application/json" : "text/plain", buf, len);
+		goto out;
+	}
 
-// returns the number of bytes evicted from the cache
-int cache_evict(Cache *c, Queue *q, int num_bytes){
-	if (c->max_cache_size < num_bytes) return 0;
-	int evicted = 0;
-
-	// evict from the head of the LFF queue
-	while (evicted < num_bytes) {
-		// get the file name at the head of the queue
-		Node *node = q->head;
-		q->head = q->head->next;
-		q->size--;
-		if (q->size == 0) q->tail = NULL;
-
-		// remove from the cache
-		int k = hash_func(node->file_name, c->array_size);
-		CacheNode *curr = c->array[k];
-		CacheNode *prev = NULL;
-		while (curr) {
-			if (strcmp(node->file_name, curr->data->file_name) == 0) {
-				if (prev) prev->next = curr->next;
-				else c->array[k] = curr->next;
-				evicted += curr->data->file_size;
-				c->current_cache_size -= curr->data->file_size;
-				assert(c->current_cache_size >= 0);
-				assert(evicted <= c->max_cache_size);
-				free(curr);
-				break;
+	/* attempt to retrieve the file from cache. a hit pins the cached
+	 * entry, so the file is sent without copying it. so does a miss on a
+	 * file that another worker is already reading.
+	 * if attempt fails, proceed as usual. */
+	start = stats_now();
+	entry = cache_lookup_load(&FileCache, data->file_name, &flight);
+	stats_time(PHASE_LOOKUP, start);
+	if (entry) {
+		request_set_data(rq, entry->data);
+	} else {
+		/* read file, 
+		 * fills data->file_buf with the file contents,
+		 * data->file_size with file size.
+		 * in zerocopy mode, files too large for the cache are
+		 * streamed from disk instead. */
+		data->cache_gen = cache_generation(&FileCache,
+						   data->file_name);
+		ret = request_readfile(rq, server_opts.zerocopy ?
+				       FileCache.max_cache_size : INT_MAX);
+		if (ret == 0) { /* couldn't read file */
+			if (flight)
+				cache_load_done(&FileCache, flight, NULL, NULL);
+			goto out;
+		}
+		/* the cache keeps a copy, if it has room for one */
+		entry = cache_insert(&FileCache, data);
+		/* hand the file to the workers waiting for it. if it wasn't
+		 * cached, they share data, which can't stay in the arena */
+		if (flight) {
+			if (!entry) {
+				data = file_data_detach(data);
+				request_set_data(rq, data);
 			}
-			prev = curr;
-			curr = curr->next;
+			entry = cache_load_done(&FileCache, flight, data, entry);
 		}
-		free(node->file_name);
-		free(node);
 	}
-	return evicted;
-}
 
-void
-list_destroy(CacheNode *head) {
-	if(head == NULL) return;
-	if(head->next == NULL) {
-		file_data_free(head->data);
-		free(head);
-		return;
+	/* send file to client. if that fails, only this connection is closed */
+	if (!request_sendfile(rq))
+		request_set_keepalive(rq, 0);
+out:
+	keepalive = request_keepalive(rq);
+	request_destroy(rq);
+	/* keep whatever the client pipelined after this request */
+	http_buf_consume(in);
+	if (entry) {
+		if (entry->data == data)
+			data = NULL;
+		cache_release(&FileCache, entry);
 	}
-	list_destroy(head->next);
-	file_data_free(head->data);
-	free(head);
-	return;
+	if (data)
+		file_data_free(data);
+	arena_reset(&w->arena);
+	return keepalive;
 }
 
-void
-cache_destroy(Cache *c)
+/* serves requests on connfd until the client is done with it */
+static void
+do_server_conn(struct server *sv, int connfd, struct worker *w)
 {
-	// loop through the entire array
-	for(int i  = 0; i < c->array_size; ++i) {
-		// free each node
-		list_destroy(c->array[i]);
+	if (server_opts.idle_timeout > 0) {
+		/* don't let an idle persistent connection hold on to a
+		 * worker forever */
+		struct timeval tv = { .tv_sec = server_opts.idle_timeout };
+		int one = 1;
+
+		SYS(setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &tv,
+			       sizeof(tv)));
+		/* the header and body are separate writes, don't let the
+		 * body wait for the ack of the previous response */
+		SYS(setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one,
+			       sizeof(one)));
 	}
+	/* the input buffer lives as long as the connection, so it keeps any
+	 * pipelined requests between calls to do_server_request */
+	http_buf_init(&w->in);
+	while (do_server_request(sv, connfd, w))
+		;
+	SYS(close(connfd));
+}
 
-	free(c);
-};
-
+/* returns the expected size of the response to connfd, or 0 if its request
+ * hasn't arrived yet, or the file doesn't exist */
+static long
+server_expected_size(int connfd)
+{
+	char file_name[MAXLINE];
+	struct stat st;
+	int size;
 
-/* Largest File First Implementation */
-/* Use a Sorted linked list to keep track of the relative size order of the files */
+	if (!request_peek_file_name(connfd, file_name, sizeof(file_name)))
+		return 0;
+	size = cache_file_size(&FileCache, file_name);
+	if (size >= 0)
+		return size;
+	if (stat_cache_stat(file_name, &st) < 0 || !S_ISREG(st.st_mode))
+		return 0;
+	return st.st_size;
+}
 
-void 
-q_init(Queue *q) {
-	q->head = NULL;
-	q->tail = NULL;
-	q->size = 0;
+/* queues connfd, or RETIRE_FD, for the workers */
+static void
+server_enqueue(struct server *sv, int connfd)
+{
+	ring_put(sv->conn_ring, connfd);
+	if (sv->sched)
+		sched_kick(sv->sched);
 }
 
-/* search & delete file_name from queue */
-void 
-q_remove(Queue *q, char *file_name) {
-	Node *prev = NULL;
-	Node *curr = q->head;
-	while(curr) {
-		if(strcmp(curr->file_name, file_name) == 0) {
-			if(prev == NULL) {
-				q->head = curr->next;
-				if(q->head == NULL) q->tail = NULL;
-			} else {
-				prev->next = curr->next;
-				if(prev->next == NULL) q->tail = prev;
-			}
-			free(curr->file_name);
-			free(curr);
-			q->size--;
-			return;
-		}
-		prev = curr;
-		curr = curr->next;
+/* queues connfd for size-aware scheduling */
+static void
+server_sched(struct server *sv, int connfd)
+{
+	unsigned long key;
+
+	if (connfd == RETIRE_FD) {
+		sched_push(sv->sched, connfd, 0);
+		return;
 	}
+	key = connfd < sv->nr_fds ? sv->accept_time[connfd] : stats_now();
+	sched_push(sv->sched, connfd, key + SCHED_NS_PER_BYTE *
+		   server_expected_size(connfd));
 }
 
-/* insert in decreasing order of file size into the queue */
-/* Prof Eyolfson mentioned that evicting largest files first gives best performance */
-void
-q_insert_sorted(Queue *q, char *file_name, int file_size) {
-	Node *new_node = malloc(sizeof(Node));
-	new_node->file_name = malloc(strlen(file_name) + 1);
-	strcpy(new_node->file_name, file_name);
-	new_node->file_size = file_size;
-	new_node->next = NULL;
-
-	if(q->head == NULL) {
-		q->head = new_node;
-		q->tail = new_node;
-	} else {
-		Node *prev = NULL;
-		Node *curr = q->head;
-		while(curr) {
-			if(curr->file_size < file_size) {
-				if(prev == NULL) {
-					new_node->next = q->head;
-					q->head = new_node;
-				} else {
-					new_node->next = curr;
-					prev->next = new_node;
-				}
-				q->size++;
-				return;
+/* takes the next connection to serve. returns 0 once the server is exiting
+ * and all connections have been served. */
+static int
+server_next_conn(struct server *sv, int *connfd)
+{
+	unsigned long epoch;
+	int fd;
+
+	if (!sv->sched) /* first come, first served */
+		return ring_get(sv->conn_ring, connfd);
+	/* idle workers wait on the heap, not the ring, so that a connection
+	 * that another worker moves to the heap wakes one of them. each
+	 * ring_put kicks the heap, see server_enqueue. */
+	do {
+		epoch = sched_epoch(sv->sched);
+		/* pick among everything that has been accepted, up to
+		 * max_requests, so that the bound on queued connections
+		 * still holds, give or take the ring */
+		while (sched_count(sv->sched) < sv->max_requests &&
+		       ring_tryget(sv->conn_ring, &fd))
+			server_sched(sv, fd);
+		if (sched_pop(sv->sched, connfd))
+			return 1;
+	} while (sched_wait(sv->sched, epoch));
+	return 0;
+}
+
+static void *
+do_server_thread(void *arg)
+{
+	struct worker *w = (struct worker *)arg;
+	struct server *sv = w->sv;
+	unsigned long now;
+	int connfd;
+
+	/* fails once the server is exiting and the queue is empty */
+	while (server_next_conn(sv, &connfd)) {
+		if (connfd == RETIRE_FD) {
+			pthread_mutex_lock(&sv->pool_lock);
+			w->retired = 1;
+			pthread_mutex_unlock(&sv->pool_lock);
+			break;
+		}
+		if (connfd < sv->nr_fds) {
+			unsigned long wait;
+
+			now = stats_time(PHASE_QUEUE, sv->accept_time[connfd]);
+			wait = now - sv->accept_time[connfd];
+			if (server_opts.pool_max > 0) {
+				__atomic_fetch_add(&sv->queue_wait, wait,
+						   __ATOMIC_RELAXED);
+				__atomic_fetch_add(&sv->nr_dequeued, 1,
+						   __ATOMIC_RELAXED);
+			}
+			if (server_opts.codel_target > 0 &&
+			    codel_dequeue(&sv->codel, wait, now)) {
+				request_reject(connfd);
+				SYS(close(connfd));
+				continue;
 			}
-			prev = curr;
-			curr = curr->next;
 		}
-		q->tail->next = new_node;
-		q->tail = new_node;
-		q->size++;
+		/* now serve request */
+		__atomic_fetch_add(&sv->nr_busy, 1, __ATOMIC_RELAXED);
+		do_server_conn(sv, connfd, w);
+		__atomic_fetch_sub(&sv->nr_busy, 1, __ATOMIC_RELAXED);
 	}
+	return NULL;
 }
 
-void
-q_destroy(Queue *q) {
-	Node *curr = q->head;
-	Node *next = NULL;
-	while(curr) {
-		next = curr->next;
-		free(curr->file_name);
-		free(curr);
-		curr = next;
+/* accepts a connection on the worker's own socket or, if steal is set and
+ * it has none, on the next socket along that has one. returns -1 if none
+ * are waiting. */
+static int
+reuseport_accept(struct server *sv, struct worker *w, int steal)
+{
+	int i, connfd;
+
+	for (i = 0; i < (steal ? sv->nr_listenfds : 1); i++) {
+		connfd = accept(sv->listenfds[(w->id + i) % sv->nr_listenfds],
+				NULL, NULL);
+		if (connfd >= 0) {
+			__atomic_fetch_add(&sv->nr_accepted, 1,
+					   __ATOMIC_RELAXED);
+			if (i > 0)
+				__atomic_fetch_add(&sv->nr_stolen, 1,
+						   __ATOMIC_RELAXED);
+			return connfd;
+		}
+		/* e.g., out of file descriptors. leave the connection in the
+		 * backlog until connections are closed. */
+		if (errno != EAGAIN && errno != EWOULDBLOCK &&
+		    errno != EINTR && errno != ECONNABORTED &&
+		    errno != EMFILE && errno != ENFILE)
+			SYS(connfd);
 	}
+	return -1;
 }
-/* Globals */
-
-Cache FileCache;
-Queue LFFQueue;
-
-/* static functions */
 
-/* initialize file data */
-static struct file_data *
-file_data_init(void)
+/* a worker in reuseport mode. it serves the connections on its own socket,
+ * and those on the other workers' sockets only when it has none, so each
+ * connection is normally accepted and served by the same thread, with no
+ * hand-off. on exit, it serves what is left in its socket's backlog. */
+static void *
+do_reuseport_thread(void *arg)
 {
-	struct file_data *data;
+	struct worker *w = (struct worker *)arg;
+	struct server *sv = w->sv;
+	struct pollfd fds[] = {
+		{ sv->listenfds[w->id], POLLIN },
+		{ sv->exitfd, POLLIN },
+	};
+	int connfd, exiting;
 
-	data = Malloc(sizeof(struct file_data));
-	data->file_name = NULL;
-	data->file_buf = NULL;
-	data->file_size = 0;
-	return data;
+	while (1) {
+		exiting = __atomic_load_n(&sv->exiting, __ATOMIC_ACQUIRE);
+		connfd = reuseport_accept(sv, w, !exiting);
+		if (connfd >= 0) {
+			__atomic_fetch_add(&sv->nr_busy, 1, __ATOMIC_RELAXED);
+			do_server_conn(sv, connfd, w);
+			__atomic_fetch_sub(&sv->nr_busy, 1, __ATOMIC_RELAXED);
+			continue;
+		}
+		if (exiting)
+			break;
+		/* a busy worker leaves the connections on its socket
+		 * waiting, so look for them again every STEAL_INTERVAL */
+		if (poll(fds, 2, STEAL_INTERVAL) < 0 && errno != EINTR)
+			SYS(-1);
+	}
+	return NULL;
 }
 
-/* free all file data */
+/* starts a worker. called with pool_lock held, or before the pool thread
+ * starts. */
 static void
-file_data_free(struct file_data *data)
+pool_add_worker(struct server *sv)
 {
-	free(data->file_name);
-	free(data->file_buf);
-	free(data);
+	struct worker *w = Malloc(sizeof(struct worker));
+
+	arena_init(&w->arena);
+	w->sv = sv;
+	w->id = sv->nr_threads;
+	w->retired = 0;
+	SYS(pthread_create(&w->thread, NULL,
+			   server_opts.mode == SERVER_REUSEPORT ?
+			   do_reuseport_thread : do_server_thread, w));
+	w->next = sv->workers;
+	sv->workers = w;
+	sv->nr_threads++;
 }
 
+/* joins the workers that have exited. called with pool_lock held, or once
+ * the pool thread has exited. */
 static void
-do_server_request(struct server *sv, int connfd)
+pool_reap(struct server *sv, int all)
 {
-	int ret;
-	struct request *rq;
-	struct file_data *data;
+	struct worker **pw = &sv->workers, *w;
 
-	data = file_data_init();
-
-	/* fill data->file_name with name of the file being requested */
-	rq = request_init(connfd, data);
-	if (!rq) {
-		file_data_free(data);
-		return;
-	}
-
-	/* attempt to retrieve the file from cache 
-	 * if attempt fails, proceed as usual. */
-	struct file_data *cachedEntry = (FileCache.array_size > 0) ? 
-									cachedEntry = cache_lookup(&FileCache, data->file_name) : 
-									NULL;
-	if (cachedEntry) {
-		request_set_data(rq, cachedEntry);
-	} else {
-		/* read file, 
-		 * fills data->file_buf with the file contents,
-		 * data->file_size with file size. */
-		ret = request_readfile(rq);
-		if (ret == 0) { /* couldn't read file */
-			goto out;
+	while ((w = *pw) != NULL) {
+		if (!all && !w->retired) {
+			pw = &w->next;
+			continue;
 		}
-		// data still points to the same memory location as rq->data
-		cache_insert(&FileCache, &LFFQueue, data);
+		*pw = w->next;
+		pthread_join(w->thread, NULL);
+		free(w);
 	}
+}
 
-	/* send file to client */
-	request_sendfile(rq);
-out:
-	request_destroy(rq);
-	file_data_free(data);
+/* grows or shrinks the pool, see POOL_TICK. idle_since is when the pool was
+ * last short of workers. */
+static void
+pool_adjust(struct server *sv, unsigned long now, unsigned long *idle_since)
+{
+	int queued = ring_count(sv->conn_ring) +
+		(sv->sched ? sched_count(sv->sched) : 0);
+	int busy = __atomic_load_n(&sv->nr_busy, __ATOMIC_RELAXED);
+	long wait = __atomic_exchange_n(&sv->queue_wait, 0, __ATOMIC_RELAXED);
+	long dequeued = __atomic_exchange_n(&sv->nr_dequeued, 0,
+					    __ATOMIC_RELAXED);
+	double mean_wait = dequeued ? (double)wait / dequeued : 0;
+	int old = sv->nr_threads, add;
+
+	pool_reap(sv, 0);
+	if ((queued > 0 && busy >= sv->nr_threads) ||
+	    mean_wait >= POOL_WAIT_TARGET) {
+		*idle_since = now;
+		/* enough workers for what is queued, at once */
+		add = queued > 1 ? queued : 1;
+		if (add > sv->max_threads - sv->nr_threads)
+			add = sv->max_threads - sv->nr_threads;
+		while (add-- > 0)
+			pool_add_worker(sv);
+	} else if (queued > 0 || busy >= sv->nr_threads) {
+		*idle_since = now;
+	} else if (now - *idle_since >= POOL_COOLDOWN &&
+		   sv->nr_threads > sv->min_threads) {
+		/* whichever worker gets the token next exits. the ring was
+		 * just empty, so this hardly ever waits, and never for long,
+		 * since the other workers are draining it */
+		server_enqueue(sv, RETIRE_FD);
+		sv->nr_threads--;
+	}
+	if (sv->nr_threads != old)
+		printf("pool: %d -> %d threads, busy = %d, "
+		       "queued = %d, queue wait = %.3f ms\n", old,
+		       sv->nr_threads, busy, queued, mean_wait / 1e6);
 }
 
 static void *
-do_server_thread(void *arg)
+do_pool_thread(void *arg)
 {
 	struct server *sv = (struct server *)arg;
-	int connfd;
-
-	while (1) {
-		pthread_mutex_lock(&sv->mutex);
-		while (sv->request_head == sv->request_tail) {
-			/* buffer is empty */
-			if (sv->exiting) {
-				pthread_mutex_unlock(&sv->mutex);
-				goto out;
-			}
-			pthread_cond_wait(&sv->cons_cond, &sv->mutex);
-		}
-		/* get request from tail */
-		connfd = sv->conn_buf[sv->request_tail];
-		/* consume request */
-		sv->conn_buf[sv->request_tail] = -1;
-		sv->request_tail = (sv->request_tail + 1) % sv->max_requests;
-		
-		pthread_cond_signal(&sv->prod_cond);
-		pthread_mutex_unlock(&sv->mutex);
-		/* now serve request */
-		do_server_request(sv, connfd);
+	unsigned long idle_since = stats_now();
+	struct timespec ts;
+
+	pthread_mutex_lock(&sv->pool_lock);
+	while (!sv->exiting) {
+		/* pthread_cond_timedwait uses CLOCK_REALTIME */
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += POOL_TICK;
+		ts.tv_sec += ts.tv_nsec / 1000000000;
+		ts.tv_nsec %= 1000000000;
+		pthread_cond_timedwait(&sv->pool_cond, &sv->pool_lock, &ts);
+		if (sv->exiting)
+			break;
+		pool_adjust(sv, stats_now(), &idle_since);
 	}
-out:
+	pthread_mutex_unlock(&sv->pool_lock);
 	return NULL;
 }
 
@@ -407,85 +481,168 @@ struct server *
 server_init(int nr_threads, int max_requests, int max_cache_size)
 {
 	struct server *sv;
-	int i;
+	struct rlimit rl;
+	int i, flags;
 
 	sv = Malloc(sizeof(struct server));
-	sv->nr_threads = nr_threads;
-	/* we add 1 because we queue at most max_request - 1 requests */
-	sv->max_requests = max_requests + 1;
+	sv->nr_threads = 0;
+	sv->max_requests = max_requests;
 	sv->max_cache_size = max_cache_size;
 	sv->exiting = 0;
-
-	/* Lab 4: create queue of max_request size when max_requests > 0 */
-	sv->conn_buf = Malloc(sizeof(*sv->conn_buf) * sv->max_requests);
-	for (i = 0; i < sv->max_requests; i++) {
-		sv->conn_buf[i] = -1;
-	}
-	sv->request_head = 0;
-	sv->request_tail = 0;
+	getrlimit(RLIMIT_NOFILE, &rl);
+	sv->nr_fds = rl.rlim_cur < INT_MAX ? rl.rlim_cur : 65536;
+	sv->accept_time = Malloc(sizeof(unsigned long) * sv->nr_fds);
+	/* a client that goes away must fail only the write to it, with EPIPE,
+	 * rather than kill the server */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Lab 4: create queue of max_request size when max_requests > 0.
+	 * with admission control, the queue takes in connections as fast as
+	 * they arrive, rather than leaving them in the listen backlog, where
+	 * nobody sees how long they wait. how long they wait is bounded by
+	 * shedding them instead. */
+	if (server_opts.codel_target > 0 && max_requests < LISTENQ)
+		max_requests = LISTENQ;
+	sv->max_requests = max_requests;
+	sv->conn_ring = ring_init(max_requests > 0 ? max_requests : 1);
 
 	/* Lab 5: init server cache and limit its size to max_cache_size */
-	cache_init(&FileCache, max_cache_size);
-	q_init(&LFFQueue);
-
-	/* Lab 4: create worker threads when nr_threads > 0 */
-	pthread_mutex_init(&sv->mutex, NULL);
-	pthread_cond_init(&sv->prod_cond, NULL);
-	pthread_cond_init(&sv->cons_cond, NULL);	
-	sv->threads = Malloc(sizeof(pthread_t) * nr_threads);
-	for (i = 0; i < nr_threads; i++) {
-		SYS(pthread_create(&(sv->threads[i]), NULL, do_server_thread,
-				   (void *)sv));
+	cache_init_shards(&FileCache, max_cache_size, server_opts.cache_policy,
+			  server_opts.cache_shards);
+	if (server_opts.hugepages)
+		SYS(cache_use_hugepages(&FileCache));
+	sv->watch = server_opts.watch ? fswatch_init(".", &FileCache) : NULL;
+
+	sv->worker = Malloc(sizeof(struct worker));
+	arena_init(&sv->worker->arena);
+
+	/* Lab 4: create worker threads when nr_threads > 0. with
+	 * autoscaling, nr_threads is only where the pool starts. */
+	pthread_mutex_init(&sv->pool_lock, NULL);
+	pthread_cond_init(&sv->pool_cond, NULL);
+	sv->workers = NULL;
+	sv->min_threads = sv->max_threads = nr_threads;
+	if (server_opts.pool_max > 0) {
+		sv->min_threads = server_opts.pool_min;
+		sv->max_threads = server_opts.pool_max;
+		if (nr_threads < sv->min_threads)
+			nr_threads = sv->min_threads;
+		if (nr_threads > sv->max_threads)
+			nr_threads = sv->max_threads;
+	}
+	sv->nr_busy = 0;
+	sv->queue_wait = 0;
+	sv->nr_dequeued = 0;
+	codel_init(&sv->codel, server_opts.codel_target * 1000000UL,
+		   server_opts.codel_interval * 1000000UL);
+	sv->sched = server_opts.sched ? sched_init() : NULL;
+
+	/* in reuseport mode, the workers accept connections themselves,
+	 * each on its own socket. all the sockets are open before any worker
+	 * starts, so the workers can steal from each other's. */
+	sv->listenfds = NULL;
+	sv->nr_listenfds = 0;
+	sv->exitfd = -1;
+	sv->nr_accepted = 0;
+	sv->nr_stolen = 0;
+	if (server_opts.mode == SERVER_REUSEPORT) {
+		assert(nr_threads > 0 && server_opts.pool_max == 0);
+		sv->listenfds = Malloc(sizeof(int) * nr_threads);
+		for (i = 0; i < nr_threads; i++) {
+			sv->listenfds[i] =
+				open_reuseport_listenfd(server_opts.port);
+			/* workers must never block in accept */
+			SYS(flags = fcntl(sv->listenfds[i], F_GETFL, 0));
+			SYS(fcntl(sv->listenfds[i], F_SETFL,
+				  flags | O_NONBLOCK));
+		}
+		sv->nr_listenfds = nr_threads;
+		SYS(sv->exitfd = eventfd(0, EFD_NONBLOCK));
 	}
+	for (i = 0; i < nr_threads; i++)
+		pool_add_worker(sv);
+	if (server_opts.pool_max > 0)
+		SYS(pthread_create(&sv->pool_thread, NULL, do_pool_thread, sv));
 	return sv;
 }
 
 void
 server_request(struct server *sv, int connfd)
 {
-	if (sv->nr_threads == 0) { /* no worker threads */
-		do_server_request(sv, connfd);
+	if (sv->max_threads == 0) { /* no worker threads */
+		do_server_conn(sv, connfd, sv->worker);
 	} else {
 		/*  Save the relevant info in a buffer and have one of the
 		 *  worker threads do the work. */
 
-		pthread_mutex_lock(&sv->mutex);
-		while (((sv->request_head - sv->request_tail + sv->max_requests)
-			% sv->max_requests) == (sv->max_requests - 1)) {
-			/* buffer is full */
-			pthread_cond_wait(&sv->prod_cond, &sv->mutex);
+		/* waits while max_requests connections are queued. the
+		 * ring orders the store before the worker's load. */
+		if (connfd < sv->nr_fds)
+			sv->accept_time[connfd] = stats_now();
+		/* while the queue is being shed, waiting for room would
+		 * only leave connections to pile up in the listen backlog,
+		 * where their wait isn't seen */
+		if (server_opts.codel_target > 0 &&
+		    ring_count(sv->conn_ring) >= sv->max_requests &&
+		    codel_full(&sv->codel)) {
+			request_reject(connfd);
+			SYS(close(connfd));
+			return;
 		}
-		/* fill conn_buf with this request */
-		assert(sv->conn_buf[sv->request_head] == -1);
-		sv->conn_buf[sv->request_head] = connfd;
-		sv->request_head = (sv->request_head + 1) % sv->max_requests;
-		pthread_cond_signal(&sv->cons_cond);
-		pthread_mutex_unlock(&sv->mutex);
+		server_enqueue(sv, connfd);
 	}
 }
 
 void
 server_exit(struct server *sv)
 {
-	int i;
 	/* when using one or more worker threads, use sv->exiting to indicate to
 	 * these threads that the server is exiting. make sure to call
 	 * pthread_join in this function so that the main server thread waits
 	 * for all the worker threads to exit before exiting. */
-	pthread_mutex_lock(&sv->mutex);
-	sv->exiting = 1;
-	pthread_cond_broadcast(&sv->cons_cond);
-	pthread_mutex_unlock(&sv->mutex);
-	for (i = 0; i < sv->nr_threads; i++) {
-		pthread_join(sv->threads[i], NULL);
-	}
+	uint64_t one = 1;
+	int i;
+
+	pthread_mutex_lock(&sv->pool_lock);
+	__atomic_store_n(&sv->exiting, 1, __ATOMIC_RELEASE);
+	pthread_cond_signal(&sv->pool_cond);
+	pthread_mutex_unlock(&sv->pool_lock);
+	if (server_opts.pool_max > 0)
+		pthread_join(sv->pool_thread, NULL);
+	ring_close(sv->conn_ring);
+	if (sv->sched)
+		sched_close(sv->sched);
+	/* wakes up every idle worker, since we never read the eventfd */
+	if (sv->exitfd >= 0)
+		SYS(write(sv->exitfd, &one, sizeof(one)));
+	pool_reap(sv, 1);
+	/* the sockets are closed only once no worker can steal from them */
+	for (i = 0; i < sv->nr_listenfds; i++)
+		SYS(close(sv->listenfds[i]));
+	if (sv->exitfd >= 0)
+		SYS(close(sv->exitfd));
 
 	/* Lab 5: free server cache */
+	cache_print_stats(&FileCache);
+	if (server_opts.codel_target > 0)
+		printf("admission: connections served = %ld, shed = %ld\n",
+		       sv->codel.admitted, sv->codel.shed);
+	if (server_opts.mode == SERVER_REUSEPORT)
+		printf("reuseport: connections accepted = %ld, stolen = %ld\n",
+		       sv->nr_accepted, sv->nr_stolen);
+	codel_destroy(&sv->codel);
+	if (sv->sched)
+		sched_destroy(sv->sched);
+	if (sv->watch)
+		fswatch_destroy(sv->watch);
 	cache_destroy(&FileCache);
-	q_destroy(&LFFQueue);
 
 	/* make sure to free any allocated resources */
-	free(sv->conn_buf);
-	free(sv->threads);
+	ring_destroy(sv->conn_ring);
+	pthread_cond_destroy(&sv->pool_cond);
+	pthread_mutex_destroy(&sv->pool_lock);
+	free(sv->accept_time);
+	free(sv->listenfds);
+	free(sv->worker);
 	free(sv);
 }
@@ -3,6 +3,42 @@
 
 struct server;
 
+/* how connections are served */
+enum server_mode {
+	SERVER_THREADS,		/* a pool of worker threads, see server_init */
+	SERVER_EPOLL,		/* event loops, see server_event.h */
+	SERVER_REUSEPORT,	/* worker threads that accept connections on
+				 * their own sockets, see server_init */
+	SERVER_URING,		/* io_uring loops, see server_uring.h */
+};
+
+/* optional server features, set from command-line flags before server_init */
+struct server_options {
+	enum server_mode mode;
+	int zerocopy;		/* stream uncacheable files with sendfile */
+	char *csum_index;	/* sidecar index with precomputed checksums */
+	int idle_timeout;	/* seconds a persistent connection may idle,
+				 * 0 disables persistent connections */
+	int cache_policy;	/* cache eviction policy, see policy.h */
+	int cache_shards;	/* the cache is split in, see cache.h */
+	int pool_min;		/* with pool_max > 0, the number of worker */
+	int pool_max;		/* threads adapts to the load within these */
+	int codel_target;	/* if > 0, shed connections that are queued for
+				 * longer than this many ms, see codel.h */
+	int codel_interval;	/* ms */
+	int sched;		/* serve the smallest responses first, with
+				 * aging, rather than in arrival order */
+	int port;		/* with SERVER_REUSEPORT, where the workers
+				 * listen */
+	int io_threads;		/* with SERVER_EPOLL, if > 0, threads that read
+				 * files for cache misses, see server_event.c */
+	int watch;		/* invalidate cached files when they change,
+				 * see fswatch.h */
+	int hugepages;		/* back the cache with huge pages */
+};
+
+extern struct server_options server_opts;
+
 struct server *server_init(int nr_threads, int max_requests, 
 			   int max_cache_size);
 void server_request(struct server *sv, int connfd);
@@ -0,0 +1,741 @@
+/*
+ * server_uring.c: An io_uring front end for the web server.
+ *
+ * Like the epoll front end, a small number of loop threads share the
+ * listening socket, and each serves many connections. Rather than being told
+ * that a socket is ready and then making the system calls itself, a loop
+ * queues the operations (accepts, receives, file stats, opens, reads and
+ * closes, sends and socket closes) on its ring, and hands all of them to the
+ * kernel with a single io_uring_enter, which also waits for the next
+ * completions. A file miss is one stat, and then one linked chain of open,
+ * read, fadvise and close.
+ *
+ * Connection sockets, and the files being read for them, are fixed files:
+ * slot i of a loop's file table holds connection i's socket, and slot
+ * URING_CONNS + i the file it is reading, so the kernel doesn't look them
+ * up on every operation. Each connection's input buffer is registered with
+ * the ring, so receives don't map it either.
+ */
+
+#include <sys/eventfd.h>
+#include "common.h"
+#include "request.h"
+#include "cache.h"
+#include "server_thread.h"
+#include "server_uring.h"
+#include "stats.h"
+#include "http.h"
+#include "arena.h"
+#include "uring.h"
+#include "stat_cache.h"
+#include "fswatch.h"
+
+#define URING_CONNS 256		/* connections per loop */
+#define URING_ACCEPTS 8		/* accepts each loop keeps queued */
+#define URING_ENTRIES 1024	/* submission queue entries */
+#define URING_LISTEN (2 * URING_CONNS)	/* the listening socket's slot */
+
+/* what a completion is for. user_data is the connection's slot, shifted
+ * left by 8 bits, with one of these in the low bits. */
+enum uring_op {
+	OP_ACCEPT,
+	OP_RECV,
+	OP_TIMEOUT,	/* a receive's idle timeout */
+	OP_STATX,
+	OP_LOAD,	/* any step of the open, read, fadvise, close chain */
+	OP_READ,	/* the read in that chain */
+	OP_SEND,
+	OP_CLOSE,
+	OP_EXIT,	/* the exit eventfd became readable */
+	OP_CANCEL,
+};
+
+#define USER_DATA(slot, op) (((unsigned long)(slot) << 8) | (op))
+#define NO_SLOT URING_CONNS
+
+enum uconn_state {
+	UCONN_FREE,
+	UCONN_ACCEPTING,	/* waiting for a connection */
+	UCONN_READING,		/* reading the request head */
+	UCONN_STAT,		/* looking at the file */
+	UCONN_LOADING,		/* reading the file */
+	UCONN_SENDING,		/* sending the response */
+	UCONN_CLOSING,		/* waiting for its operations to finish */
+};
+
+struct uconn {
+	int slot;
+	enum uconn_state state;
+	int inflight;		/* operations the kernel hasn't completed */
+	struct http_buf in;	/* request head read so far, registered */
+	char out_buf[2 * MAXBUF];	/* the response header, or a complete
+					 * error response */
+	struct response_buf out;
+	struct request *rq;
+	struct arena arena;	/* the request's objects */
+	struct file_data *data;	/* file_data allocated for this request */
+	struct file_data *body;	/* file to send, NULL on errors */
+	CacheNode *entry;	/* pinned cache entry, if body is cached */
+	struct statx stx;
+	unsigned long stat_gen;	/* the stat cache's, before the statx */
+	int load_steps;		/* steps of the load chain still running */
+	int read_res;		/* what the read in the chain returned */
+	struct iovec iov[2];	/* what is left to send */
+	struct msghdr msg;
+	unsigned long send_start;	/* when the response was ready */
+	struct uconn *next_free;
+};
+
+struct uring_loop {
+	pthread_t thread;
+	struct uring ring;
+	struct uconn *conns;	/* URING_CONNS of them */
+	struct uconn *free;	/* list of free connection slots */
+	int nr_conns;		/* open connections */
+	int nr_accepting;	/* slots waiting for a connection */
+	int exiting;
+	struct __kernel_timespec idle;	/* the idle timeout */
+	long nr_requests;
+	struct uring_server *sv;
+};
+
+struct uring_server {
+	int nr_loops;
+	int listenfd;
+	int exitfd;		/* eventfd, stays readable once we are exiting */
+	Cache cache;
+	struct uring_loop *loops;
+	struct fswatch *watch;	/* with server_opts.watch */
+};
+
+static void uconn_start_response(struct uring_loop *loop, struct uconn *conn);
+static void uconn_cancel_recv(struct uring_loop *loop, struct uconn *conn);
+
+static struct io_uring_sqe *
+uconn_sqe(struct uring_loop *loop, struct uconn *conn, int op)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+
+	sqe->user_data = USER_DATA(conn ? conn->slot : NO_SLOT, op);
+	if (conn)
+		conn->inflight++;
+	return sqe;
+}
+
+/* keeps up to URING_ACCEPTS accepts queued, each into a free slot */
+static void
+uconn_accept(struct uring_loop *loop)
+{
+	struct io_uring_sqe *sqe;
+	struct uconn *conn;
+
+	while (!loop->exiting && loop->nr_accepting < URING_ACCEPTS &&
+	       loop->free) {
+		conn = loop->free;
+		loop->free = conn->next_free;
+		conn->state = UCONN_ACCEPTING;
+		loop->nr_accepting++;
+		sqe = uconn_sqe(loop, conn, OP_ACCEPT);
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->fd = URING_LISTEN;
+		sqe->flags = IOSQE_FIXED_FILE;
+		/* the new socket goes straight into the file table */
+		sqe->file_index = conn->slot + 1;
+	}
+}
+
+static void
+uconn_recv(struct uring_loop *loop, struct uconn *conn)
+{
+	struct io_uring_sqe *sqe;
+
+	conn->state = UCONN_READING;
+	/* the timeout is linked to the receive, so they go in together */
+	uring_reserve(&loop->ring, 2);
+	sqe = uconn_sqe(loop, conn, OP_RECV);
+	sqe->opcode = IORING_OP_READ_FIXED;
+	sqe->fd = conn->slot;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->addr = (unsigned long)(conn->in.data + conn->in.len);
+	sqe->len = HTTP_BUF_SIZE - conn->in.len;
+	sqe->off = -1;
+	sqe->buf_index = conn->slot;
+	if (server_opts.idle_timeout > 0) {
+		/* don't let an idle connection hold on to its slot forever */
+		sqe->flags |= IOSQE_IO_LINK;
+		sqe = uconn_sqe(loop, conn, OP_TIMEOUT);
+		sqe->opcode = IORING_OP_LINK_TIMEOUT;
+		sqe->addr = (unsigned long)&loop->idle;
+		sqe->len = 1;
+	}
+}
+
+/* lets go of the last request's response */
+static void
+uconn_end_request(struct uring_loop *loop, struct uconn *conn)
+{
+	if (conn->rq)
+		request_destroy(conn->rq);
+	if (conn->entry) {
+		/* the cache owns data once it has been inserted */
+		if (conn->entry->data == conn->data)
+			conn->data = NULL;
+		cache_release(&loop->sv->cache, conn->entry);
+	}
+	if (conn->data)
+		file_data_free(conn->data);
+	arena_reset(&conn->arena);
+	conn->rq = NULL;
+	conn->data = NULL;
+	conn->body = NULL;
+	conn->entry = NULL;
+	conn->out.len = 0;
+}
+
+static void
+uconn_close(struct uring_loop *loop, struct uconn *conn)
+{
+	struct io_uring_sqe *sqe;
+
+	conn->state = UCONN_CLOSING;
+	sqe = uconn_sqe(loop, conn, OP_CLOSE);
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->file_index = conn->slot + 1;
+}
+
+/* frees the slot of a closed connection, once the kernel is done with it */
+static void
+uconn_free(struct uring_loop *loop, struct uconn *conn)
+{
+	if (conn->state != UCONN_CLOSING || conn->inflight > 0)
+		return;
+	uconn_end_request(loop, conn);
+	conn->state = UCONN_FREE;
+	conn->next_free = loop->free;
+	loop->free = conn;
+	loop->nr_conns--;
+}
+
+/* sends what is left of the header, and the body if it is in memory */
+static void
+uconn_send(struct uring_loop *loop, struct uconn *conn)
+{
+	struct io_uring_sqe *sqe;
+
+	conn->state = UCONN_SENDING;
+	conn->msg.msg_iov = conn->iov[0].iov_len ? &conn->iov[0] :
+		&conn->iov[1];
+	conn->msg.msg_iovlen = conn->iov[0].iov_len ? 2 : 1;
+	sqe = uconn_sqe(loop, conn, OP_SEND);
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = conn->slot;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->addr = (unsigned long)&conn->msg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+}
+
+/* starts sending the response formatted into conn->out */
+static void
+uconn_start_send(struct uring_loop *loop, struct uconn *conn)
+{
+	conn->iov[0].iov_base = conn->out.buf;
+	conn->iov[0].iov_len = conn->out.len;
+	conn->iov[1].iov_base = conn->body ? conn->body->file_buf : NULL;
+	conn->iov[1].iov_len = conn->body ? conn->body->file_size : 0;
+	/* sending takes as long as the client takes to drain it */
+	conn->send_start = stats_now();
+	uconn_send(loop, conn);
+}
+
+static void
+uconn_sent(struct uring_loop *loop, struct uconn *conn, int res)
+{
+	int i, n;
+
+	if (res <= 0) { /* the client went away */
+		uconn_close(loop, conn);
+		return;
+	}
+	for (i = 0; i < 2; i++) {
+		n = res < conn->iov[i].iov_len ? res : conn->iov[i].iov_len;
+		conn->iov[i].iov_base += n;
+		conn->iov[i].iov_len -= n;
+		res -= n;
+	}
+	if (conn->iov[0].iov_len || conn->iov[1].iov_len) {
+		uconn_send(loop, conn);
+		return;
+	}
+	loop->nr_requests++;
+	if (conn->rq)
+		stats_time(PHASE_SEND, conn->send_start);
+	if (!conn->rq || !request_keepalive(conn->rq) || loop->exiting) {
+		uconn_close(loop, conn);
+		return;
+	}
+	/* the client may have pipelined its next request */
+	uconn_end_request(loop, conn);
+	http_buf_consume(&conn->in);
+	if (http_buf_head(&conn->in) > 0)
+		uconn_start_response(loop, conn);
+	else
+		uconn_recv(loop, conn);
+}
+
+/* formats the header of a response from a file in memory. on errors, the
+ * response is already in conn->out. */
+static void
+uconn_finish_response(struct uring_loop *loop, struct uconn *conn,
+		      int loaded)
+{
+	if (loaded)
+		request_sendfile(conn->rq);
+	uconn_start_send(loop, conn);
+}
+
+/* hands a file that has been read to the cache, and sends it. on errors,
+ * sends the error response instead. */
+static void
+uconn_loaded(struct uring_loop *loop, struct uconn *conn, int loaded)
+{
+	if (loaded) {
+		request_file_loaded(conn->rq);
+		/* the cache keeps a copy, if it has room for one */
+		conn->body = conn->data;
+		conn->entry = cache_insert(&loop->sv->cache, conn->data);
+	}
+	uconn_finish_response(loop, conn, loaded);
+}
+
+/* reads the file, now that stat says it can be. the file is opened into the
+ * connection's file slot, read into memory, dropped from the page cache,
+ * see request_readfile, and closed, by one chain of linked operations. */
+static void
+uconn_load(struct uring_loop *loop, struct uconn *conn)
+{
+	struct file_data *data = conn->data;
+	int file_slot = URING_CONNS + conn->slot;
+	struct io_uring_sqe *sqe;
+
+	conn->state = UCONN_LOADING;
+	data->file_buf = Malloc(data->file_size);
+	uring_reserve(&loop->ring, 4);
+	sqe = uconn_sqe(loop, conn, OP_LOAD);
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (unsigned long)data->file_name;
+	sqe->open_flags = O_RDONLY;
+	sqe->file_index = file_slot + 1;
+	sqe->flags = IOSQE_IO_LINK;
+	/* once the file is open, it is closed, however the read goes */
+	sqe = uconn_sqe(loop, conn, OP_READ);
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = file_slot;
+	sqe->addr = (unsigned long)data->file_buf;
+	sqe->len = data->file_size;
+	sqe->off = 0;
+	sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+	sqe = uconn_sqe(loop, conn, OP_LOAD);
+	sqe->opcode = IORING_OP_FADVISE;
+	sqe->fd = file_slot;
+	sqe->off = 0;
+	sqe->len = data->file_size;
+	sqe->fadvise_advice = POSIX_FADV_DONTNEED;
+	sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+	sqe = uconn_sqe(loop, conn, OP_LOAD);
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->file_index = file_slot + 1;
+	conn->load_steps = 4;
+	conn->read_res = -ECANCELED;
+}
+
+static void
+uconn_load_step(struct uring_loop *loop, struct uconn *conn, int op, int res)
+{
+	struct file_data *data = conn->data;
+
+	if (op == OP_READ)
+		conn->read_res = res;
+	/* the file slot is free for the next load once the close is done */
+	if (--conn->load_steps > 0)
+		return;
+	if (conn->read_res == data->file_size) {
+		uconn_loaded(loop, conn, 1);
+		return;
+	}
+	/* e.g., the file went away, or shrank, after the stat */
+	stat_cache_invalidate(data->file_name);
+	free(data->file_buf);
+	data->file_buf = NULL;
+	data->file_size = 0;
+	request_check_file(conn->rq, conn->read_res < 0 ? -conn->read_res :
+			   EIO, 0);
+	uconn_loaded(loop, conn, 0);
+}
+
+/* reads the file, given its metadata, or sends the error response */
+static void
+uconn_stat_known(struct uring_loop *loop, struct uconn *conn,
+		 unsigned int mode, off_t size)
+{
+	if (!request_check_file(conn->rq, 0, mode)) {
+		uconn_loaded(loop, conn, 0);
+		return;
+	}
+	/* without sendfile, files are always read into memory */
+	conn->data->file_size = size;
+	if (conn->data->file_size == 0)
+		uconn_loaded(loop, conn, 1);
+	else
+		uconn_load(loop, conn);
+}
+
+static void
+uconn_stat_done(struct uring_loop *loop, struct uconn *conn, int res)
+{
+	struct stat sbuf;
+
+	if (res < 0) {
+		request_check_file(conn->rq, -res, 0);
+		uconn_loaded(loop, conn, 0);
+		return;
+	}
+	/* the stat cache only needs what the server looks at */
+	memset(&sbuf, 0, sizeof(sbuf));
+	sbuf.st_mode = conn->stx.stx_mode;
+	sbuf.st_size = conn->stx.stx_size;
+	sbuf.st_mtim.tv_sec = conn->stx.stx_mtime.tv_sec;
+	sbuf.st_mtim.tv_nsec = conn->stx.stx_mtime.tv_nsec;
+	stat_cache_put(conn->data->file_name, &sbuf, conn->stat_gen);
+	uconn_stat_known(loop, conn, sbuf.st_mode, sbuf.st_size);
+}
+
+/* looks the file up, and sends it if it is cached, or starts reading it */
+static void
+uconn_start_response(struct uring_loop *loop, struct uconn *conn)
+{
+	Cache *cache = &loop->sv->cache;
+	struct io_uring_sqe *sqe;
+	struct request *rq;
+	struct stat sbuf;
+	unsigned long start;
+
+	conn->data = file_data_init(&conn->arena);
+	rq = request_init_buf(-1, &conn->in, conn->data, &conn->out);
+	conn->rq = rq;
+	if (!rq) { /* the error response is in conn->out */
+		uconn_start_send(loop, conn);
+		return;
+	}
+	request_set_keepalive(rq, server_opts.idle_timeout > 0 &&
+			      !loop->exiting);
+	if (request_status_page(rq)) {
+		char buf[MAXBUF];
+		int len = stats_report(buf, sizeof(buf), cache,
+				       request_status_page(rq));
+
+		request_sendbuf(rq, request_status_page(rq) == STATS_JSON ?
+				"application/json" : "text/plain", buf, len);
+		uconn_start_send(loop, conn);
+		return;
+	}
+
+	/* a loop never waits for another's miss on the same file, see
+	 * cache_lookup_load, since that miss may be its own, or that of a
+	 * loop that is waiting for it in turn. each reads the file. */
+	start = stats_now();
+	conn->entry = cache_lookup(cache, conn->data->file_name);
+	stats_time(PHASE_LOOKUP, start);
+	if (conn->entry) {
+		request_set_data(rq, conn->entry->data);
+		conn->body = conn->entry->data;
+		uconn_finish_response(loop, conn, 1);
+		return;
+	}
+	if (!request_check_name(rq)) {
+		uconn_loaded(loop, conn, 0);
+		return;
+	}
+	conn->data->cache_gen = cache_generation(cache, conn->data->file_name);
+	if (stat_cache_get(conn->data->file_name, &sbuf)) {
+		uconn_stat_known(loop, conn, sbuf.st_mode, sbuf.st_size);
+		return;
+	}
+	conn->state = UCONN_STAT;
+	conn->stat_gen = stat_cache_generation();
+	sqe = uconn_sqe(loop, conn, OP_STATX);
+	sqe->opcode = IORING_OP_STATX;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (unsigned long)conn->data->file_name;
+	sqe->len = STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME;
+	sqe->off = (unsigned long)&conn->stx;
+}
+
+static void
+uconn_open(struct uring_loop *loop, struct uconn *conn)
+{
+	loop->nr_conns++;
+	http_buf_init(&conn->in);
+	arena_init(&conn->arena);
+	conn->out.buf = conn->out_buf;
+	conn->out.size = sizeof(conn->out_buf);
+	conn->out.len = 0;
+	conn->rq = NULL;
+	conn->data = NULL;
+	conn->body = NULL;
+	conn->entry = NULL;
+	memset(&conn->msg, 0, sizeof(conn->msg));
+	uconn_recv(loop, conn);
+}
+
+static void
+uconn_accepted(struct uring_loop *loop, struct uconn *conn, int res)
+{
+	loop->nr_accepting--;
+	if (res >= 0) {
+		uconn_open(loop, conn);
+		/* too late, close it like the ones that are waiting for a
+		 * request, see loop_exit */
+		if (loop->exiting && conn->in.len == 0)
+			uconn_cancel_recv(loop, conn);
+		return;
+	}
+	/* e.g., canceled on exit, or out of file descriptors */
+	conn->state = UCONN_FREE;
+	conn->next_free = loop->free;
+	loop->free = conn;
+}
+
+static void
+uconn_received(struct uring_loop *loop, struct uconn *conn, int res)
+{
+	int ret;
+
+	/* EOF, error, timeout, or canceled on exit */
+	if (res <= 0) {
+		uconn_close(loop, conn);
+		return;
+	}
+	conn->in.len += res;
+	ret = http_buf_head(&conn->in);
+	if (ret < 0) /* request head is too long */
+		uconn_close(loop, conn);
+	else if (ret == 0)
+		uconn_recv(loop, conn);
+	else
+		uconn_start_response(loop, conn);
+}
+
+/* makes a connection's receive fail, and so closes the connection */
+static void
+uconn_cancel_recv(struct uring_loop *loop, struct uconn *conn)
+{
+	struct io_uring_sqe *sqe = uconn_sqe(loop, NULL, OP_CANCEL);
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = USER_DATA(conn->slot, OP_RECV);
+}
+
+static void
+loop_exit_poll(struct uring_loop *loop)
+{
+	struct io_uring_sqe *sqe = uconn_sqe(loop, NULL, OP_EXIT);
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = loop->sv->exitfd;
+	sqe->poll32_events = POLLIN;
+}
+
+/* stops accepting, and closes the connections waiting for a request */
+static void
+loop_exit(struct uring_loop *loop)
+{
+	struct io_uring_sqe *sqe;
+	int i;
+
+	loop->exiting = 1;
+	sqe = uconn_sqe(loop, NULL, OP_CANCEL);
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = URING_LISTEN;
+	sqe->cancel_flags = IORING_ASYNC_CANCEL_FD |
+		IORING_ASYNC_CANCEL_FD_FIXED | IORING_ASYNC_CANCEL_ALL;
+	for (i = 0; i < URING_CONNS; i++) {
+		struct uconn *conn = &loop->conns[i];
+
+		if (conn->state == UCONN_READING && conn->in.len == 0)
+			uconn_cancel_recv(loop, conn);
+	}
+}
+
+static void
+loop_complete(struct uring_loop *loop, unsigned long user_data, int res)
+{
+	int slot = user_data >> 8, op = user_data & 0xff;
+	struct uconn *conn;
+
+	if (slot == NO_SLOT) {
+		if (op == OP_EXIT)
+			loop_exit(loop);
+		return;
+	}
+	conn = &loop->conns[slot];
+	conn->inflight--;
+	if (conn->state == UCONN_CLOSING) {
+		/* e.g., the idle timeout of a receive that has finished */
+		uconn_free(loop, conn);
+		return;
+	}
+	switch (op) {
+	case OP_ACCEPT:
+		uconn_accepted(loop, conn, res);
+		break;
+	case OP_RECV:
+		uconn_received(loop, conn, res);
+		break;
+	case OP_STATX:
+		uconn_stat_done(loop, conn, res);
+		break;
+	case OP_LOAD:
+	case OP_READ:
+		uconn_load_step(loop, conn, op, res);
+		break;
+	case OP_SEND:
+		uconn_sent(loop, conn, res);
+		break;
+	}
+}
+
+static void *
+do_uring_loop(void *arg)
+{
+	struct uring_loop *loop = (struct uring_loop *)arg;
+	struct io_uring_cqe *cqe;
+	unsigned long user_data;
+	int res;
+
+	loop_exit_poll(loop);
+	/* on exit, stop accepting, and finish the open requests */
+	while (!loop->exiting || loop->nr_conns > 0 ||
+	       loop->nr_accepting > 0) {
+		uconn_accept(loop);
+		uring_submit(&loop->ring, 1);
+		while ((cqe = uring_peek_cqe(&loop->ring)) != NULL) {
+			user_data = cqe->user_data;
+			res = cqe->res;
+			uring_cqe_seen(&loop->ring);
+			loop_complete(loop, user_data, res);
+		}
+	}
+	return NULL;
+}
+
+/* entry point functions */
+
+struct uring_server *
+uring_server_init(int nr_loops, int max_cache_size, int listenfd)
+{
+	struct uring_server *sv;
+	struct iovec *bufs;
+	int *files;
+	int i, j;
+
+	sv = Malloc(sizeof(struct uring_server));
+	sv->nr_loops = (nr_loops > 0) ? nr_loops : 1;
+	sv->listenfd = listenfd;
+	SYS(sv->exitfd = eventfd(0, EFD_NONBLOCK));
+	cache_init_shards(&sv->cache, max_cache_size, server_opts.cache_policy,
+			  server_opts.cache_shards);
+	if (server_opts.hugepages)
+		SYS(cache_use_hugepages(&sv->cache));
+	sv->watch = server_opts.watch ? fswatch_init(".", &sv->cache) : NULL;
+
+	if (server_opts.idle_timeout > 0) {
+		/* the responses to pipelined requests are separate sends,
+		 * don't let one wait for the ack of the previous one. the
+		 * sockets are fixed files, without fds to setsockopt on, so
+		 * they inherit this from the listening socket instead. */
+		int one = 1;
+
+		SYS(setsockopt(listenfd, IPPROTO_TCP, TCP_NODELAY, &one,
+			       sizeof(one)));
+	}
+
+	files = Malloc(sizeof(int) * (URING_LISTEN + 1));
+	bufs = Malloc(sizeof(struct iovec) * URING_CONNS);
+	sv->loops = Malloc(sizeof(struct uring_loop) * sv->nr_loops);
+	for (i = 0; i < sv->nr_loops; i++) {
+		struct uring_loop *loop = &sv->loops[i];
+
+		loop->sv = sv;
+		loop->nr_conns = 0;
+		loop->nr_accepting = 0;
+		loop->exiting = 0;
+		loop->nr_requests = 0;
+		loop->idle.tv_sec = server_opts.idle_timeout;
+		loop->idle.tv_nsec = 0;
+		loop->conns = Malloc(sizeof(struct uconn) * URING_CONNS);
+		loop->free = NULL;
+		for (j = URING_CONNS - 1; j >= 0; j--) {
+			struct uconn *conn = &loop->conns[j];
+
+			conn->slot = j;
+			conn->state = UCONN_FREE;
+			conn->inflight = 0;
+			conn->next_free = loop->free;
+			loop->free = conn;
+			bufs[j].iov_base = conn->in.data;
+			bufs[j].iov_len = HTTP_BUF_SIZE;
+		}
+		uring_init(&loop->ring, URING_ENTRIES);
+		/* every slot starts out empty, except the listening socket's */
+		for (j = 0; j < URING_LISTEN; j++)
+			files[j] = -1;
+		files[URING_LISTEN] = listenfd;
+		SYS(uring_register(&loop->ring, IORING_REGISTER_FILES, files,
+				   URING_LISTEN + 1));
+		SYS(uring_register(&loop->ring, IORING_REGISTER_BUFFERS, bufs,
+				   URING_CONNS));
+	}
+	free(files);
+	free(bufs);
+	for (i = 0; i < sv->nr_loops; i++) {
+		SYS(pthread_create(&sv->loops[i].thread, NULL, do_uring_loop,
+				   &sv->loops[i]));
+	}
+	return sv;
+}
+
+void
+uring_server_exit(struct uring_server *sv)
+{
+	uint64_t one = 1;
+	long requests = 0, enters = 0, sqes = 0;
+	int i;
+
+	/* wakes up every loop, since we never read the eventfd */
+	SYS(write(sv->exitfd, &one, sizeof(one)));
+	for (i = 0; i < sv->nr_loops; i++) {
+		struct uring_loop *loop = &sv->loops[i];
+
+		pthread_join(loop->thread, NULL);
+		requests += loop->nr_requests;
+		enters += loop->ring.nr_enters;
+		sqes += loop->ring.nr_sqes;
+		uring_destroy(&loop->ring);
+		free(loop->conns);
+	}
+	SYS(close(sv->exitfd));
+	if (sv->watch)
+		fswatch_destroy(sv->watch);
+
+	printf("uring: requests = %ld, io_uring_enter calls = %ld, "
+	       "operations = %ld, per request = %.2f, %.2f\n", requests,
+	       enters, sqes, requests ? (double)enters / requests : 0,
+	       requests ? (double)sqes / requests : 0);
+	cache_print_stats(&sv->cache);
+	cache_destroy(&sv->cache);
+
+	free(sv->loops);
+	free(sv);
+}
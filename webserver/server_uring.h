@@ -0,0 +1,10 @@
+#ifndef __SERVER_URING_H__
+#define __SERVER_URING_H__
+
+struct uring_server;
+
+struct uring_server *uring_server_init(int nr_loops, int max_cache_size,
+				       int listenfd);
+void uring_server_exit(struct uring_server *sv);
+
+#endif /* __SERVER_URING_H__ */
@@ -0,0 +1,324 @@
+/*
+ * slab.c: The file cache's memory, one region carved into blocks.
+ */
+
+#include <stdint.h>
+#include "common.h"
+#include "slab.h"
+
+#define SLAB_ALIGN 16
+#define SLAB_HEADER 16		/* prev_size and size */
+#define SLAB_MIN_BLOCK 32	/* a free block holds its list links too */
+#define SLAB_SUB_BITS 2		/* 4 lists per power of 2 */
+#define SLAB_LISTS (64 << SLAB_SUB_BITS)
+#define SLAB_SCAN 16		/* blocks looked at in the list of the size
+				 * asked for, before taking a larger one */
+#define SLAB_RELEASE (64 * 1024)	/* free pages given back at a time */
+#define SLAB_HUGE_PAGE (2 * 1024 * 1024)
+
+/* flags in the low bits of size */
+#define SLAB_USED 1
+#define SLAB_PREV_USED 2
+#define SLAB_FLAGS (SLAB_USED | SLAB_PREV_USED)
+
+/* every block starts with prev_size and size. the links are only there
+ * while the block is free, and are the start of the caller's bytes
+ * otherwise. */
+struct slab_block {
+	size_t prev_size;	/* of the block before, only if it is free */
+	size_t size;		/* of the block, header included, | flags */
+	struct slab_block *next_free;
+	struct slab_block *prev_free;
+};
+
+struct slab {
+	pthread_mutex_t lock;
+	char *map;		/* what was mapped, see slab_init */
+	size_t map_size;
+	char *start;		/* the first block */
+	char *end;		/* a used block of size 0, after the last one */
+	struct slab_block *lists[SLAB_LISTS];	/* free blocks */
+	uint64_t nonempty[SLAB_LISTS / 64];	/* bit i: lists[i] != NULL */
+	long used;
+	long blocks;
+	long free_blocks;
+};
+
+static size_t
+block_size(struct slab_block *b)
+{
+	return b->size & ~(size_t)SLAB_FLAGS;
+}
+
+static struct slab_block *
+block_next(struct slab_block *b)
+{
+	return (struct slab_block *)((char *)b + block_size(b));
+}
+
+/* the list of free blocks of size. every block in list i is at least as
+ * large as every block in the lists below it. */
+static int
+list_index(size_t size)
+{
+	int msb = 63 - __builtin_clzl(size);
+
+	return (msb << SLAB_SUB_BITS) |
+		((size >> (msb - SLAB_SUB_BITS)) & ((1 << SLAB_SUB_BITS) - 1));
+}
+
+static void
+list_insert(struct slab *s, struct slab_block *b)
+{
+	int i = list_index(block_size(b));
+
+	b->prev_free = NULL;
+	b->next_free = s->lists[i];
+	if (b->next_free)
+		b->next_free->prev_free = b;
+	s->lists[i] = b;
+	s->nonempty[i / 64] |= 1UL << (i % 64);
+	s->free_blocks++;
+}
+
+static void
+list_remove(struct slab *s, struct slab_block *b)
+{
+	int i = list_index(block_size(b));
+
+	if (b->prev_free)
+		b->prev_free->next_free = b->next_free;
+	else
+		s->lists[i] = b->next_free;
+	if (b->next_free)
+		b->next_free->prev_free = b->prev_free;
+	if (!s->lists[i])
+		s->nonempty[i / 64] &= ~(1UL << (i % 64));
+	s->free_blocks--;
+}
+
+/* returns the first non-empty list from i on, or -1 */
+static int
+list_find(struct slab *s, int i)
+{
+	int w = i / 64;
+	uint64_t bits;
+
+	if (i >= SLAB_LISTS)
+		return -1;
+	bits = s->nonempty[w] & (~0UL << (i % 64));
+	while (!bits) {
+		if (++w == SLAB_LISTS / 64)
+			return -1;
+		bits = s->nonempty[w];
+	}
+	return w * 64 + __builtin_ctzl(bits);
+}
+
+/* makes b, of size bytes, a free block, after the block before it has been
+ * set up */
+static void
+block_set_free(struct slab *s, struct slab_block *b, size_t size)
+{
+	struct slab_block *next;
+
+	b->size = size | (b->size & SLAB_PREV_USED);
+	next = block_next(b);
+	next->prev_size = size;
+	next->size &= ~(size_t)SLAB_PREV_USED;
+	list_insert(s, b);
+}
+
+/* gives the whole pages inside free block b back to the kernel, if there
+ * are enough of them to be worth the page faults when they are used
+ * again */
+static void
+block_release(struct slab_block *b)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	uintptr_t from = ((uintptr_t)(b + 1) + page - 1) & ~(page - 1);
+	uintptr_t to = ((uintptr_t)b + block_size(b)) & ~(page - 1);
+
+	if (to > from && to - from >= SLAB_RELEASE)
+		SYS(madvise((void *)from, to - from, MADV_DONTNEED));
+}
+
+struct slab *
+slab_init(size_t size)
+{
+	struct slab *s = Malloc(sizeof(struct slab));
+	long page = sysconf(_SC_PAGESIZE);
+	struct slab_block *b, *fence;
+	size_t region;
+	uintptr_t start;
+
+	memset(s, 0, sizeof(struct slab));
+	pthread_mutex_init(&s->lock, NULL);
+	if (size == 0)
+		return s;
+	/* room for the fence, and aligned on a huge page, in case the
+	 * region is backed by them (see slab_use_hugepages). only the
+	 * pages that are used take up memory. */
+	region = (size + SLAB_HEADER + page - 1) & ~(page - 1);
+	s->map_size = region + SLAB_HUGE_PAGE;
+	s->map = mmap(NULL, s->map_size, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (s->map == MAP_FAILED)
+		SYS(-1);
+	start = ((uintptr_t)s->map + SLAB_HUGE_PAGE - 1) &
+		~(uintptr_t)(SLAB_HUGE_PAGE - 1);
+	s->start = (char *)start;
+	s->end = s->start + region - SLAB_HEADER;
+
+	fence = (struct slab_block *)s->end;
+	fence->size = SLAB_USED;
+	b = (struct slab_block *)s->start;
+	b->size = SLAB_PREV_USED;
+	block_set_free(s, b, s->end - s->start);
+	return s;
+}
+
+void
+slab_destroy(struct slab *s)
+{
+	if (s->map)
+		SYS(munmap(s->map, s->map_size));
+	pthread_mutex_destroy(&s->lock);
+	free(s);
+}
+
+int
+slab_use_hugepages(struct slab *s)
+{
+	if (!s->start)
+		return 0;
+	return madvise(s->start, s->end + SLAB_HEADER - s->start,
+		       MADV_HUGEPAGE);
+}
+
+size_t
+slab_block_size(size_t size)
+{
+	size += SLAB_HEADER;
+	size = (size + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+	return size < SLAB_MIN_BLOCK ? SLAB_MIN_BLOCK : size;
+}
+
+void *
+slab_alloc(struct slab *s, size_t size)
+{
+	size_t needed = slab_block_size(size), left;
+	struct slab_block *b = NULL, *rest;
+	int i, scan;
+
+	pthread_mutex_lock(&s->lock);
+	/* the blocks in the list of the size asked for may be too small,
+	 * the ones in the lists above it never are. a block from that list
+	 * leaves the least behind, so look there first. */
+	i = list_index(needed);
+	for (b = s->lists[i], scan = 0; b && scan < SLAB_SCAN;
+	     b = b->next_free, scan++) {
+		if (block_size(b) >= needed)
+			break;
+	}
+	if (!b || block_size(b) < needed) {
+		i = list_find(s, i + 1);
+		b = i >= 0 ? s->lists[i] : NULL;
+	}
+	if (!b) {
+		pthread_mutex_unlock(&s->lock);
+		return NULL;
+	}
+	list_remove(s, b);
+	left = block_size(b) - needed;
+	if (left >= SLAB_MIN_BLOCK) {
+		/* split off the rest, which stays free */
+		b->size = needed | (b->size & SLAB_PREV_USED);
+		rest = block_next(b);
+		rest->size = SLAB_PREV_USED;
+		block_set_free(s, rest, left);
+	} else {
+		needed = block_size(b);
+		block_next(b)->size |= SLAB_PREV_USED;
+	}
+	b->size |= SLAB_USED;
+	s->used += needed;
+	s->blocks++;
+	pthread_mutex_unlock(&s->lock);
+	return (char *)b + SLAB_HEADER;
+}
+
+void
+slab_free(struct slab *s, void *p)
+{
+	struct slab_block *b = (struct slab_block *)((char *)p - SLAB_HEADER);
+	struct slab_block *next, *prev;
+	size_t size;
+
+	pthread_mutex_lock(&s->lock);
+	assert(b->size & SLAB_USED);
+	size = block_size(b);
+	s->used -= size;
+	s->blocks--;
+	b->size &= ~(size_t)SLAB_USED;
+	/* merge with the free blocks on either side */
+	next = block_next(b);
+	if (!(next->size & SLAB_USED)) {
+		list_remove(s, next);
+		size += block_size(next);
+	}
+	if (!(b->size & SLAB_PREV_USED)) {
+		prev = (struct slab_block *)((char *)b - b->prev_size);
+		list_remove(s, prev);
+		size += block_size(prev);
+		b = prev;
+	}
+	block_set_free(s, b, size);
+	block_release(b);
+	pthread_mutex_unlock(&s->lock);
+}
+
+size_t
+slab_size(void *p)
+{
+	return block_size((struct slab_block *)((char *)p - SLAB_HEADER));
+}
+
+int
+slab_contains(struct slab *s, void *p)
+{
+	return (char *)p >= s->start && (char *)p < s->end;
+}
+
+void
+slab_get_stats(struct slab *s, struct slab_stats *st)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	struct slab_block *b;
+	unsigned char *vec;
+	long i, nr_pages;
+
+	memset(st, 0, sizeof(*st));
+	if (!s->start)
+		return;
+	st->size = s->end + SLAB_HEADER - s->start;
+	pthread_mutex_lock(&s->lock);
+	st->used = s->used;
+	st->blocks = s->blocks;
+	st->free_blocks = s->free_blocks;
+	/* the last non-empty list holds the largest block */
+	for (i = SLAB_LISTS - 1; i >= 0 && !s->lists[i]; i--)
+		;
+	for (b = i >= 0 ? s->lists[i] : NULL; b; b = b->next_free) {
+		if ((long)block_size(b) > st->largest_free)
+			st->largest_free = block_size(b);
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	nr_pages = st->size / page;
+	vec = Malloc(nr_pages);
+	SYS(mincore(s->start, st->size, vec));
+	for (i = 0; i < nr_pages; i++)
+		st->resident += (vec[i] & 1) * page;
+	free(vec);
+}
@@ -0,0 +1,54 @@
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include <stddef.h>
+
+/* The file cache's memory (see cache.h). The cache doesn't malloc its
+ * entries: each entry is one block, carved out of a single region that is
+ * mapped once, with the size of the cache's budget, so the memory that the
+ * cache holds is exactly what the blocks it charges for add up to.
+ *
+ * Free blocks are kept in lists by size class, four to each power of two, so
+ * a block that fits is found in O(1), and adjacent free blocks are merged as
+ * they are freed. The pages inside large free blocks are given back to the
+ * kernel, so that the region's resident memory follows what is in use.
+ *
+ * The region can't grow, so an allocation can fail even though the bytes
+ * are free, if no free block is large enough.
+ *
+ * All calls are thread-safe. */
+
+struct slab;
+
+struct slab_stats {
+	long size;	/* of the region */
+	long used;	/* bytes in allocated blocks, headers included */
+	long blocks;	/* allocated blocks */
+	long free_blocks;
+	long largest_free;	/* bytes in the largest free block */
+	long resident;	/* bytes of the region in memory */
+};
+
+/* maps a region of at least size bytes, which may be 0 */
+struct slab *slab_init(size_t size);
+void slab_destroy(struct slab *s);
+/* asks for the region to be backed by huge pages, returns 0 on success */
+int slab_use_hugepages(struct slab *s);
+
+/* returns the bytes that allocating size bytes takes up, i.e., what a
+ * cache entry of size bytes should be charged */
+size_t slab_block_size(size_t size);
+/* returns size bytes, aligned like malloc's, or NULL if no free block is
+ * large enough */
+void *slab_alloc(struct slab *s, size_t size);
+void slab_free(struct slab *s, void *p);
+/* returns the bytes that p takes up, which can be a little more than
+ * slab_block_size said, when what was left of the free block it came from
+ * was too small to keep */
+size_t slab_size(void *p);
+/* returns 1 if p was returned by slab_alloc */
+int slab_contains(struct slab *s, void *p);
+
+void slab_get_stats(struct slab *s, struct slab_stats *st);
+
+#endif /* __SLAB_H__ */
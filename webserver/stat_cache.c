@@ -0,0 +1,168 @@
+/*
+ * stat_cache.c: Remembers the metadata of files served by the web server.
+ */
+
+#include "common.h"
+#include "stat_cache.h"
+
+#define STAT_CACHE_SIZE 4096	/* number of hash buckets */
+#define STAT_CACHE_MAX 65536	/* entries, dropped all at once beyond this */
+
+struct stat_entry {
+	char *file_name;
+	struct stat sbuf;
+	struct stat_entry *next;
+};
+
+static struct stat_entry **stat_table;	/* NULL while the cache is off */
+static int stat_entries;
+static unsigned long stat_generation;	/* invalidations so far, atomic */
+static pthread_rwlock_t stat_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static unsigned int
+stat_cache_hash(const char *word)
+{
+	unsigned long hash = 5381;
+	int c;
+	while ((c = *word++))
+		hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+	return hash % STAT_CACHE_SIZE;
+}
+
+static struct stat_entry **
+stat_cache_find(const char *file_name, unsigned int k)
+{
+	struct stat_entry **pprev;
+
+	for (pprev = &stat_table[k]; *pprev; pprev = &(*pprev)->next) {
+		if (strcmp((*pprev)->file_name, file_name) == 0)
+			break;
+	}
+	return pprev;
+}
+
+/* must be called with stat_lock held for writing */
+static void
+stat_cache_clear(void)
+{
+	int i;
+	struct stat_entry *e, *next;
+
+	for (i = 0; i < STAT_CACHE_SIZE; i++) {
+		for (e = stat_table[i]; e; e = next) {
+			next = e->next;
+			free(e->file_name);
+			free(e);
+		}
+		stat_table[i] = NULL;
+	}
+	stat_entries = 0;
+}
+
+void
+stat_cache_init(void)
+{
+	stat_table = calloc(STAT_CACHE_SIZE, sizeof(struct stat_entry *));
+	assert(stat_table);
+	stat_entries = 0;
+}
+
+void
+stat_cache_destroy(void)
+{
+	if (!stat_table)
+		return;
+	stat_cache_clear();
+	free(stat_table);
+	stat_table = NULL;
+}
+
+int
+stat_cache_get(const char *file_name, struct stat *sbuf)
+{
+	struct stat_entry *e;
+
+	if (!stat_table)
+		return 0;
+	pthread_rwlock_rdlock(&stat_lock);
+	e = *stat_cache_find(file_name, stat_cache_hash(file_name));
+	if (e)
+		*sbuf = e->sbuf;
+	pthread_rwlock_unlock(&stat_lock);
+	return e != NULL;
+}
+
+unsigned long
+stat_cache_generation(void)
+{
+	return __atomic_load_n(&stat_generation, __ATOMIC_ACQUIRE);
+}
+
+void
+stat_cache_put(const char *file_name, const struct stat *sbuf,
+	       unsigned long generation)
+{
+	unsigned int k;
+	struct stat_entry *e;
+
+	if (!stat_table)
+		return;
+	k = stat_cache_hash(file_name);
+	pthread_rwlock_wrlock(&stat_lock);
+	if (generation != stat_generation) {
+		pthread_rwlock_unlock(&stat_lock);
+		return;
+	}
+	e = *stat_cache_find(file_name, k);
+	if (!e) {
+		/* the names come from clients, don't let them grow the cache
+		 * without bounds */
+		if (stat_entries >= STAT_CACHE_MAX)
+			stat_cache_clear();
+		e = Malloc(sizeof(struct stat_entry));
+		e->file_name = Malloc(strlen(file_name) + 1);
+		strcpy(e->file_name, file_name);
+		e->next = stat_table[k];
+		stat_table[k] = e;
+		stat_entries++;
+	}
+	e->sbuf = *sbuf;
+	pthread_rwlock_unlock(&stat_lock);
+}
+
+int
+stat_cache_stat(const char *file_name, struct stat *sbuf)
+{
+	unsigned long generation;
+
+	if (stat_cache_get(file_name, sbuf))
+		return 0;
+	generation = stat_cache_generation();
+	if (stat(file_name, sbuf) < 0)
+		return -1;
+	stat_cache_put(file_name, sbuf, generation);
+	return 0;
+}
+
+void
+stat_cache_invalidate(const char *file_name)
+{
+	struct stat_entry **pprev, *e;
+
+	if (!stat_table)
+		return;
+	pthread_rwlock_wrlock(&stat_lock);
+	__atomic_add_fetch(&stat_generation, 1, __ATOMIC_RELEASE);
+	if (!file_name) {
+		stat_cache_clear();
+	} else {
+		pprev = stat_cache_find(file_name, stat_cache_hash(file_name));
+		if ((e = *pprev)) {
+			*pprev = e->next;
+			free(e->file_name);
+			free(e);
+			stat_entries--;
+		}
+	}
+	pthread_rwlock_unlock(&stat_lock);
+}
@@ -0,0 +1,34 @@
+#ifndef __STAT_CACHE_H__
+#define __STAT_CACHE_H__
+
+#include <sys/stat.h>
+
+/* Cache of the metadata of files served by the web server, keyed by the
+ * file name used by the server (e.g., "./fileset_dir/00000"), so that a miss
+ * on a file that has been looked at before doesn't stat it again.
+ *
+ * The metadata is only valid as long as someone tells the cache when files
+ * change (see fswatch.h), so the cache is off until stat_cache_init. While
+ * it is off, lookups always miss, and stat_cache_stat is stat(2).
+ *
+ * Only successful stats are cached. A lookup that misses reads the
+ * generation first, and passes it to stat_cache_put, which drops the
+ * metadata if any file was invalidated in between, since it may be out of
+ * date already. */
+
+void stat_cache_init(void);
+void stat_cache_destroy(void);
+
+/* returns 1 after copying file_name's cached metadata to sbuf, or 0 */
+int stat_cache_get(const char *file_name, struct stat *sbuf);
+unsigned long stat_cache_generation(void);
+void stat_cache_put(const char *file_name, const struct stat *sbuf,
+		    unsigned long generation);
+
+/* like stat(2), from the cache if possible */
+int stat_cache_stat(const char *file_name, struct stat *sbuf);
+
+/* forgets file_name's metadata, or everything's if file_name is NULL */
+void stat_cache_invalidate(const char *file_name);
+
+#endif /* __STAT_CACHE_H__ */
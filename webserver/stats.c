@@ -0,0 +1,314 @@
+/*
+ * stats.c: Per-thread request latency histograms, and the status report.
+ */
+
+#include <stdarg.h>
+#include "common.h"
+#include "cache.h"
+#include "stats.h"
+
+#define HIST_SUB_BITS 5			/* 32 sub-buckets, ~3% error */
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40		/* up to ~18 minutes */
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 2) * HIST_SUB)
+
+/* only written by its thread. the counters are stored, rather than
+ * incremented, atomically, so that a report can read them while they are
+ * being updated */
+struct stats_hist {
+	long count;
+	long sum;	/* in ns */
+	long max;
+	long buckets[HIST_BUCKETS];
+};
+
+struct stats {
+	struct stats_hist hist[NR_PHASES];
+	long responses;
+	long bytes;
+	long shed;
+	struct stats *next;	/* list of all threads' stats */
+};
+
+static const char *phase_names[NR_PHASES] = {
+	"queue", "parse", "lookup", "read", "csum", "process", "send",
+};
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stats *stats_list;	/* protected by stats_lock */
+static unsigned long stats_start;	/* when the server started */
+static __thread struct stats *stats_self;
+
+/* values below HIST_SUB get a bucket each. above that, the highest set bit
+ * picks a power of two, and the next HIST_SUB_BITS bits a sub-bucket in it */
+static int
+hist_index(unsigned long v)
+{
+	int msb, shift;
+
+	if (v < HIST_SUB)
+		return v;
+	msb = 63 - __builtin_clzl(v);
+	if (msb > HIST_MAX_BITS) {
+		msb = HIST_MAX_BITS;
+		v = (2UL << HIST_MAX_BITS) - 1;
+	}
+	shift = msb - HIST_SUB_BITS;
+	return (shift + 1) * HIST_SUB + ((v >> shift) & (HIST_SUB - 1));
+}
+
+/* returns the middle of the range of values that land in bucket i */
+static double
+hist_value(int i)
+{
+	int shift;
+
+	if (i < HIST_SUB)
+		return i;
+	shift = i / HIST_SUB - 1;
+	return (double)((unsigned long)(HIST_SUB + i % HIST_SUB) << shift) +
+		((1UL << shift) - 1) / 2.0;
+}
+
+static void
+store(long *p, long v)
+{
+	__atomic_store_n(p, v, __ATOMIC_RELAXED);
+}
+
+static long
+load(long *p)
+{
+	return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+static void
+hist_record(struct stats_hist *h, unsigned long v)
+{
+	int i = hist_index(v);
+
+	store(&h->buckets[i], h->buckets[i] + 1);
+	store(&h->count, h->count + 1);
+	store(&h->sum, h->sum + v);
+	if (v > h->max)
+		store(&h->max, v);
+}
+
+/* returns the calling thread's stats, which are created on first use */
+static struct stats *
+stats_get(void)
+{
+	struct stats *s = stats_self;
+
+	if (s)
+		return s;
+	s = calloc(1, sizeof(struct stats));
+	assert(s);
+	pthread_mutex_lock(&stats_lock);
+	s->next = stats_list;
+	stats_list = s;
+	pthread_mutex_unlock(&stats_lock);
+	stats_self = s;
+	return s;
+}
+
+void
+stats_init(void)
+{
+	stats_start = stats_now();
+}
+
+void
+stats_destroy(void)
+{
+	struct stats *s, *next;
+
+	pthread_mutex_lock(&stats_lock);
+	for (s = stats_list; s; s = next) {
+		next = s->next;
+		free(s);
+	}
+	stats_list = NULL;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+unsigned long
+stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+unsigned long
+stats_time(int phase, unsigned long start)
+{
+	unsigned long now = stats_now();
+
+	assert(phase >= 0 && phase < NR_PHASES);
+	hist_record(&stats_get()->hist[phase], now > start ? now - start : 0);
+	return now;
+}
+
+void
+stats_response(long bytes)
+{
+	struct stats *s = stats_get();
+
+	store(&s->responses, s->responses + 1);
+	store(&s->bytes, s->bytes + bytes);
+}
+
+void
+stats_shed(void)
+{
+	struct stats *s = stats_get();
+
+	store(&s->shed, s->shed + 1);
+}
+
+/* a report being put together in a fixed-size buffer */
+struct report {
+	char *buf;
+	int size;
+	int len;
+};
+
+static void
+report_printf(struct report *r, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	if (r->len >= r->size - 1)
+		return;
+	va_start(ap, fmt);
+	n = vsnprintf(r->buf + r->len, r->size - r->len, fmt, ap);
+	va_end(ap);
+	r->len += n;
+	if (r->len > r->size - 1)
+		r->len = r->size - 1;
+}
+
+/* returns the value below which a fraction q of the values lie, in ns */
+static double
+hist_percentile(struct stats_hist *h, double q)
+{
+	long target = q * h->count, seen = 0;
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen > target)
+			break;
+	}
+	/* the middle of the last bucket may be past the largest value */
+	return i < HIST_BUCKETS && hist_value(i) < h->max ?
+		hist_value(i) : h->max;
+}
+
+static const double percentiles[] = { 0.5, 0.9, 0.99, 0.999 };
+static const char *percentile_names[] = { "p50", "p90", "p99", "p999" };
+#define NR_PERCENTILES 4
+
+int
+stats_report(char *buf, int size, Cache *c, int format)
+{
+	struct stats_hist *total;
+	struct stats *s;
+	struct cache_stats cs;
+	struct report r = { buf, size, 0 };
+	long responses = 0, bytes = 0, shed = 0;
+	int nr_threads = 0, i, j, json = (format == STATS_JSON);
+	double uptime = (stats_now() - stats_start) / 1e9;
+
+	/* merge the threads' histograms */
+	total = calloc(NR_PHASES, sizeof(struct stats_hist));
+	assert(total);
+	pthread_mutex_lock(&stats_lock);
+	for (s = stats_list; s; s = s->next) {
+		nr_threads++;
+		responses += load(&s->responses);
+		bytes += load(&s->bytes);
+		shed += load(&s->shed);
+		for (i = 0; i < NR_PHASES; i++) {
+			struct stats_hist *h = &s->hist[i];
+
+			total[i].count += load(&h->count);
+			total[i].sum += load(&h->sum);
+			if (load(&h->max) > total[i].max)
+				total[i].max = load(&h->max);
+			for (j = 0; j < HIST_BUCKETS; j++)
+				total[i].buckets[j] += load(&h->buckets[j]);
+		}
+	}
+	pthread_mutex_unlock(&stats_lock);
+	cache_get_stats(c, &cs);
+
+	if (json) {
+		report_printf(&r, "{\"uptime\": %.3f, \"threads\": %d, "
+			      "\"responses\": %ld, \"bytes\": %ld, "
+			      "\"shed\": %ld,\n",
+			      uptime, nr_threads, responses, bytes, shed);
+		report_printf(&r, " \"cache\": {\"hits\": %ld, \"misses\": %ld, "
+			      "\"hit_bytes\": %ld, \"miss_bytes\": %ld, "
+			      "\"evictions\": %ld, \"evicted_bytes\": %ld, "
+			      "\"coalesced\": %ld, \"invalidations\": %ld, "
+			      "\"entries\": %ld, "
+			      "\"size\": %ld, \"max_size\": %ld, "
+			      "\"resident\": %ld},\n",
+			      cs.hits, cs.misses, cs.hit_bytes, cs.miss_bytes,
+			      cs.evictions, cs.evicted_bytes, cs.coalesced,
+			      cs.invalidations, cs.entries, cs.size, cs.max_size,
+			      cs.resident);
+		report_printf(&r, " \"phases_us\": {");
+	} else {
+		report_printf(&r, "uptime: %.3f s, threads: %d\n"
+			      "responses: %ld, bytes: %ld, shed: %ld\n",
+			      uptime, nr_threads, responses, bytes, shed);
+		report_printf(&r, "cache: hits = %ld, misses = %ld, "
+			      "hit bytes = %ld, miss bytes = %ld, "
+			      "evictions = %ld, evicted bytes = %ld, "
+			      "coalesced = %ld, invalidations = %ld, "
+			      "entries = %ld, size = %ld, max size = %ld, "
+			      "resident = %ld\n",
+			      cs.hits, cs.misses, cs.hit_bytes, cs.miss_bytes,
+			      cs.evictions, cs.evicted_bytes, cs.coalesced,
+			      cs.invalidations, cs.entries, cs.size, cs.max_size,
+			      cs.resident);
+		report_printf(&r, "%-9s %10s %10s", "phase(us)", "count",
+			      "mean");
+		for (j = 0; j < NR_PERCENTILES; j++)
+			report_printf(&r, " %10s", percentile_names[j]);
+		report_printf(&r, " %10s\n", "max");
+	}
+	for (i = 0; i < NR_PHASES; i++) {
+		struct stats_hist *h = &total[i];
+		double mean = h->count ? (double)h->sum / h->count : 0.0;
+
+		if (json) {
+			report_printf(&r, "%s\n  \"%s\": {\"count\": %ld, "
+				      "\"mean\": %.1f", i ? "," : "",
+				      phase_names[i], h->count, mean / 1e3);
+			for (j = 0; j < NR_PERCENTILES; j++)
+				report_printf(&r, ", \"%s\": %.1f",
+					      percentile_names[j],
+					      hist_percentile(h, percentiles[j])
+					      / 1e3);
+			report_printf(&r, ", \"max\": %.1f}", h->max / 1e3);
+		} else {
+			report_printf(&r, "%-9s %10ld %10.1f", phase_names[i],
+				      h->count, mean / 1e3);
+			for (j = 0; j < NR_PERCENTILES; j++)
+				report_printf(&r, " %10.1f",
+					      hist_percentile(h, percentiles[j])
+					      / 1e3);
+			report_printf(&r, " %10.1f\n", h->max / 1e3);
+		}
+	}
+	if (json)
+		report_printf(&r, "}}\n");
+	free(total);
+	return r.len;
+}
@@ -0,0 +1,60 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+/* Request latency statistics, broken down by phase.
+ *
+ * Every thread that serves requests records into its own set of
+ * histograms, so recording never writes to memory shared with another
+ * thread. The histograms are HDR-style: each power of two of nanoseconds is
+ * split into linear sub-buckets, which bounds the relative error of every
+ * percentile. A report merges all the threads' histograms, reading them
+ * while they are being updated, so it is a close, not an exact, snapshot.
+ *
+ * The report is served from STATUS_URI (see request_status_page). */
+
+struct Cache;
+
+#define STATUS_URI "/server-status"
+
+enum stats_phase {
+	PHASE_QUEUE,	/* accepted connection waiting for a worker, in
+			 * threads mode */
+	PHASE_PARSE,	/* parsing the request head, once it has arrived */
+	PHASE_LOOKUP,	/* cache lookup, including waiting for another
+			 * thread's load of the same file */
+	PHASE_READ,	/* opening and reading the file */
+	PHASE_CSUM,	/* checksumming the file, once per read */
+	PHASE_PROCESS,	/* request_processfile */
+	PHASE_SEND,	/* sending the response. in epoll mode, until the
+			 * client has taken all of it */
+	NR_PHASES
+};
+
+/* report formats */
+enum stats_format {
+	STATS_TEXT = 1,
+	STATS_JSON,
+};
+
+void stats_init(void);
+void stats_destroy(void);
+
+/* returns the current time in nanoseconds, for timing a phase */
+unsigned long stats_now(void);
+
+/* records that the calling thread spent from start until now in phase, and
+ * returns now, which can start the next phase */
+unsigned long stats_time(int phase, unsigned long start);
+
+/* counts a response of the given number of bytes, header included */
+void stats_response(long bytes);
+
+/* counts a connection that was turned away because the server was
+ * overloaded, see codel.h */
+void stats_shed(void);
+
+/* formats a report of all threads' statistics, and of cache c, into buf.
+ * returns the length of the report, which is cut short to fit size. */
+int stats_report(char *buf, int size, struct Cache *c, int format);
+
+#endif /* __STATS_H__ */
@@ -0,0 +1,161 @@
+/*
+ * uring.c: io_uring without liburing.
+ */
+
+#include <sys/syscall.h>
+#include "common.h"
+#include "uring.h"
+
+static int
+io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+	       unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		       NULL, 0);
+}
+
+void
+uring_init(struct uring *r, unsigned entries)
+{
+	struct io_uring_params p;
+	unsigned *sq_array;
+	unsigned i;
+
+	memset(&p, 0, sizeof(p));
+	r->fd = io_uring_setup(entries, &p);
+	if (r->fd < 0) {
+		perror("io_uring_setup");
+		exit(1);
+	}
+	/* the kernels we need for the other features all map both rings
+	 * at once */
+	assert(p.features & IORING_FEAT_SINGLE_MMAP);
+	r->ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	if (r->ring_size < p.cq_off.cqes +
+	    p.cq_entries * sizeof(struct io_uring_cqe))
+		r->ring_size = p.cq_off.cqes +
+			p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sq_ring = mmap(NULL, r->ring_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	assert(r->sq_ring != MAP_FAILED);
+	r->cq_ring = r->sq_ring;
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	assert(r->sqes != MAP_FAILED);
+
+	r->sq_head = r->sq_ring + p.sq_off.head;
+	r->sq_tail = r->sq_ring + p.sq_off.tail;
+	r->sq_mask = *(unsigned *)(r->sq_ring + p.sq_off.ring_mask);
+	r->sq_queued = 0;
+	r->cq_head = r->cq_ring + p.cq_off.head;
+	r->cq_tail = r->cq_ring + p.cq_off.tail;
+	r->cq_mask = *(unsigned *)(r->cq_ring + p.cq_off.ring_mask);
+	r->cqes = r->cq_ring + p.cq_off.cqes;
+	/* sqe i always goes in slot i, so the array is filled in once */
+	sq_array = r->sq_ring + p.sq_off.array;
+	for (i = 0; i < p.sq_entries; i++)
+		sq_array[i] = i;
+	r->nr_enters = 0;
+	r->nr_sqes = 0;
+}
+
+void
+uring_destroy(struct uring *r)
+{
+	SYS(munmap(r->sqes, r->sqes_size));
+	SYS(munmap(r->sq_ring, r->ring_size));
+	SYS(close(r->fd));
+}
+
+int
+uring_register(struct uring *r, unsigned opcode, void *arg, unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, r->fd, opcode, arg, nr_args);
+}
+
+struct io_uring_sqe *
+uring_get_sqe(struct uring *r)
+{
+	unsigned head, tail = *r->sq_tail + r->sq_queued;
+	struct io_uring_sqe *sqe;
+
+	head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	if (tail - head > r->sq_mask) {
+		/* full. the kernel consumes them on submission. */
+		uring_submit(r, 0);
+		tail = *r->sq_tail;
+		head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+		assert(tail - head <= r->sq_mask);
+	}
+	sqe = &r->sqes[tail & r->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	r->sq_queued++;
+	return sqe;
+}
+
+void
+uring_reserve(struct uring *r, unsigned nr)
+{
+	unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+
+	assert(nr <= r->sq_mask + 1);
+	if (*r->sq_tail + r->sq_queued - head + nr > r->sq_mask + 1)
+		uring_submit(r, 0);
+}
+
+void
+uring_submit(struct uring *r, unsigned wait_nr)
+{
+	unsigned to_submit;
+	int ret;
+
+	/* the sqes must be filled in before the kernel sees the tail */
+	__atomic_store_n(r->sq_tail, *r->sq_tail + r->sq_queued,
+			 __ATOMIC_RELEASE);
+	r->sq_queued = 0;
+	/* including any that an earlier call didn't get to submit */
+	to_submit = *r->sq_tail -
+		__atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	if (to_submit == 0 && wait_nr == 0)
+		return;
+	while (1) {
+		r->nr_enters++;
+		ret = io_uring_enter(r->fd, to_submit, wait_nr,
+				     wait_nr ? IORING_ENTER_GETEVENTS : 0);
+		if (ret >= 0)
+			break;
+		/* EINTR while waiting, or EAGAIN/EBUSY while the
+		 * completion queue is too full to take more. either way,
+		 * the caller has completions to look at. */
+		if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			SYS(ret);
+		if (errno != EINTR || wait_nr == 0)
+			return;
+	}
+	/* on a bad sqe, the kernel stops there, and posts its error as a
+	 * completion. the rest are submitted next time. */
+	r->nr_sqes += ret;
+}
+
+struct io_uring_cqe *
+uring_peek_cqe(struct uring *r)
+{
+	unsigned head = *r->cq_head;
+
+	if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &r->cqes[head & r->cq_mask];
+}
+
+void
+uring_cqe_seen(struct uring *r)
+{
+	__atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,63 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+/* A thin wrapper around the io_uring system calls, so that we don't depend
+ * on liburing.
+ *
+ * Requests are queued by filling in submission queue entries (sqes), and are
+ * all handed to the kernel with one io_uring_enter, which can also wait for
+ * completions. Completions are read from the completion queue (cqes) without
+ * any system call. */
+
+#include <linux/io_uring.h>
+
+struct uring {
+	int fd;
+	/* submission queue, shared with the kernel */
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	struct io_uring_sqe *sqes;
+	unsigned sq_queued;	/* filled in, not yet passed to the kernel */
+	/* completion queue, shared with the kernel */
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+	/* the mappings. both rings are in one. */
+	void *sq_ring;
+	void *cq_ring;
+	size_t ring_size;
+	size_t sqes_size;
+	/* totals */
+	long nr_enters;		/* io_uring_enter calls */
+	long nr_sqes;		/* requests submitted */
+};
+
+/* sets up a ring with room for entries submissions at a time. exits if the
+ * kernel doesn't support io_uring. */
+void uring_init(struct uring *r, unsigned entries);
+void uring_destroy(struct uring *r);
+
+/* wraps io_uring_register, returns its result */
+int uring_register(struct uring *r, unsigned opcode, void *arg,
+		   unsigned nr_args);
+
+/* returns a cleared sqe to fill in, submitting the queued ones first if the
+ * submission queue is full */
+struct io_uring_sqe *uring_get_sqe(struct uring *r);
+
+/* makes sure that the next nr sqes are submitted together, e.g., a chain of
+ * linked ones, by submitting the queued ones first if they don't fit */
+void uring_reserve(struct uring *r, unsigned nr);
+
+/* submits the queued sqes, and waits until at least wait_nr completions
+ * are available */
+void uring_submit(struct uring *r, unsigned wait_nr);
+
+/* returns the oldest completion, or NULL if there is none. it stays in the
+ * queue until uring_cqe_seen. */
+struct io_uring_cqe *uring_peek_cqe(struct uring *r);
+void uring_cqe_seen(struct uring *r);
+
+#endif /* __URING_H__ */